@@ -0,0 +1,94 @@
+// helpers shared by the benchmarks: wall clock, run statistics, thread control and input generation
+#ifndef NAN_BENCH_H
+#define NAN_BENCH_H
+
+#include "../ellipse.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+static double now_seconds(void){
+#ifdef _WIN32
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts the n samples and reads off their median, p99 (nearest rank) and minimum
+static void summarize(double *samples, int n, double *median, double *p99, double *min){
+    qsort(samples, n, sizeof(double), compare_doubles);
+    int rank = (int)(0.99 * n + 0.999999);
+    *min = samples[0];
+    *median = n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    *p99 = samples[(rank < 1 ? 1 : rank) - 1];
+}
+
+static void set_threads(int threads){
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+#ifdef NAN_USE_OPENBLAS
+    openblas_set_num_threads(threads);
+#endif
+    (void)threads;
+}
+
+static int max_threads(void){
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// comma separated positive ints; returns how many were read or -1
+static int parse_list(const char *s, int *values, int max){
+    int count = 0;
+    while(*s && count < max){
+        char *end;
+        long v = strtol(s, &end, 10);
+        if(end == s || v <= 0) return -1;
+        values[count++] = (int)v;
+        s = *end == ',' ? end + 1 : end;
+        if(*end && *end != ',') return -1;
+    }
+    return count;
+}
+
+// fixed LCG so that every run sees the same inputs
+static unsigned bench_rng = 12345;
+
+static double uniform(double lo, double hi){
+    bench_rng = bench_rng * 1103515245u + 12345u;
+    return lo + (hi - lo) * ((bench_rng >> 8) / 16777216.0);
+}
+
+static Tensor * filled(DType dtype, int *dims, int ndim, double lo, double hi, bool requires_grad){
+    Tensor *t = tensor_nd(NULL, dtype, dims, ndim, dtype != INT && requires_grad);
+    if(!t) return NULL;
+    for(int i=0; i<t->size; i++){
+        switch(dtype){
+            case FLOAT32: t->data.float32[i] = (float)uniform(lo, hi); break;
+            case FLOAT64: t->data.float64[i] = uniform(lo, hi); break;
+            case INT: t->data.Int[i] = (int)uniform(lo, hi); break;
+        }
+    }
+    return t;
+}
+
+#endif
@@ -0,0 +1,448 @@
+// End-to-end benchmarks: training steps and inference passes of small models built on the public API.
+//
+//   gcc -O3 -fopenmp benchmarks/bench_models.c -lm -o bench_models
+//   ./bench_models --out base.csv                 # record a baseline
+//   ./bench_models --compare base.csv             # exit status 1 if any model got slower than --tolerance
+//
+// A training step is timed in three parts: forward (graph up to the loss), backward (grad_init + backward) and
+// the SGD update (which also zeroes the grads). Inference runs the forward with every parameter's requires_grad
+// off, so no grads are allocated and the graph is dropped with its root. Synthetic data is generated once, so
+// steps only differ in the parameter values.
+//
+// Peak RSS is the high-water mark of the whole process (getrusage), so it only describes a model on its own
+// when that model runs alone (--model name).
+
+#include "bench.h"
+
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+#define MAX_PARAMS 32
+#define CONV_OFFSETS 9 // taps of a 3x3 kernel
+
+typedef struct{
+    DType dtype;
+    int batch;
+    Tensor *params[MAX_PARAMS];
+    int num_params;
+    Tensor *x, *y;               // synthetic inputs and targets
+    Tensor *ids[2][CONV_OFFSETS]; // conv: the input row of every output pixel, per kernel tap and layer
+    Tensor *pool;                 // conv: [batch, batch * pixels] averaging matrix
+} Model;
+
+typedef struct{
+    const char *name;
+    int batch;
+    bool (*setup)(Model *m);
+    Tensor * (*forward)(Model *m, bool training); // output in inference, loss while training
+} ModelDef;
+
+static Tensor * param(Model *m, int *dims, int ndim, double scale){
+    Tensor *t = filled(m->dtype, dims, ndim, -scale, scale, true);
+    if(t && m->num_params < MAX_PARAMS) m->params[m->num_params++] = t;
+    return t;
+}
+
+static Tensor * ones_param(Model *m, int n){
+    Tensor *t = filled(m->dtype, (int []){n}, 1, 1, 1, true);
+    if(t && m->num_params < MAX_PARAMS) m->params[m->num_params++] = t;
+    return t;
+}
+
+// one-hot rows of `classes` columns
+static Tensor * one_hot(DType dtype, int rows, int classes){
+    Tensor *t = tensor_nd(NULL, dtype, (int []){rows, classes}, 2, false);
+    if(!t) return NULL;
+    for(int i=0; i<rows; i++){
+        int c = (int)uniform(0, classes) % classes;
+        if(dtype == FLOAT32) t->data.float32[(size_t)i * classes + c] = 1;
+        else t->data.float64[(size_t)i * classes + c] = 1;
+    }
+    return t;
+}
+
+// MLP 784 -> 512 -> 256 -> 10 with relu, MSE against one-hot targets
+#define MLP_IN 784
+#define MLP_HIDDEN1 512
+#define MLP_HIDDEN2 256
+#define MLP_CLASSES 10
+
+static bool mlp_setup(Model *m){
+    int widths[] = {MLP_IN, MLP_HIDDEN1, MLP_HIDDEN2, MLP_CLASSES};
+    for(int i=0; i<3; i++){
+        if(!param(m, (int []){widths[i], widths[i + 1]}, 2, 1 / sqrt(widths[i]))) return false;
+    }
+    m->x = filled(m->dtype, (int []){m->batch, MLP_IN}, 2, 0, 1, false);
+    m->y = one_hot(m->dtype, m->batch, MLP_CLASSES);
+    return m->x && m->y;
+}
+
+static Tensor * mlp_forward(Model *m, bool training){
+    Tensor *h = relu(matmul(m->x, m->params[0]));
+    h = relu(matmul(h, m->params[1]));
+    Tensor *out = matmul(h, m->params[2]);
+    return training ? MSELoss(m->y, out) : out;
+}
+
+// Conv net on 28x28 single channel images: two valid 3x3 convolutions (16 and 32 channels) with relu, global
+// average pooling and a linear classifier. Activations are channels-last pixel rows [batch * pixels, channels];
+// a convolution is the sum over its 9 taps of embedding(rows, ids of the tap) @ W[tap], i.e. im2col done by
+// gathers, one tap at a time.
+#define CONV_SIDE 28
+#define CONV_CH1 16
+#define CONV_CH2 32
+
+static Tensor * tap_ids(int batch, int in_side, int tap){
+    int out_side = in_side - 2, dy = tap / 3, dx = tap % 3;
+    Tensor *t = tensor_nd(NULL, INT, (int []){batch * out_side * out_side}, 1, false);
+    if(!t) return NULL;
+    int *ids = t->data.Int;
+    for(int b=0; b<batch; b++){
+        for(int y=0; y<out_side; y++){
+            for(int x=0; x<out_side; x++){
+                *ids++ = (b * in_side + y + dy) * in_side + x + dx;
+            }
+        }
+    }
+    return t;
+}
+
+static bool conv_setup(Model *m){
+    int channels[] = {1, CONV_CH1, CONV_CH2}, side = CONV_SIDE;
+    for(int layer=0; layer<2; layer++){
+        for(int tap=0; tap<CONV_OFFSETS; tap++){
+            if(!param(m, (int []){channels[layer], channels[layer + 1]}, 2, 1 / sqrt(9.0 * channels[layer]))) return false;
+            if(!(m->ids[layer][tap] = tap_ids(m->batch, side, tap))) return false;
+        }
+        side -= 2;
+    }
+    if(!param(m, (int []){CONV_CH2, MLP_CLASSES}, 2, 1 / sqrt(CONV_CH2))) return false;
+    int pixels = side * side;
+    m->pool = tensor_nd(NULL, m->dtype, (int []){m->batch, m->batch * pixels}, 2, false);
+    if(!m->pool) return false;
+    for(int b=0; b<m->batch; b++){
+        for(int p=0; p<pixels; p++){
+            size_t at = (size_t)b * m->batch * pixels + (size_t)b * pixels + p;
+            if(m->dtype == FLOAT32) m->pool->data.float32[at] = 1.0f / pixels;
+            else m->pool->data.float64[at] = 1.0 / pixels;
+        }
+    }
+    m->x = filled(m->dtype, (int []){m->batch * CONV_SIDE * CONV_SIDE, 1}, 2, 0, 1, false);
+    m->y = one_hot(m->dtype, m->batch, MLP_CLASSES);
+    return m->x && m->y;
+}
+
+static Tensor * conv_forward(Model *m, bool training){
+    Tensor *h = m->x;
+    for(int layer=0; layer<2; layer++){
+        Tensor *acc = NULL;
+        for(int tap=0; tap<CONV_OFFSETS; tap++){
+            Tensor *term = matmul(embedding(h, m->ids[layer][tap]), m->params[layer * CONV_OFFSETS + tap]);
+            acc = acc ? add(acc, term) : term;
+        }
+        h = relu(acc);
+    }
+    Tensor *out = matmul(matmul(m->pool, h), m->params[2 * CONV_OFFSETS]);
+    return training ? MSELoss(m->y, out) : out;
+}
+
+// Pre-norm transformer block on [batch, T, D]: causal multi-head attention (per-head projections, the heads'
+// outputs summed through their slice of W_o), then a GELU MLP with dropout, both residual. MSE against a
+// random target.
+#define TF_SEQ 64
+#define TF_DIM 128
+#define TF_HEADS 4
+#define TF_FF 512
+
+static bool transformer_setup(Model *m){
+    int dh = TF_DIM / TF_HEADS;
+    for(int h=0; h<TF_HEADS; h++){
+        for(int i=0; i<3; i++){
+            if(!param(m, (int []){TF_DIM, dh}, 2, 1 / sqrt(TF_DIM))) return false;
+        }
+        if(!param(m, (int []){dh, TF_DIM}, 2, 1 / sqrt(TF_DIM))) return false;
+    }
+    if(!ones_param(m, TF_DIM) || !param(m, (int []){TF_DIM}, 1, 0)) return false;
+    if(!ones_param(m, TF_DIM) || !param(m, (int []){TF_DIM}, 1, 0)) return false;
+    if(!param(m, (int []){TF_DIM, TF_FF}, 2, 1 / sqrt(TF_DIM))) return false;
+    if(!param(m, (int []){TF_FF, TF_DIM}, 2, 1 / sqrt(TF_FF))) return false;
+    m->x = filled(m->dtype, (int []){m->batch, TF_SEQ, TF_DIM}, 3, -1, 1, false);
+    m->y = filled(m->dtype, (int []){m->batch, TF_SEQ, TF_DIM}, 3, -1, 1, false);
+    return m->x && m->y;
+}
+
+static Tensor * transformer_forward(Model *m, bool training){
+    Tensor **p = m->params, **block = p + 4 * TF_HEADS; // g1, b1, g2, b2, W1, W2 follow the heads
+    Tensor *ln = layer_norm(m->x, block[0], block[1], 1e-5), *attn = NULL;
+    for(int h=0; h<TF_HEADS; h++){
+        Tensor **w = p + 4 * h;
+        Tensor *a = scaled_dot_product_attention(matmul(ln, w[0]), matmul(ln, w[1]), matmul(ln, w[2]), NULL, true);
+        Tensor *o = matmul(a, w[3]);
+        attn = attn ? add(attn, o) : o;
+    }
+    Tensor *x1 = add(m->x, attn);
+    Tensor *f = dropout(gelu(matmul(layer_norm(x1, block[2], block[3], 1e-5), block[4])), 0.1, training);
+    Tensor *out = add(x1, matmul(f, block[5]));
+    return training ? MSELoss(m->y, out) : out;
+}
+
+static const ModelDef models[] = {
+    {"mlp", 64, mlp_setup, mlp_forward},
+    {"conv", 16, conv_setup, conv_forward},
+    {"transformer", 8, transformer_setup, transformer_forward},
+};
+
+static void model_free(Model *m){
+    for(int i=0; i<m->num_params; i++) t_release(m->params[i]);
+    for(int l=0; l<2; l++){
+        for(int tap=0; tap<CONV_OFFSETS; tap++) t_release(m->ids[l][tap]);
+    }
+    t_release(m->x);
+    t_release(m->y);
+    t_release(m->pool);
+}
+
+// p -= lr * grad, and the grad starts over for the next step
+static void sgd_step(Model *m, double lr){
+    for(int i=0; i<m->num_params; i++){
+        Tensor *t = m->params[i];
+        int n = t->size;
+        if(t->dtype == FLOAT32){
+            float *w = t->data.float32, *g = t->grad.float32, step = (float)lr;
+            #pragma omp parallel for simd if(n > MATMUL_PARALLEL_MIN)
+            for(int k=0; k<n; k++){ w[k] -= step * g[k]; g[k] = 0; }
+        } else {
+            double *w = t->data.float64, *g = t->grad.float64;
+            #pragma omp parallel for simd if(n > MATMUL_PARALLEL_MIN)
+            for(int k=0; k<n; k++){ w[k] -= lr * g[k]; g[k] = 0; }
+        }
+    }
+}
+
+static long peak_rss_kb(void){
+#ifndef _WIN32
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0){
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+typedef struct{
+    char model[32], mode[16], dtype[16];
+    int threads, batch, steps;
+    double samples_per_sec, step_ms, p99_ms, forward_ms, backward_ms, optimizer_ms;
+    long peak_rss_kb;
+} ModelResult;
+
+typedef struct{
+    int warmup, steps;
+    double lr, tolerance;
+    DType dtype;
+    int threads[16], num_threads;
+    const char *filter, *out_path, *compare_path;
+    bool inference, training;
+} ModelConfig;
+
+// runs `steps` timed steps after `warmup` untimed ones; every part's median is taken on its own
+static bool run_model(const ModelDef *def, const ModelConfig *cfg, bool training, int threads, ModelResult *r){
+    Model m = {cfg->dtype, def->batch, {NULL}, 0, NULL, NULL, {{NULL}}, NULL};
+    if(!def->setup(&m)){
+        fprintf(stderr, "bench: could not build model %s\n", def->name);
+        model_free(&m);
+        return false;
+    }
+    for(int i=0; i<m.num_params; i++) m.params[i]->requires_grad = training;
+
+    double *samples = malloc(sizeof(double) * 4 * cfg->steps);
+    if(!samples){
+        model_free(&m);
+        return false;
+    }
+    double *fwd = samples, *bwd = samples + cfg->steps, *opt = samples + 2 * cfg->steps, *total = samples + 3 * cfg->steps;
+    bool ok = true;
+    for(int s=-cfg->warmup; s<cfg->steps && ok; s++){
+        double t0 = now_seconds();
+        Tensor *out = t_retain(def->forward(&m, training));
+        double t1 = now_seconds(), t2 = t1, t3 = t1;
+        if(!out){
+            ok = false;
+            break;
+        }
+        if(training){
+            grad_init(out);
+            backward(out);
+            t2 = now_seconds();
+            sgd_step(&m, cfg->lr);
+            t3 = now_seconds();
+        }
+        t_release(out);
+        if(s >= 0){
+            fwd[s] = t1 - t0;
+            bwd[s] = t2 - t1;
+            opt[s] = t3 - t2;
+            total[s] = t3 - t0;
+        }
+    }
+    for(int i=0; i<m.num_params; i++) m.params[i]->requires_grad = true;
+    model_free(&m);
+    if(!ok){
+        fprintf(stderr, "bench: forward of %s failed\n", def->name);
+        free(samples);
+        return false;
+    }
+
+    double median, p99, min;
+    snprintf(r->model, sizeof(r->model), "%s", def->name);
+    snprintf(r->mode, sizeof(r->mode), "%s", training ? "train" : "infer");
+    snprintf(r->dtype, sizeof(r->dtype), "%s", dtype_name(cfg->dtype));
+    r->threads = threads;
+    r->batch = def->batch;
+    r->steps = cfg->steps;
+    summarize(fwd, cfg->steps, &r->forward_ms, &p99, &min);
+    summarize(bwd, cfg->steps, &r->backward_ms, &p99, &min);
+    summarize(opt, cfg->steps, &r->optimizer_ms, &p99, &min);
+    summarize(total, cfg->steps, &median, &p99, &min);
+    r->samples_per_sec = def->batch / median;
+    r->step_ms = median * 1e3;
+    r->p99_ms = p99 * 1e3;
+    r->forward_ms *= 1e3;
+    r->backward_ms *= 1e3;
+    r->optimizer_ms *= 1e3;
+    r->peak_rss_kb = peak_rss_kb();
+    free(samples);
+    return true;
+}
+
+#define CSV_HEADER "model,mode,dtype,threads,batch,steps,cpu,samples_per_sec,step_ms,p99_ms,forward_ms,backward_ms,optimizer_ms,peak_rss_kb\n"
+
+static void write_csv(FILE *f, const ModelResult *r){
+    fprintf(f, "%s,%s,%s,%d,%d,%d,%s,%.3f,%.4f,%.4f,%.4f,%.4f,%.4f,%ld\n", r->model, r->mode, r->dtype, r->threads,
+            r->batch, r->steps, cpu_level_name(cpu_level()), r->samples_per_sec, r->step_ms, r->p99_ms, r->forward_ms,
+            r->backward_ms, r->optimizer_ms, r->peak_rss_kb);
+}
+
+// samples/sec of the baseline row with the same model, mode, dtype and threads, or -1
+static double baseline_throughput(const char *path, const ModelResult *r){
+    FILE *f = fopen(path, "r");
+    if(!f) return -1;
+    char line[512], model[32], mode[16], dtype[16];
+    int threads;
+    double throughput = -1, value;
+    while(fgets(line, sizeof(line), f)){
+        if(sscanf(line, "%31[^,],%15[^,],%15[^,],%d,%*d,%*d,%*[^,],%lf", model, mode, dtype, &threads, &value) != 5) continue;
+        if(!strcmp(model, r->model) && !strcmp(mode, r->mode) && !strcmp(dtype, r->dtype) && threads == r->threads){
+            throughput = value;
+        }
+    }
+    fclose(f);
+    return throughput;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --model name        only this model (mlp, conv, transformer)\n"
+            "  --mode m            train, infer or both (default both)\n"
+            "  --dtype name        float32 or float64 (default float32)\n"
+            "  --threads a,b,...   thread counts (default 1 and the OpenMP maximum)\n"
+            "  --warmup n          untimed steps (default 3)\n"
+            "  --steps n           timed steps (default 20)\n"
+            "  --out file          also write the results as CSV (a baseline for --compare)\n"
+            "  --compare file      compare samples/sec against a CSV written by --out\n"
+            "  --tolerance f       allowed slowdown before --compare fails (default 0.05)\n", prog);
+}
+
+int main(int argc, char **argv){
+    ModelConfig cfg = {3, 20, 1e-3, 0.05, FLOAT32, {1}, 1, NULL, NULL, NULL, true, true};
+    if(max_threads() > 1) cfg.threads[cfg.num_threads++] = max_threads();
+    for(int i=1; i<argc; i++){
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = true;
+        if(!strcmp(arg, "--help") || !val){ usage(argv[0]); return strcmp(arg, "--help") ? 1 : 0; }
+        if(!strcmp(arg, "--model")) cfg.filter = val;
+        else if(!strcmp(arg, "--mode")){
+            cfg.training = strcmp(val, "infer") != 0;
+            cfg.inference = strcmp(val, "train") != 0;
+            ok = !strcmp(val, "train") || !strcmp(val, "infer") || !strcmp(val, "both");
+        }
+        else if(!strcmp(arg, "--dtype")){
+            ok = !strcmp(val, "float32") || !strcmp(val, "float64");
+            cfg.dtype = !strcmp(val, "float64") ? FLOAT64 : FLOAT32;
+        }
+        else if(!strcmp(arg, "--threads")) ok = (cfg.num_threads = parse_list(val, cfg.threads, 16)) > 0;
+        else if(!strcmp(arg, "--warmup")) ok = (cfg.warmup = atoi(val)) >= 0;
+        else if(!strcmp(arg, "--steps")) ok = (cfg.steps = atoi(val)) > 0;
+        else if(!strcmp(arg, "--out")) cfg.out_path = val;
+        else if(!strcmp(arg, "--compare")) cfg.compare_path = val;
+        else if(!strcmp(arg, "--tolerance")) ok = (cfg.tolerance = atof(val)) >= 0;
+        else ok = false;
+        if(!ok){
+            fprintf(stderr, "bench: bad option %s %s\n", arg, val);
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    FILE *out = NULL;
+    if(cfg.out_path){
+        if(!(out = fopen(cfg.out_path, "w"))){
+            fprintf(stderr, "bench: cannot open %s\n", cfg.out_path);
+            return 1;
+        }
+        fputs(CSV_HEADER, out);
+    }
+    if(cfg.compare_path){
+        FILE *f = fopen(cfg.compare_path, "r");
+        if(!f){
+            fprintf(stderr, "bench: cannot open %s\n", cfg.compare_path);
+            return 1;
+        }
+        fclose(f);
+    }
+
+    printf("# kernels: %s, %s\n", cpu_level_name(cpu_level()), dtype_name(cfg.dtype));
+    printf("%-12s %-6s %4s %6s %12s %10s %10s %10s %10s %10s %10s%s\n", "model", "mode", "thr", "batch", "samples/s",
+           "step(ms)", "p99(ms)", "fwd(ms)", "bwd(ms)", "opt(ms)", "rss(MB)", cfg.compare_path ? "   vs base" : "");
+    int regressions = 0;
+    for(size_t d=0; d<sizeof(models) / sizeof(models[0]); d++){
+        if(cfg.filter && strcmp(cfg.filter, models[d].name)) continue;
+        for(int mode=0; mode<2; mode++){
+            bool training = mode == 0;
+            if(training ? !cfg.training : !cfg.inference) continue;
+            for(int th=0; th<cfg.num_threads; th++){
+                ModelResult r;
+                set_threads(cfg.threads[th]);
+                if(!run_model(&models[d], &cfg, training, cfg.threads[th], &r)) continue;
+                printf("%-12s %-6s %4d %6d %12.1f %10.3f %10.3f %10.3f %10.3f %10.3f %10.1f", r.model, r.mode,
+                       r.threads, r.batch, r.samples_per_sec, r.step_ms, r.p99_ms, r.forward_ms, r.backward_ms,
+                       r.optimizer_ms, r.peak_rss_kb / 1024.0);
+                if(cfg.compare_path){
+                    double base = baseline_throughput(cfg.compare_path, &r);
+                    if(base <= 0) printf("    (none)");
+                    else {
+                        double change = r.samples_per_sec / base - 1;
+                        bool slower = change < -cfg.tolerance;
+                        regressions += slower;
+                        printf("  %+7.1f%%%s", 100 * change, slower ? " SLOWER" : "");
+                    }
+                }
+                printf("\n");
+                fflush(stdout);
+                if(out) write_csv(out, &r);
+            }
+        }
+    }
+    if(out) fclose(out);
+    if(regressions){
+        fprintf(stderr, "bench: %d result(s) more than %.0f%% below the baseline\n", regressions, 100 * cfg.tolerance);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,333 @@
+// Micro-benchmarks for every op in op_table, forward and backward, over a size sweep, every dtype the op
+// supports and one or more thread counts.
+//
+//   gcc -O3 -fopenmp benchmarks/bench_ops.c -lm -o bench_ops
+//   ./bench_ops --sizes 64,256,1024 --threads 1,8 --format csv --out ops.csv
+//
+// Inputs and the output tensor are built once per case through op_apply; the timed region is the op's kernel
+// from op_table alone (no allocation, no graph bookkeeping), run `--warmup` times untimed and then at least
+// `--reps` times (and until `--min-time` seconds have passed, up to `--max-reps`). GFLOP/s uses the op's nominal
+// flop count and GB/s the bytes its inputs and outputs occupy, so both are comparable between runs rather than
+// exact hardware counters.
+
+#include "bench.h"
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_THREADS 16
+#define BENCH_HEADS 8 // heads of the attention cases
+#define BENCH_HEAD_DIM 64 // per-head width of the attention cases
+#define BENCH_SPARSE_DENSITY 0.01 // share of nonzeros in the sparse operand of sparse_matmul
+
+// how a case lays out its inputs for a given size n
+typedef enum{
+    SHAPE_BINARY,       // two [n, n]
+    SHAPE_UNARY,        // one [n, n]
+    SHAPE_ROWS,         // one [n, n], op over the last dim
+    SHAPE_MATMUL,       // [n, n] @ [n, n]
+    SHAPE_PACKED,       // [n, n] @ pack_weights([n, n])
+    SHAPE_SPARSE,       // sparse_from_dense([n, n], ~1% nonzero) @ [n, n]
+    SHAPE_ATTENTION,    // q, k, v [BENCH_HEADS, n, BENCH_HEAD_DIM], causal
+    SHAPE_ATTN_MASK,    // as above plus an additive [n, n] mask
+    SHAPE_NORM,         // x [n, n], weight [n] (and bias [n])
+    SHAPE_INDEX_SELECT, // t [n, n], n indices along dim 0
+    SHAPE_EMBEDDING,    // table [n, n], n ids
+    SHAPE_GATHER,       // t [n, n], index [n, n] along dim 1
+} BenchShape;
+
+typedef struct{
+    Op op;
+    BenchShape shape;
+    double extra;  // the op's scalar argument
+    bool positive; // inputs must stay away from zero and negatives (log, div)
+    const char *label; // reported name when the op's own name is ambiguous
+} BenchCase;
+
+static const BenchCase cases[] = {
+    {.op = ADD, .shape = SHAPE_BINARY},
+    {.op = SUB, .shape = SHAPE_BINARY},
+    {.op = MUL, .shape = SHAPE_BINARY},
+    {.op = DIV, .shape = SHAPE_BINARY, .positive = true},
+    {.op = POW, .shape = SHAPE_UNARY, .extra = 3},
+    {.op = EXP, .shape = SHAPE_UNARY},
+    {.op = LOG, .shape = SHAPE_UNARY, .positive = true},
+    {.op = RELU, .shape = SHAPE_UNARY},
+    {.op = LEAKY_RELU, .shape = SHAPE_UNARY, .extra = 0.01},
+    {.op = TANH, .shape = SHAPE_UNARY},
+    {.op = SIGMOID, .shape = SHAPE_UNARY},
+    {.op = GELU, .shape = SHAPE_UNARY},
+    {.op = DROPOUT, .shape = SHAPE_UNARY, .extra = 0.1},
+    {.op = SOFTMAX, .shape = SHAPE_ROWS, .extra = 1},
+    {.op = SUM, .shape = SHAPE_UNARY},
+    {.op = MEAN, .shape = SHAPE_UNARY},
+    {.op = MSE, .shape = SHAPE_BINARY},
+    {.op = MAE, .shape = SHAPE_BINARY},
+    {.op = LAYER_NORM, .shape = SHAPE_NORM, .extra = 1e-5},
+    {.op = RMS_NORM, .shape = SHAPE_NORM, .extra = 1e-5},
+    {.op = INDEX_SELECT, .shape = SHAPE_INDEX_SELECT},
+    {.op = EMBEDDING, .shape = SHAPE_EMBEDDING},
+    {.op = GATHER, .shape = SHAPE_GATHER, .extra = 1},
+    {.op = MATMUL, .shape = SHAPE_MATMUL},
+    {.op = MATMUL_PACKED, .shape = SHAPE_PACKED},
+    {.op = SPARSE_MATMUL, .shape = SHAPE_SPARSE},
+    {.op = ATTENTION, .shape = SHAPE_ATTENTION, .extra = 1},
+    {.op = ATTENTION_MASKED, .shape = SHAPE_ATTN_MASK, .label = "scaled_dot_product_attention_masked"},
+};
+
+typedef struct{
+    int warmup, reps, max_reps;
+    double min_time;
+    int sizes[BENCH_MAX_SIZES], num_sizes;
+    int threads[BENCH_MAX_THREADS], num_threads;
+    const char *filter; // substring of the op name, or NULL for all
+    const char *format; // "table", "csv" or "json"
+    bool forward_only;
+    bool dtypes[3];
+    FILE *out;
+} BenchConfig;
+
+typedef struct{
+    const char *op, *pass, *dtype;
+    int size, threads, reps;
+    double median, p99, min, gflops, gbps;
+} BenchResult;
+
+static Tensor * indices(int count, int limit){
+    Tensor *t = tensor_nd(NULL, INT, (int []){count}, 1, false);
+    if(!t) return NULL;
+    for(int i=0; i<count; i++) t->data.Int[i] = (int)uniform(0, limit) % limit;
+    return t;
+}
+
+// builds the inputs of case c at size n; returns how many there are, 0 on failure
+static int build_inputs(const BenchCase *c, DType dtype, int n, Tensor **in, double *flops){
+    double lo = c->positive ? 0.5 : -1, hi = c->positive ? 1.5 : 1;
+    if(dtype == INT){ lo = 1; hi = 8; }
+    double elems = (double)n * n;
+    int count = op_table[c->op].num_inputs;
+    *flops = elems;
+    switch(c->shape){
+        case SHAPE_BINARY:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            in[1] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            break;
+        case SHAPE_UNARY:
+        case SHAPE_ROWS:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            break;
+        case SHAPE_MATMUL:
+        case SHAPE_PACKED:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            in[1] = filled(dtype, (int []){n, n}, 2, lo, hi, c->shape == SHAPE_MATMUL);
+            if(c->shape == SHAPE_PACKED && in[1]){
+                Tensor *w = in[1];
+                in[1] = pack_weights(w);
+                t_release(w);
+            }
+            *flops = 2 * elems * n;
+            break;
+        case SHAPE_SPARSE: {
+            Tensor *dense = filled(dtype, (int []){n, n}, 2, lo, hi, false);
+            if(dense){
+                size_t bytes = dtype_size(dtype);
+                for(int i=0; i<dense->size; i++)
+                    if(uniform(0, 1) >= BENCH_SPARSE_DENSITY) memset((char *)dense->data.raw_data + i * bytes, 0, bytes);
+                in[0] = sparse_from_dense(dense);
+                t_release(dense);
+            }
+            in[1] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            // multiply-adds happen only for the stored entries
+            *flops = in[0] ? 2.0 * in[0]->size * n : 0;
+            break;
+        }
+        case SHAPE_ATTENTION:
+        case SHAPE_ATTN_MASK: {
+            int dims[] = {BENCH_HEADS, n, BENCH_HEAD_DIM};
+            for(int i=0; i<3; i++) in[i] = filled(dtype, dims, 3, lo, hi, true);
+            if(c->shape == SHAPE_ATTN_MASK) in[3] = filled(dtype, (int []){n, n}, 2, -1, 0, false);
+            *flops = 4.0 * BENCH_HEADS * elems * BENCH_HEAD_DIM;
+            break;
+        }
+        case SHAPE_NORM:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            for(int i=1; i<count; i++) in[i] = filled(dtype, (int []){n}, 1, lo, hi, true);
+            break;
+        case SHAPE_INDEX_SELECT:
+        case SHAPE_EMBEDDING:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            in[1] = indices(n, n);
+            break;
+        case SHAPE_GATHER:
+            in[0] = filled(dtype, (int []){n, n}, 2, lo, hi, true);
+            in[1] = indices(n * n, n);
+            if(in[1]){
+                Tensor *flat = in[1];
+                in[1] = tensor_nd(flat->data.Int, INT, (int []){n, n}, 2, false);
+                t_release(flat);
+            }
+            break;
+    }
+    for(int i=0; i<count; i++){
+        if(!in[i]){
+            for(int j=0; j<count; j++) if(in[j]) t_release(in[j]);
+            return 0;
+        }
+    }
+    return count;
+}
+
+static size_t dtype_bytes(DType dtype){
+    return dtype == FLOAT64 ? sizeof(double) : dtype == FLOAT32 ? sizeof(float) : sizeof(int);
+}
+
+// times kernel(out) and fills the timing fields of r
+static void time_kernel(void (*kernel)(Tensor *), Tensor *out, const BenchConfig *cfg, BenchResult *r){
+    for(int i=0; i<cfg->warmup; i++) kernel(out);
+    double *samples = malloc(sizeof(double) * cfg->max_reps);
+    if(!samples){
+        fprintf(stderr, "bench: out of memory\n");
+        return;
+    }
+    int reps = 0;
+    double start = now_seconds();
+    while(reps < cfg->max_reps && (reps < cfg->reps || now_seconds() - start < cfg->min_time)){
+        double t0 = now_seconds();
+        kernel(out);
+        samples[reps++] = now_seconds() - t0;
+    }
+    r->reps = reps;
+    summarize(samples, reps, &r->median, &r->p99, &r->min);
+    free(samples);
+}
+
+static void emit(const BenchConfig *cfg, const BenchResult *r, bool *first){
+    if(!strcmp(cfg->format, "csv")){
+        if(*first) fprintf(cfg->out, "op,pass,dtype,size,threads,cpu,reps,median_us,p99_us,min_us,gflops,gbps\n");
+        fprintf(cfg->out, "%s,%s,%s,%d,%d,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", r->op, r->pass, r->dtype, r->size,
+                r->threads, cpu_level_name(cpu_level()), r->reps, r->median * 1e6, r->p99 * 1e6, r->min * 1e6,
+                r->gflops, r->gbps);
+    } else if(!strcmp(cfg->format, "json")){
+        fprintf(cfg->out, "%s\n  {\"op\": \"%s\", \"pass\": \"%s\", \"dtype\": \"%s\", \"size\": %d, \"threads\": %d, "
+                "\"cpu\": \"%s\", \"reps\": %d, \"median_us\": %.3f, \"p99_us\": %.3f, \"min_us\": %.3f, "
+                "\"gflops\": %.3f, \"gbps\": %.3f}", *first ? "[" : ",", r->op, r->pass, r->dtype, r->size,
+                r->threads, cpu_level_name(cpu_level()), r->reps, r->median * 1e6, r->p99 * 1e6, r->min * 1e6,
+                r->gflops, r->gbps);
+    } else {
+        if(*first) fprintf(cfg->out, "%-36s %-8s %-8s %6s %4s %6s %12s %12s %10s %9s\n", "op", "pass", "dtype", "size",
+                           "thr", "reps", "median(us)", "p99(us)", "GFLOP/s", "GB/s");
+        fprintf(cfg->out, "%-36s %-8s %-8s %6d %4d %6d %12.2f %12.2f %10.2f %9.2f\n", r->op, r->pass, r->dtype, r->size,
+                r->threads, r->reps, r->median * 1e6, r->p99 * 1e6, r->gflops, r->gbps);
+    }
+    fflush(cfg->out);
+    *first = false;
+}
+
+static void run_case(const BenchCase *c, DType dtype, int n, int threads, const BenchConfig *cfg, bool *first){
+    const OpDesc *desc = &op_table[c->op];
+    Tensor *in[MAX_PREVS] = {NULL};
+    double flops;
+    int count = build_inputs(c, dtype, n, in, &flops);
+    if(!count) return;
+
+    Tensor *out = op_apply(c->op, in, c->extra);
+    if(out){
+        t_retain(out);
+        size_t bytes = out->size * dtype_bytes(dtype), grad_bytes = 0;
+        for(int i=0; i<count; i++){
+            bytes += in[i]->size * dtype_bytes(in[i]->dtype);
+            if(in[i]->requires_grad) grad_bytes += in[i]->size * dtype_bytes(dtype);
+        }
+        BenchResult r = {c->label ? c->label : desc->name, "forward", dtype_name(dtype), n, threads, 0, 0, 0, 0, 0, 0};
+        time_kernel(desc->forward[dtype], out, cfg, &r);
+        r.gflops = flops / r.median * 1e-9;
+        r.gbps = bytes / r.median * 1e-9;
+        emit(cfg, &r, first);
+
+        if(!cfg->forward_only && out->requires_grad && desc->backward[dtype]){
+            grad_init(out);
+            // the backward reads the output grad and inputs and updates every input grad
+            size_t bwd_bytes = bytes + 2 * grad_bytes;
+            r.pass = "backward";
+            time_kernel(desc->backward[dtype], out, cfg, &r);
+            // matmul and attention backwards do twice and 2.5 times the forward's work
+            double bwd_flops = flops * (c->shape == SHAPE_MATMUL ? 2 : c->shape >= SHAPE_ATTENTION &&
+                                        c->shape <= SHAPE_ATTN_MASK ? 2.5 : 1);
+            r.gflops = bwd_flops / r.median * 1e-9;
+            r.gbps = bwd_bytes / r.median * 1e-9;
+            emit(cfg, &r, first);
+        }
+        t_release(out);
+    }
+    for(int i=0; i<count; i++) t_release(in[i]);
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --sizes a,b,...     sizes n to sweep (default 64,256,1024)\n"
+            "  --threads a,b,...   thread counts (default 1 and the OpenMP maximum)\n"
+            "  --dtype name        float32, float64 or int (default all)\n"
+            "  --op name           only ops whose name contains this\n"
+            "  --warmup n          untimed runs per case (default 3)\n"
+            "  --reps n            minimum timed runs (default 10)\n"
+            "  --max-reps n        maximum timed runs (default 1000)\n"
+            "  --min-time s        keep timing until this many seconds passed (default 0.2)\n"
+            "  --forward-only      skip the backward kernels\n"
+            "  --format f          table, csv or json (default table)\n"
+            "  --out file          write results here instead of stdout\n", prog);
+}
+
+int main(int argc, char **argv){
+    BenchConfig cfg = {3, 10, 1000, 0.2, {64, 256, 1024}, 3, {1}, 1, NULL, "table", false, {true, true, true}, stdout};
+    if(max_threads() > 1) cfg.threads[cfg.num_threads++] = max_threads();
+    const char *out_path = NULL;
+    for(int i=1; i<argc; i++){
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = true;
+        if(!strcmp(arg, "--forward-only")){ cfg.forward_only = true; continue; }
+        if(!strcmp(arg, "--help") || !val){ usage(argv[0]); return strcmp(arg, "--help") ? 1 : 0; }
+        if(!strcmp(arg, "--sizes")) ok = (cfg.num_sizes = parse_list(val, cfg.sizes, BENCH_MAX_SIZES)) > 0;
+        else if(!strcmp(arg, "--threads")) ok = (cfg.num_threads = parse_list(val, cfg.threads, BENCH_MAX_THREADS)) > 0;
+        else if(!strcmp(arg, "--dtype")){
+            for(int d=0; d<3; d++) cfg.dtypes[d] = !strcmp(val, dtype_name((DType)d));
+            ok = cfg.dtypes[0] || cfg.dtypes[1] || cfg.dtypes[2];
+        }
+        else if(!strcmp(arg, "--op")) cfg.filter = val;
+        else if(!strcmp(arg, "--warmup")) ok = (cfg.warmup = atoi(val)) >= 0;
+        else if(!strcmp(arg, "--reps")) ok = (cfg.reps = atoi(val)) > 0;
+        else if(!strcmp(arg, "--max-reps")) ok = (cfg.max_reps = atoi(val)) > 0;
+        else if(!strcmp(arg, "--min-time")) ok = (cfg.min_time = atof(val)) >= 0;
+        else if(!strcmp(arg, "--format")) ok = !strcmp(cfg.format = val, "table") || !strcmp(val, "csv") || !strcmp(val, "json");
+        else if(!strcmp(arg, "--out")) out_path = val;
+        else ok = false;
+        if(!ok){
+            fprintf(stderr, "bench: bad option %s %s\n", arg, val);
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if(cfg.max_reps < cfg.reps) cfg.max_reps = cfg.reps;
+    if(out_path && !(cfg.out = fopen(out_path, "w"))){
+        fprintf(stderr, "bench: cannot open %s\n", out_path);
+        return 1;
+    }
+    if(!strcmp(cfg.format, "table")) fprintf(cfg.out, "# kernels: %s\n", cpu_level_name(cpu_level()));
+
+    bool first = true;
+    for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++){
+        const OpDesc *desc = &op_table[cases[c].op];
+        if(cfg.filter && !strstr(cases[c].label ? cases[c].label : desc->name, cfg.filter)) continue;
+        for(int d=0; d<3; d++){
+            if(!cfg.dtypes[d] || !desc->forward[d]) continue;
+            for(int s=0; s<cfg.num_sizes; s++){
+                for(int th=0; th<cfg.num_threads; th++){
+                    set_threads(cfg.threads[th]);
+                    run_case(&cases[c], (DType)d, cfg.sizes[s], cfg.threads[th], &cfg, &first);
+                }
+            }
+        }
+    }
+    if(!strcmp(cfg.format, "json")) fprintf(cfg.out, first ? "[]\n" : "\n]\n");
+    if(cfg.out != stdout) fclose(cfg.out);
+    return 0;
+}
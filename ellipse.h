@@ -7,7 +7,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
 #include <time.h>
+#include <locale.h>
 // #include <stdarg.h>
 #include <stdbool.h>
 
@@ -15,12 +17,50 @@
 #include <cblas.h>
 #endif
 
-#define MAX_PREVS 3
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// the data loader prefetches batches on POSIX threads and maps binary files; on Windows batches are assembled on
+// the calling thread and files are read into memory
+#ifndef LOADER_THREADS
+#ifdef _WIN32
+#define LOADER_THREADS 0
+#else
+#define LOADER_THREADS 1
+#endif
+#endif
+#if LOADER_THREADS
+#include <pthread.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#define MAX_PREVS 4
+#define MAX_DIMS 8
 #define BLOCK_SIZE 128
+#define MATMUL_ROW_BLOCK 32
+#define MATMUL_MICRO_ROWS 8         // rows of A per register tile of the matmul kernel
+#define PACK_COLS 16                // columns of B per packed panel
+#define MATMUL_PARALLEL_MIN 32768   // multiply-adds below which a matmul (or attention) stays on the calling thread
+#define MATMUL_SKINNY_ROWS 8        // matmuls with at most this many rows skip packing (GEMV path)
+#define SKINNY_COLS 256             // columns of C per chunk of the GEMV path, kept in L1 while B streams past
+#define ATTN_BLOCK_Q 32             // query rows per attention tile
+#define ATTN_BLOCK_K 64             // keys per attention tile
+#define ATTN_TRANSPOSE_ROWS 4       // query rows from which a key block is transposed for the score loop
+#define NORM_COL_BLOCK 256          // columns of the weight/bias grads owned by one thread in the norm backward
+#define SCATTER_COL_BLOCK 256       // columns of a looked-up row owned by one thread in the index_select backward
+#define GRAD_LOCKS 64               // striped locks guarding grad accumulation during parallel backward
+#define BACKWARD_TASK_MIN_SIZE 4096 // ready nodes from this size on count as branches worth a task of their own
+#define CSV_CHUNK_BYTES 1048576     // bytes of text per chunk that csv_load() parses as one task
+#define SPARSE_ROW_CHUNK 16         // rows (or columns) of a sparse matrix per task of sparse_matmul()
 
 struct Tensor *transpose(struct Tensor *self);
 struct Tensor *reshape(struct Tensor *self, int *shape); 
 struct Tensor *flatten(struct Tensor *self);
+void t_release(struct Tensor *t);
+void checkpoint_backward(struct Tensor *out);
 
 typedef union
 {
@@ -59,7 +99,20 @@ typedef enum{
     EXP,
     MSE,
     MAE,
-    LOG
+    LOG,
+    GELU,
+    MATMUL_PACKED,
+    SPARSE_MATMUL,
+    ATTENTION,
+    ATTENTION_MASKED,
+    LAYER_NORM,
+    RMS_NORM,
+    INDEX_SELECT,
+    EMBEDDING,
+    GATHER,
+    DROPOUT,
+    CHECKPOINT,
+    NUM_OPS
 }Op;
 
 // typedef enum{
@@ -82,6 +135,10 @@ typedef struct Tensor{
     struct Tensor *(*T)(struct Tensor *self);
     struct Tensor *(*reshape)(struct Tensor *self, int *shape);
     struct Tensor *(*flatten)(struct Tensor *self);
+    void *saved;        // op specific state kept for backward, freed with the tensor
+    int ref_count;      // references held by the caller and by consumer nodes in the graph
+    unsigned int visit; // traversal mark used by backward()
+    int pending;        // consumers whose backward has not run yet (backward scheduler)
 }Tensor;
 
 static size_t dtype_size(DType dtype){
@@ -108,10 +165,161 @@ static int *copy_dims(const int *dims, int ndim){
     return new_dims;
 }
 
+// 64-byte aligned buffer; aligned_alloc requires the size to be a multiple of the alignment
+static void *data_alloc(size_t bytes){
+    size_t rounded = (bytes + 63) & ~(size_t)63;
+    return aligned_alloc(64, rounded ? rounded : 64);
+}
+
+// memory tracking
+// Opt-in: between memory_track_start() and memory_track_stop() every tensor that is created is recorded with its
+// bytes (struct, dims, data and grad) and the op that produced it, until t_free() drops it. Live counts are kept
+// per dtype and per op, with a high-water mark for the whole run and one per step (memory_step()). Buffers an op
+// keeps in t->saved and kernel scratch are not counted. While tracking is off, creating or freeing a tensor costs
+// one branch.
+typedef struct{
+    Tensor *t;
+    size_t bytes;
+    int op;             // NUM_OPS until an op claims the tensor: made by tensor() and friends
+    int step;
+    unsigned long seq;  // creation order
+} MemRecord;
+
+static bool memory_on = false;
+static MemRecord *mem_table = NULL; // open addressing on the tensor's address, linear probing
+static size_t mem_cap = 0, mem_count = 0;
+static unsigned long mem_seq = 0;
+static int mem_step = 0;
+static size_t mem_live_bytes = 0, mem_peak = 0, mem_step_peak = 0;
+static size_t mem_dtype_count[3], mem_dtype_bytes[3];
+static size_t mem_op_count[NUM_OPS + 1], mem_op_bytes[NUM_OPS + 1];
+static size_t *mem_step_peaks = NULL; // high-water mark of every finished step
+static int mem_steps_cap = 0;
+
+static size_t mem_slot(const Tensor *t, size_t cap){
+    return (size_t)(((uintptr_t)t >> 4) * 0x9e3779b97f4a7c15ULL >> 17) & (cap - 1);
+}
+
+static bool mem_grow(void){
+    size_t cap = mem_cap ? mem_cap * 2 : 1024;
+    MemRecord *table = (MemRecord *)calloc(cap, sizeof(MemRecord));
+    if(!table) return false;
+    for(size_t i=0; i<mem_cap; i++){
+        if(!mem_table[i].t) continue;
+        size_t s = mem_slot(mem_table[i].t, cap);
+        while(table[s].t) s = (s + 1) & (cap - 1);
+        table[s] = mem_table[i];
+    }
+    free(mem_table);
+    mem_table = table;
+    mem_cap = cap;
+    return true;
+}
+
+static MemRecord *mem_find(const Tensor *t){
+    if(!mem_cap) return NULL;
+    for(size_t s = mem_slot(t, mem_cap); mem_table[s].t; s = (s + 1) & (mem_cap - 1)){
+        if(mem_table[s].t == t) return &mem_table[s];
+    }
+    return NULL;
+}
+
+static void mem_account(const MemRecord *r, bool add){
+    DType dtype = r->t->dtype;
+    if(add){
+        mem_dtype_count[dtype]++;
+        mem_dtype_bytes[dtype] += r->bytes;
+        mem_op_count[r->op]++;
+        mem_op_bytes[r->op] += r->bytes;
+        mem_live_bytes += r->bytes;
+        if(mem_live_bytes > mem_peak) mem_peak = mem_live_bytes;
+        if(mem_live_bytes > mem_step_peak) mem_step_peak = mem_live_bytes;
+    } else {
+        mem_dtype_count[dtype]--;
+        mem_dtype_bytes[dtype] -= r->bytes;
+        mem_op_count[r->op]--;
+        mem_op_bytes[r->op] -= r->bytes;
+        mem_live_bytes -= r->bytes;
+    }
+}
+
+// called once t has its data and grad
+static void memory_track(Tensor *t){
+    #pragma omp critical(nan_memory)
+    {
+        if(2 * (mem_count + 1) <= mem_cap || mem_grow()){
+            size_t s = mem_slot(t, mem_cap);
+            while(mem_table[s].t) s = (s + 1) & (mem_cap - 1);
+            MemRecord *r = &mem_table[s];
+            r->t = t;
+            r->bytes = sizeof(Tensor) + t->ndim * sizeof(int) + t->size * dtype_size(t->dtype);
+            if(t->dtype != INT && t->grad.float64) r->bytes += t->size * dtype_size(t->dtype);
+            r->op = NUM_OPS;
+            r->step = mem_step;
+            r->seq = mem_seq++;
+            mem_count++;
+            mem_account(r, true);
+        }
+    }
+}
+
+// moves t from the constructors' bucket to the op that produced it
+static void memory_tag(Tensor *t, Op op){
+    #pragma omp critical(nan_memory)
+    {
+        MemRecord *r = mem_find(t);
+        if(r){
+            mem_account(r, false);
+            r->op = op;
+            mem_account(r, true);
+        }
+    }
+}
+
+static void memory_untrack(Tensor *t){
+    #pragma omp critical(nan_memory)
+    {
+        MemRecord *r = mem_find(t);
+        if(r){
+            mem_account(r, false);
+            mem_count--;
+            // backward-shift deletion keeps every probe chain unbroken
+            size_t hole = (size_t)(r - mem_table), s = hole;
+            for(;;){
+                s = (s + 1) & (mem_cap - 1);
+                if(!mem_table[s].t) break;
+                size_t home = mem_slot(mem_table[s].t, mem_cap);
+                if(((s - home) & (mem_cap - 1)) >= ((s - hole) & (mem_cap - 1))){
+                    mem_table[hole] = mem_table[s];
+                    hole = s;
+                }
+            }
+            mem_table[hole].t = NULL;
+        }
+    }
+}
+
 //Memory Management
+/*
+Ownership model:
+    - tensor() (and every creation function built on it) returns a tensor holding one reference owned by the caller.
+    - op results (add, matmul, relu, ...) are returned unowned (ref_count == 0). The first op that consumes
+      them takes a reference, so chained calls like relu(matmul(x, w)) do not leak the inner result.
+    - every graph node holds one reference to each tensor in its prevs[].
+    - t_release() drops one reference and frees the tensor (and releases its prevs) once nothing refers to it.
+      Calling t_release() on the root of a graph (e.g. the loss) frees every intermediate that only the graph kept alive.
+    - t_retain() keeps an intermediate alive past the release of the graph that produced it.
+*/
 void t_free(Tensor* t){
     if(t == NULL)return;
+    if(memory_on) memory_untrack(t);
 
+    for(int i=0; i<t->num_prevs; i++){
+        t_release(t->prevs[i]);
+    }
+    t->num_prevs = 0;
+
+    if(t->saved) free(t->saved);
     if(t->dims) free(t->dims);
 
     switch (t->dtype)
@@ -133,6 +341,22 @@ void t_free(Tensor* t){
     free(t);
 }
 
+// reference counts are updated atomically: backward() may release nodes from several threads
+Tensor * t_retain(Tensor *t){
+    if(!t) return NULL;
+    #pragma omp atomic
+    t->ref_count++;
+    return t;
+}
+
+void t_release(Tensor *t){
+    if(t == NULL) return;
+    int remaining;
+    #pragma omp atomic capture
+    remaining = --t->ref_count;
+    if(remaining <= 0) t_free(t);
+}
+
 static int T_index(int index, int rows, int cols){
     int row = index / cols;
     int col = index % cols;
@@ -181,7 +405,9 @@ static void grad_mem_init(Tensor * self){
     }
 }
 
-Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
+Tensor * tensor_nd(void * data, DType dtype, int * dims, int ndim, bool requires_grad){
+    if(!dims || ndim <= 0) return NULL;
+
     //allocate memory for the tensor structure
     Tensor *t = (Tensor *)malloc(sizeof(Tensor));
     if(!t){
@@ -189,17 +415,22 @@ Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
         return NULL;
     }
     t->dtype = dtype;
-    t->ndim = sizeof(dims)/sizeof(int);
+    t->ndim = ndim;
     t->size = total_size(dims, t->ndim);
     t->extra = 0;
     t->requires_grad = requires_grad;
     t->op = -1;
     t->num_prevs = 0;
+    t->data.raw_data = NULL;
+    t->grad.float64 = NULL;
+    t->dims = NULL;
+    t->saved = NULL;
+    t->ref_count = 1;
+    t->visit = 0;
+    t->pending = 0;
     t->T=transpose;
     t->reshape = reshape;
     t->flatten = flatten;
-    
-    if(!dims || t->ndim <= 0) return NULL;
 
     t->dims = copy_dims(dims, t->ndim);
     if(!t->dims){
@@ -210,7 +441,7 @@ Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
 
     switch(dtype){
         case FLOAT32:
-            t->data.float32 = (float*) aligned_alloc(64, t->size * sizeof(float));
+            t->data.float32 = (float*) data_alloc(t->size * sizeof(float));
             if(!t->data.float32){
                 fprintf(stderr, "Memory allocation for data failed\n");
                 t_free(t);
@@ -222,7 +453,7 @@ Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
             grad_mem_init(t);
             break;
         case FLOAT64:
-            t->data.float64 = (double*) alligned_alloc(64, t->size * sizeof(double));
+            t->data.float64 = (double*) data_alloc(t->size * sizeof(double));
             if(!t->data.float64){
                 fprintf(stderr, "Memory allocation for data failed\n");
                 t_free(t);
@@ -246,12 +477,29 @@ Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
             break;
         default:
             fprintf(stderr, "Unsupported data type\n");
-            // t_free(t);
+            t_free(t);
             return NULL;
     }
+    if(memory_on) memory_track(t);
     return t;
 }
 
+Tensor * tensor(void * data, DType dtype, int * dims,  bool requires_grad){
+    return tensor_nd(data, dtype, dims, 2, requires_grad);
+}
+
+// records `t` as the result of `op` applied to `prevs`. The node takes a reference to each input,
+// and `t` itself is handed back unowned so the first consumer (or t_release) takes ownership of it.
+static void graph_link(Tensor *t, Op op, Tensor **prevs, int num_prevs){
+    t->op = op;
+    if(memory_on) memory_tag(t, op);
+    for(int i=0; i<num_prevs; i++){
+        t->prevs[i] = t_retain(prevs[i]);
+    }
+    t->num_prevs = num_prevs;
+    t->ref_count = 0;
+}
+
 Tensor * transpose(Tensor *self){
     if(!self || self->ndim != 2){
         fprintf(stderr, "Cannot transpose a tensor with %d dimensions\n", self->ndim);
@@ -372,7 +620,7 @@ Tensor * flatten(Tensor * self){
         return NULL;
     }
 
-    Tensor * t = tensor(NULL, self->dtype, &size, self->requires_grad);
+    Tensor * t = tensor_nd(NULL, self->dtype, &size, 1, self->requires_grad);
     if(!t) return NULL;
 
     int rows = self->dims[0];
@@ -497,7 +745,7 @@ Tensor *ones(DType dtype, int * dims, bool requires_grad) {
             }
             break;
         default:
-            free(t);
+            t_free(t);
             fprintf(stderr, "Unsupported data type \n");
             return NULL;
     }
@@ -604,12 +852,12 @@ Tensor * randn(DType dtype, int *dims, bool requires_grad){
             break;
         }
         case INT:
-            free(t);
+            t_free(t);
             fprintf(stderr, " \"randn\" not implemented for \'int\' dtype \n"); 
             return NULL;
             break;
         default:
-            free(t);
+            t_free(t);
             fprintf(stderr, "Unsupported data type \n");
             return NULL;
     }
@@ -652,7 +900,6 @@ void grad_init(Tensor * self){
     if(self->dtype == FLOAT64){
         if(self->requires_grad == true){
             for (int i = 0; i < self->size; i++){
-                int idx = shape_index(i, self->dims[0], self->dims[1]);
                 self->grad.float64[i] = 1.0;
             }
         }
@@ -660,7 +907,6 @@ void grad_init(Tensor * self){
     if(self->dtype == FLOAT32){
         if(self->requires_grad == true){
             for (int i = 0; i < self->size; i++){
-                int idx = shape_index(i, self->dims[0], self->dims[1]);
                 self->grad.float32[i] = 1.0f;
             }
             // memset(self->grad.float32, 1.0f, self->size*sizeof(float));
@@ -668,1495 +914,3855 @@ void grad_init(Tensor * self){
     }
 }
 
-// element-wise addition
-Tensor * add(Tensor * t1, Tensor * t2){
-    if (!t1 || !t2) return NULL;
-    if(t1->ndim != t2->ndim || t1->dtype != t2->dtype) return NULL;
-    for(int i=0; i < t1->ndim; i++){
-        if(t1->dims[i] != t2->dims[i]) return NULL;
+// Op registry
+// Every op is described once in op_table: its arity, flags, a shape function that validates the inputs (and the
+// op's scalar argument) and computes the output dims, and one forward/backward kernel per dtype. The public op
+// functions (add, matmul, ...) all go through op_apply(), and backward() dispatches through the same table, so
+// adding an op or swapping in an optimised kernel only means touching its entry.
+
+#define OP_ELEMENTWISE 1 // out[i] only depends on element i of each input
+#define OP_FUSABLE     2 // elementwise and stateless: can be folded into the loop of the op producing its input
+#define OP_REDUCE      4 // collapses its input(s) to a scalar
+#define OP_INDEXED     8 // in[1] is an INT index tensor; in[0] alone sets the dtype
+
+typedef void (*Kernel)(Tensor *out);
+
+typedef struct{
+    const char *name;
+    int num_inputs;
+    int flags;
+    bool (*shape)(Tensor **in, int n, double extra, int *dims, int *ndim); // false if the inputs are incompatible
+    Kernel forward[3];  // indexed by DType, NULL when the dtype is not supported
+    Kernel backward[3];
+    double (*flops)(Tensor *out); // nominal forward FLOPs for the profiler; NULL counts one per element
+}OpDesc;
+
+static const char *dtype_name(DType dtype){
+    switch(dtype){
+        case FLOAT32: return "float32";
+        case FLOAT64: return "float64";
+        case INT: return "int";
+        default: return "unknown";
     }
+}
 
-    bool require_grad = (t1->requires_grad == true || t2->requires_grad == true) ? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
+// vectorizable math
+// Branch-free replacements for libm's exp/log/tanh/erf/sqrt: special cases are handled with selects and every
+// polynomial is fully unrolled, so the loops that call them vectorize at the width of the kernel's ISA.
+// Max errors, measured against long double libm over the whole finite range:
+//   exp < 1.1 ulp, log < 1 ulp, tanh < 1.5 ulp, sigmoid < 2.5 ulp, erf < 2.1 ulp, sqrt < 1 ulp, rsqrt < 1.25 ulp
+//   (float32 and float64 alike)
+// exp flushes results below 2^-125 (float32) / 2^-1021 (float64) to zero; log treats subnormal inputs exactly.
+typedef union{ float f; uint32_t u; }Bits32;
+typedef union{ double f; uint64_t u; }Bits64;
+
+// c ? a : b as a bit blend; with a plain ?: GCC sinks the computation of the unused side into a branch, which it
+// then won't if-convert because floating point ops may trap
+static inline float select_f32(bool c, float a, float b){
+    uint32_t m = -(uint32_t)c;
+    Bits32 x = {.f = a}, y = {.f = b}, r = {.u = (x.u & m) | (y.u & ~m)};
+    return r.f;
+}
 
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = t1->data.float32[i] + t2->data.float32[i];
-            }
-            
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = t1->data.float64[i] + t2->data.float64[i];
-            }
-            break;
-        case INT:
-            // #pragma omp parallel for simd  //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.Int[i] = t1->data.Int[i] + t2->data.Int[i];
-            }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
-    
-    t->op = ADD;
-    t->prevs[0] = t1;
-    t->prevs[1] = t2;
-    t->num_prevs = 2;
-    return t;
+static inline double select_f64(bool c, double a, double b){
+    uint64_t m = -(uint64_t)c;
+    Bits64 x = {.f = a}, y = {.f = b}, r = {.u = (x.u & m) | (y.u & ~m)};
+    return r.f;
 }
 
-void add_backward(Tensor * out){
-    if(!out) return;
-    if(out->prevs[0]->requires_grad == true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float32[i] += (float)1.0 * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float64[i] += (double)1.0 * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
-        }
-    }
-    if(out->prevs[1]->requires_grad == true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float32[i] += (float)1.0 * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd  //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float64[i] += (double)1.0 * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
-        }
-    }
+static inline float poly_f32(float x, const float *c, int n){
+    float p = c[0];
+    #pragma GCC unroll 32
+    for(int i=1; i<n; i++) p = p * x + c[i];
+    return p;
 }
 
-//element-wise subtraction
-Tensor * sub(Tensor * t1, Tensor * t2){
-    if(!t1 || !t2) return NULL;
-    if(t1->ndim != t2->ndim || t1->dtype != t2->dtype){
-        return NULL;
-    }
-    for(int i =0; i < t1->ndim; i++){
-        if(t1->dims[i]!= t2->dims[i]) return NULL;
-    }
+static inline double poly_f64(double x, const double *c, int n){
+    double p = c[0];
+    #pragma GCC unroll 32
+    for(int i=1; i<n; i++) p = p * x + c[i];
+    return p;
+}
 
-    bool require_grad = (t1->requires_grad == true || t2->requires_grad == true) ? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = t1->data.float32[i] - t2->data.float32[i];
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = t1->data.float64[i] - t2->data.float64[i];
-            }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.Int[i] = t1->data.Int[i] - t2->data.Int[i];
-            }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
+// exp(x) = 2^k * e^r with |r| <= ln2/2; k is rounded with the 1.5*2^23 shift trick and 2^(k-1) is built in the exponent bits.
+// Out of range inputs compute garbage that the final selects replace.
+static inline float vexp_f32(float x){
+    static const float c[] = {1.0f / 5040, 1.0f / 720, 1.0f / 120, 1.0f / 24, 1.0f / 6, 0.5f};
+    Bits32 kb = {.f = x * 1.44269504f + 0x1.8p23f};
+    float k = kb.f - 0x1.8p23f;
+    float r = x - k * 0.693359375f;
+    r = r - k * -2.12194440e-4f;
+    float p = poly_f32(r, c, 6) * r * r + r + 1.0f;
+    Bits32 s = {.u = (kb.u + 126) << 23};
+    float y = (p + p) * s.f;
+    y = select_f32(x > 88.7228317f, INFINITY, y);
+    return select_f32(x < -86.9f, 0.0f, y);
+}
 
-    t->op = SUB;
-    t->prevs[0] = t1;
-    t->prevs[1] = t2;
-    t->num_prevs = 2;
-    return t;
+static inline double vexp_f64(double x){
+    static const double c[] = {
+        1.0 / 6227020800, 1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880, 1.0 / 40320,
+        1.0 / 5040, 1.0 / 720, 1.0 / 120, 1.0 / 24, 1.0 / 6, 0.5
+    };
+    Bits64 kb = {.f = x * 1.4426950408889634 + 0x1.8p52};
+    double k = kb.f - 0x1.8p52;
+    double r = x - k * 6.93147180369123816490e-01;
+    r = r - k * 1.90821492927058770002e-10;
+    double p = poly_f64(r, c, 12) * r * r + r + 1.0;
+    Bits64 s = {.u = (kb.u + 1022) << 52};
+    double y = (p + p) * s.f;
+    y = select_f64(x > 709.782712893384, INFINITY, y);
+    return select_f64(x < -708.0, 0.0, y);
 }
 
-void sub_backward(Tensor * out){
-    if(!out) return;
-    if(out->prevs[0]->requires_grad==true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float32[i] += (float)1.0 * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float64[i] += (double)1.0 * out->grad.float64[i];
-                }
-                break;           
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
-        }
+// log(x) = k*ln2 + log(1+f) with 1+f in [sqrt(1/2), sqrt(2)); log(1+f) = f - f^2/2 + s*(f^2/2 + R(s^2)), s = f/(2+f)
+static inline float vlog_f32(float x){
+    static const float c[] = {2.0f / 9, 2.0f / 7, 2.0f / 5, 2.0f / 3};
+    bool sub = x < 0x1p-126f;
+    Bits32 b = {.f = x * select_f32(sub, 0x1p23f, 1.0f)};
+    float k = (float)((int32_t)(b.u >> 23) - 127) - select_f32(sub, 23.0f, 0.0f);
+    Bits32 mb = {.u = (b.u & 0x007fffff) | 0x3f800000};
+    float m = mb.f;
+    k = select_f32(m > 1.41421356f, k + 1.0f, k);
+    m = select_f32(m > 1.41421356f, m * 0.5f, m);
+    float f = m - 1.0f;
+    float s = f / (2.0f + f), w = s * s, hfsq = 0.5f * f * f;
+    float R = w * poly_f32(w, c, 4);
+    float y = k * 0.693359375f - ((hfsq - (s * (hfsq + R) + k * -2.12194440e-4f)) - f);
+    y = select_f32(x < 0, NAN, y);
+    y = select_f32(x == 0, -INFINITY, y);
+    return select_f32((x == INFINITY) | (x != x), x, y);
+}
+
+static inline double vlog_f64(double x){
+    static const double c[] = {
+        2.0 / 23, 2.0 / 21, 2.0 / 19, 2.0 / 17, 2.0 / 15, 2.0 / 13, 2.0 / 11, 2.0 / 9, 2.0 / 7, 2.0 / 5, 2.0 / 3
+    };
+    bool sub = x < 0x1p-1022;
+    Bits64 b = {.f = x * select_f64(sub, 0x1p54, 1.0)};
+    // exponent field -> double without a 64-bit int conversion: 2^52 + e has e in its low mantissa bits
+    Bits64 eb = {.u = 0x4330000000000000ULL | (b.u >> 52)};
+    double k = eb.f - (0x1p52 + 1023) - select_f64(sub, 54.0, 0.0);
+    Bits64 mb = {.u = (b.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL};
+    double m = mb.f;
+    k = select_f64(m > 1.4142135623730951, k + 1.0, k);
+    m = select_f64(m > 1.4142135623730951, m * 0.5, m);
+    double f = m - 1.0;
+    double s = f / (2.0 + f), w = s * s, hfsq = 0.5 * f * f;
+    double R = w * poly_f64(w, c, 11);
+    double y = k * 6.93147180369123816490e-01 - ((hfsq - (s * (hfsq + R) + k * 1.90821492927058770002e-10)) - f);
+    y = select_f64(x < 0, NAN, y);
+    y = select_f64(x == 0, -INFINITY, y);
+    return select_f64((x == INFINITY) | (x != x), x, y);
+}
+
+// |x| < 0.625: tanh(x) = x + x^3 * q(x^2), q a Chebyshev fit; otherwise sign(x) * (1 - 2 / (exp(2|x|) + 1))
+static inline float vtanh_f32(float x){
+    static const float c[] = {6.525173327e-07f, -8.883868594e-06f, 1.201382007e-04f, -1.638144995e-03f, 2.236610727e-02f, -3.091994049e-01f};
+    float ax = fabsf(x), z = x * x;
+    float small = x + x * z * poly_f32(z * 5.12f - 1.0f, c, 6);
+    float large = 1.0f - 2.0f / (vexp_f32(ax + ax) + 1.0f);
+    large = select_f32(x < 0, -large, large);
+    return select_f32(ax < 0.625f, small, large);
+}
+
+static inline double vtanh_f64(double x){
+    static const double c[] = {
+        1.02456023220833118e-13, -1.39491121292851213e-12, 1.87095871074950027e-11, -2.55074726695527094e-10,
+        3.47780343519755123e-09, -4.74132162532658474e-08, 6.46388815957472011e-07, -8.81229977300145035e-06,
+        1.20141272045493189e-04, -1.63817188932568678e-03, 2.23661068807246739e-02, -3.09199403436347164e-01
+    };
+    double ax = fabs(x), z = x * x;
+    double small = x + x * z * poly_f64(z * 5.12 - 1.0, c, 12);
+    double large = 1.0 - 2.0 / (vexp_f64(ax + ax) + 1.0);
+    large = select_f64(x < 0, -large, large);
+    return select_f64(ax < 0.625, small, large);
+}
+
+static inline float vsigmoid_f32(float x){ return 1.0f / (1.0f + vexp_f32(-x)); }
+static inline double vsigmoid_f64(double x){ return 1.0 / (1.0 + vexp_f64(-x)); }
+
+// |x| < 1: erf(x) = x * p(x^2); otherwise erf(x) = 1 - exp(-x^2) * q(|x|), both Chebyshev fits
+static inline float verf_f32(float x){
+    static const float p[] = {1.231640173e-06f, -1.766908081e-05f, 2.175119898e-04f, -2.285419529e-03f, 1.985249772e-02f, -1.405360973e-01f, 9.654687386e-01f};
+    static const float q[] = {
+        -5.058179245e-06f, 1.381908900e-05f, -2.048964103e-05f, 5.494724823e-05f, -1.644974511e-04f, 4.145080978e-04f, -1.004788462e-03f,
+        2.401701695e-03f, -5.570928959e-03f, 1.248970367e-02f, -2.700527578e-02f, 5.611047258e-02f, -1.115210207e-01f, 2.108063643e-01f
+    };
+    float ax = fabsf(x), z = x * x;
+    float small = x * poly_f32(z + z - 1.0f, p, 7);
+    float large = 1.0f - vexp_f32(-z) * poly_f32(ax * (2.0f / 3) - (5.0f / 3), q, 14);
+    large = select_f32(ax > 4.0f, 1.0f, large);
+    large = select_f32(x < 0, -large, large);
+    return select_f32(ax < 1.0f, small, large);
+}
+
+static inline double verf_f64(double x){
+    static const double p[] = {
+        1.45481707596067905e-14, -3.80788273952634147e-13, 9.16760674606944502e-12, -2.03522840489946699e-10,
+        4.11580059766495969e-09, -7.51156928660088975e-08, 1.22338273835240093e-06, -1.75371694411248255e-05,
+        2.17517156041601079e-04, -2.28548556114411324e-03, 1.98524966889837076e-02, -1.40536089022717109e-01,
+        9.65468738669867266e-01
+    };
+    static const double q[] = {
+        -8.29466160020057193e-09, 1.91030238464713510e-08, 1.24806024947782504e-08, -2.62041131279216327e-08,
+        -1.14040469978661816e-07, 2.48455539654513324e-07, -2.39704968942521120e-07, 5.39502771184419375e-07,
+        -1.53418887043274355e-06, 3.26480587220421433e-06, -6.59720261735379188e-06, 1.37499784175649087e-05,
+        -2.83961607988310685e-05, 5.74504605144846668e-05, -1.14436264613058611e-04, 2.24521320360490320e-04,
+        -4.33363051232466055e-04, 8.22256945465481563e-04, -1.53251551633636963e-03, 2.80332597257575838e-03,
+        -5.02806798637428672e-03, 8.83342393258160392e-03, -1.51825115447086090e-02, 2.54955596430682420e-02,
+        -4.17667881194538140e-02, 6.66320824532009859e-02, -1.03308944583131071e-01, 1.55293655608894271e-01
+    };
+    double ax = fabs(x), z = x * x;
+    double small = x * poly_f64(z + z - 1.0, p, 13);
+    double large = 1.0 - vexp_f64(-z) * poly_f64(ax * 0.4 - 1.4, q, 28);
+    large = select_f64(ax > 6.0, 1.0, large);
+    large = select_f64(x < 0, -large, large);
+    return select_f64(ax < 1.0, small, large);
+}
+
+// 1/sqrt(x): bit trick estimate (~3.4% off) refined by Newton steps, each doubling the correct bits. Tiny inputs are
+// scaled up first, far enough that x/2 in the Newton step is still a normal number. sqrt(x) = x/sqrt(x) plus one residual correction. libm's sqrt sets errno
+// on negative inputs, which keeps GCC from vectorizing it.
+static inline float vrsqrt_f32(float x){
+    bool sub = x < 0x1p-64f;
+    float xs = x * select_f32(sub, 0x1p64f, 1.0f);
+    Bits32 b = {.f = xs};
+    b.u = 0x5f375a86 - (b.u >> 1);
+    float y = b.f, h = 0.5f * xs;
+    #pragma GCC unroll 4
+    for(int i=0; i<3; i++) y = y + y * (0.5f - h * y * y);
+    y = y * select_f32(sub, 0x1p32f, 1.0f);
+    y = select_f32(x == INFINITY, 0.0f, y);
+    y = select_f32(x == 0, 1.0f / x, y);
+    return select_f32(!(x >= 0), NAN, y);
+}
+
+static inline double vrsqrt_f64(double x){
+    bool sub = x < 0x1p-960;
+    double xs = x * select_f64(sub, 0x1p128, 1.0);
+    Bits64 b = {.f = xs};
+    b.u = 0x5fe6eb50c7b537a9ULL - (b.u >> 1);
+    double y = b.f, h = 0.5 * xs;
+    #pragma GCC unroll 5
+    for(int i=0; i<4; i++) y = y + y * (0.5 - h * y * y);
+    y = y * select_f64(sub, 0x1p64, 1.0);
+    y = select_f64(x == INFINITY, 0.0, y);
+    y = select_f64(x == 0, 1.0 / x, y);
+    return select_f64(!(x >= 0), NAN, y);
+}
+
+static inline float vsqrt_f32(float x){
+    bool sub = x < 0x1p-126f;
+    float xs = x * select_f32(sub, 0x1p24f, 1.0f);
+    float y = vrsqrt_f32(xs), s = xs * y;
+    s = (s + 0.5f * y * (xs - s * s)) * select_f32(sub, 0x1p-12f, 1.0f);
+    return select_f32((x == 0) | (x == INFINITY), x, s);
+}
+
+static inline double vsqrt_f64(double x){
+    bool sub = x < 0x1p-1022;
+    double xs = x * select_f64(sub, 0x1p54, 1.0);
+    double y = vrsqrt_f64(xs), s = xs * y;
+    s = (s + 0.5 * y * (xs - s * s)) * select_f64(sub, 0x1p-27, 1.0);
+    return select_f64((x == 0) | (x == INFINITY), x, s);
+}
+
+// x^y as exp(y * log|x|) with the sign fixed up for integer y; float32 goes through the float64 kernels so the
+// rounding error of log|x| doesn't get scaled by y (< 1 ulp). float64 keeps libm's pow, which is correctly rounded
+// where this formula would lose up to |y * log x| ulp.
+static inline float vpow_f32(float x, float y){
+    double r = vexp_f64((double)y * vlog_f64(fabs((double)x)));
+    bool yint = floorf(y) == y, odd = yint && floorf(y * 0.5f) != y * 0.5f;
+    r = select_f64(x < 0 && odd, -r, r);
+    r = select_f64(x < 0 && !yint, NAN, r);
+    return select_f32(y == 0, 1.0f, (float)r);
+}
+
+// GELU(x) = x/2 * (1 + erf(x/sqrt(2))) and its derivative
+static inline float vgelu_f32(float x){ return 0.5f * x * (1.0f + verf_f32(x * 0.707106781f)); }
+static inline double vgelu_f64(double x){ return 0.5 * x * (1.0 + verf_f64(x * 0.70710678118654752)); }
+
+static inline float vgelu_grad_f32(float x){
+    return 0.5f * (1.0f + verf_f32(x * 0.707106781f)) + x * 0.398942280f * vexp_f32(-0.5f * x * x);
+}
+
+static inline double vgelu_grad_f64(double x){
+    return 0.5 * (1.0 + verf_f64(x * 0.70710678118654752)) + x * 0.39894228040143268 * vexp_f64(-0.5 * x * x);
+}
+
+// type generic math, so one kernel body serves every dtype
+#define nan_exp(x)       _Generic((x), float: vexp_f32, default: vexp_f64)(x)
+#define nan_log(x)       _Generic((x), float: vlog_f32, default: vlog_f64)(x)
+#define nan_tanh(x)      _Generic((x), float: vtanh_f32, default: vtanh_f64)(x)
+#define nan_sigmoid(x)   _Generic((x), float: vsigmoid_f32, default: vsigmoid_f64)(x)
+#define nan_erf(x)       _Generic((x), float: verf_f32, default: verf_f64)(x)
+#define nan_gelu(x)      _Generic((x), float: vgelu_f32, default: vgelu_f64)(x)
+#define nan_gelu_grad(x) _Generic((x), float: vgelu_grad_f32, default: vgelu_grad_f64)(x)
+#define nan_sqrt(x)      _Generic((x), float: vsqrt_f32, default: vsqrt_f64)(x)
+#define nan_rsqrt(x)     _Generic((x), float: vrsqrt_f32, default: vrsqrt_f64)(x)
+#define nan_pow(x, y)    _Generic((x), float: vpow_f32, default: pow)((x), (y))
+#define nan_abs(x)       _Generic((x), float: fabsf, double: fabs, default: abs)(x)
+
+// instantiate a kernel macro M(T, F, ...) for each C type T and matching Data/Grad field F
+#define FOR_FLOAT_DTYPES(M, ...) M(float, float32, __VA_ARGS__) M(double, float64, __VA_ARGS__)
+#define FOR_ALL_DTYPES(M, ...) FOR_FLOAT_DTYPES(M, __VA_ARGS__) M(int, Int, __VA_ARGS__)
+
+// CPU dispatch
+// Kernels are compiled once per instruction set: the baseline variant uses the compiler's default target
+// (SSE2 on x86-64, NEON on AArch64) and, on x86 with GCC/Clang, AVX2+FMA and AVX-512 variants are generated
+// from the same source with target attributes. kernels_init() picks the best variant the CPU supports the first
+// time an op runs. NAN_CPU=baseline|sse2|neon|avx2|avx512 in the environment caps the level (for testing),
+// set_cpu_level() does the same at runtime.
+typedef enum{
+    CPU_BASELINE,
+    CPU_AVX2,
+    CPU_AVX512
+}CpuLevel;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NAN_X86_DISPATCH
+#define TARGET_AVX2 __attribute__((target("avx2,fma"), unused))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw,avx2,fma"), unused))
+// M(args..., ISA suffix, attributes) once per instruction set
+#define FOR_EACH_ISA(M, ...) M(__VA_ARGS__, , ) M(__VA_ARGS__, _avx2, TARGET_AVX2) M(__VA_ARGS__, _avx512, TARGET_AVX512)
+#else
+#define FOR_EACH_ISA(M, ...) M(__VA_ARGS__, , )
+#endif
+
+// elementwise kernels: `a`, `b` are the input elements, `c` the output element, `g` its gradient
+// and `alpha` the op's scalar argument (t->extra)
+#define BINARY_FORWARD(T, F, NAME, EXPR) FOR_EACH_ISA(BINARY_FORWARD_ISA, T, F, NAME, EXPR)
+#define BINARY_FORWARD_ISA(T, F, NAME, EXPR, ISA, ATTR) \
+ATTR static void NAME##_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    const T *y = out->prevs[1]->data.F; \
+    T *o = out->data.F; \
+    for(int i=0; i<out->size; i++){ \
+        T a = x[i], b = y[i]; \
+        o[i] = (EXPR); \
+    } \
+}
+
+#define BINARY_BACKWARD(T, F, NAME, DA, DB) FOR_EACH_ISA(BINARY_BACKWARD_ISA, T, F, NAME, DA, DB)
+#define BINARY_BACKWARD_ISA(T, F, NAME, DA, DB, ISA, ATTR) \
+ATTR static void NAME##_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0], *p1 = out->prevs[1]; \
+    const T *x = p0->data.F, *y = p1->data.F, *o = out->data.F, *go = out->grad.F; \
+    if(p0->requires_grad == true){ \
+        T *gx = p0->grad.F; \
+        for(int i=0; i<out->size; i++){ \
+            T a = x[i], b = y[i], c = o[i], g = go[i]; \
+            (void)a; (void)b; (void)c; \
+            gx[i] += (DA); \
+        } \
+    } \
+    if(p1->requires_grad == true){ \
+        T *gy = p1->grad.F; \
+        for(int i=0; i<out->size; i++){ \
+            T a = x[i], b = y[i], c = o[i], g = go[i]; \
+            (void)a; (void)b; (void)c; \
+            gy[i] += (DB); \
+        } \
+    } \
+}
+
+#define UNARY_FORWARD(T, F, NAME, EXPR) FOR_EACH_ISA(UNARY_FORWARD_ISA, T, F, NAME, EXPR)
+#define UNARY_FORWARD_ISA(T, F, NAME, EXPR, ISA, ATTR) \
+ATTR static void NAME##_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    T *o = out->data.F; \
+    T alpha = (T)out->extra; \
+    (void)alpha; \
+    for(int i=0; i<out->size; i++){ \
+        T a = x[i]; \
+        o[i] = (EXPR); \
+    } \
+}
+
+#define UNARY_BACKWARD(T, F, NAME, DA) FOR_EACH_ISA(UNARY_BACKWARD_ISA, T, F, NAME, DA)
+#define UNARY_BACKWARD_ISA(T, F, NAME, DA, ISA, ATTR) \
+ATTR static void NAME##_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0]; \
+    if(p0->requires_grad != true) return; \
+    const T *x = p0->data.F, *o = out->data.F, *go = out->grad.F; \
+    T *gx = p0->grad.F; \
+    T alpha = (T)out->extra; \
+    (void)alpha; \
+    for(int i=0; i<out->size; i++){ \
+        T a = x[i], c = o[i], g = go[i]; \
+        (void)a; (void)c; \
+        gx[i] += (DA); \
+    } \
+}
+
+FOR_ALL_DTYPES(BINARY_FORWARD, add, a + b)
+FOR_FLOAT_DTYPES(BINARY_BACKWARD, add, g, g)
+
+FOR_ALL_DTYPES(BINARY_FORWARD, sub, a - b)
+FOR_FLOAT_DTYPES(BINARY_BACKWARD, sub, g, -g)
+
+FOR_ALL_DTYPES(BINARY_FORWARD, mul, a * b)
+FOR_FLOAT_DTYPES(BINARY_BACKWARD, mul, g * b, g * a)
+
+FOR_FLOAT_DTYPES(BINARY_FORWARD, div, a / b)
+FOR_FLOAT_DTYPES(BINARY_BACKWARD, div, g / b, -g * a / (b * b))
+
+// exponents that get their own loop instead of a general pow: M(T, exponent, value, derivative) with the input `a`
+// and the output `c`
+#define POW_CASES(M, T) \
+    M(T, 1, a, one) \
+    M(T, 2, a * a, 2 * a) \
+    M(T, 3, a * a * a, 3 * a * a) \
+    M(T, 4, (a * a) * (a * a), 4 * a * a * a) \
+    M(T, -1, one / a, -c * c) \
+    M(T, -2, one / (a * a), -2 * c / a) \
+    M(T, 0.5, nan_sqrt(a), half / c) \
+    M(T, -0.5, nan_rsqrt(a), -half * c * c * c)
+
+#define POW_FORWARD_CASE(T, E, VALUE, DERIV) \
+    if(e == (E)){ \
+        for(int i=0; i<out->size; i++){ \
+            T a = x[i]; \
+            o[i] = (VALUE); \
+        } \
+        return; \
     }
-    if(out->prevs[1]->requires_grad==true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float32[i] += (float)-1.0 * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float64[i] += (double)-1.0 * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
-        }
+
+#define POW_BACKWARD_CASE(T, E, VALUE, DERIV) \
+    if(e == (E)){ \
+        for(int i=0; i<out->size; i++){ \
+            T a = x[i], c = o[i]; \
+            (void)a; (void)c; \
+            gx[i] += go[i] * (DERIV); \
+        } \
+        return; \
     }
+
+#define POW_FORWARD(T, F, ...) FOR_EACH_ISA(POW_FORWARD_ISA, T, F)
+#define POW_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void pow_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    T *o = out->data.F; \
+    T e = (T)out->extra, one = 1, half = 0.5; \
+    (void)half; \
+    if(e == 0){ \
+        for(int i=0; i<out->size; i++) o[i] = one; \
+        return; \
+    } \
+    POW_CASES(POW_FORWARD_CASE, T) \
+    for(int i=0; i<out->size; i++){ \
+        o[i] = nan_pow(x[i], e); \
+    } \
 }
 
-//element-wise multiplication
-Tensor * mul(Tensor *t1, Tensor *t2){
-    if(!t1 || !t2) return NULL;
-    if(t1->ndim != t2->ndim || t1->dtype != t2->dtype){
-        return NULL;
-    }
-    for(int i =0; i<t1->ndim; i++){
-        if(t1->dims[i] != t2->dims[i]){
-            return NULL;
+#define POW_BACKWARD(T, F, ...) FOR_EACH_ISA(POW_BACKWARD_ISA, T, F)
+#define POW_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void pow_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0]; \
+    if(p0->requires_grad != true) return; \
+    const T *x = p0->data.F, *o = out->data.F, *go = out->grad.F; \
+    T *gx = p0->grad.F; \
+    T e = (T)out->extra, one = 1, half = 0.5; \
+    (void)half; \
+    if(e == 0) return; \
+    POW_CASES(POW_BACKWARD_CASE, T) \
+    for(int i=0; i<out->size; i++){ \
+        gx[i] += go[i] * e * nan_pow(x[i], e - 1); \
+    } \
+}
+
+FOR_FLOAT_DTYPES(POW_FORWARD)
+FOR_FLOAT_DTYPES(POW_BACKWARD)
+
+// integer powers by square and multiply, straight into the output. Negative exponents follow C's integer
+// division: 1 and -1 stay in {1, -1}, everything else truncates to 0.
+static void pow_forward_Int(Tensor *out){
+    const int *x = out->prevs[0]->data.Int;
+    int *o = out->data.Int;
+    int e = (int)out->extra;
+    int n = e < 0 ? -e : e;
+    for(int i=0; i<out->size; i++){
+        int base = x[i], r = 1;
+        for(int k=n; k; k>>=1){
+            if(k & 1) r *= base;
+            base *= base;
         }
+        o[i] = (e >= 0 || r == 1 || r == -1) ? r : 0;
     }
+}
 
-    bool require_grad = (t1->requires_grad == true || t2->requires_grad == true ) ? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    switch(t1->dtype){
-        case FLOAT32:
-            // double start_time = omp_get_wtime();
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = t1->data.float32[i] * t2->data.float32[i];
-            }
-            // double parallel_time = omp_get_wtime() - start_time;
-            // printf("\n%f\n", parallel_time);
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = t1->data.float64[i] * t2->data.float64[i];
-            }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.Int[i] = t1->data.Int[i] * t2->data.Int[i];
-            }
-            break;
-        default:
-            free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
+FOR_FLOAT_DTYPES(UNARY_FORWARD, exp, nan_exp(a))
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, exp, g * c)
 
-    t->op = MUL;
-    t->prevs[0] = t1;
-    t->prevs[1] = t2;
-    t->num_prevs = 2;
-    return t;
+FOR_FLOAT_DTYPES(UNARY_FORWARD, log, nan_log(a))
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, log, g / a)
+
+FOR_ALL_DTYPES(UNARY_FORWARD, relu, (a < 0) ? 0 : a)
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, relu, (a > 0) ? g : 0)
+
+FOR_FLOAT_DTYPES(UNARY_FORWARD, leaky_relu, (a < 0) ? alpha * a : a)
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, leaky_relu, (a < 0) ? alpha * g : g)
+
+FOR_FLOAT_DTYPES(UNARY_FORWARD, tanh, nan_tanh(a))
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, tanh, (1 - c * c) * g)
+
+FOR_FLOAT_DTYPES(UNARY_FORWARD, sigmoid, nan_sigmoid(a))
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, sigmoid, c * (1 - c) * g)
+
+FOR_FLOAT_DTYPES(UNARY_FORWARD, gelu, nan_gelu(a))
+FOR_FLOAT_DTYPES(UNARY_BACKWARD, gelu, g * nan_gelu_grad(a))
+
+// Batched matmul: every operand is a stack of matrices over its leading dims, which broadcast like numpy
+// ([4, 1, m, l] @ [3, l, n] -> [4, 3, m, n]). Batch entry `b` of the output uses matrices *ia of A and *ib of B.
+static int matmul_batches(Tensor *t){
+    int batch = 1;
+    for(int d=0; d<t->ndim-2; d++) batch *= t->dims[d];
+    return batch;
 }
 
-void mul_backward(Tensor * out){
-    if(!out) return;
-    if(out->prevs[0]->requires_grad==true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd  //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float32[i] += out->prevs[1]->data.float32[i] * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->prevs[1]->data.float64[i] * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
+static void matmul_batch_index(Tensor *out, int b, int *ia, int *ib){
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1];
+    int nb = out->ndim - 2, sa = 1, sb = 1;
+    *ia = *ib = 0;
+    for(int d=nb-1; d>=0; d--){
+        int idx = b % out->dims[d];
+        b /= out->dims[d];
+        int da = d - (nb - (pa->ndim - 2)), db = d - (nb - (pb->ndim - 2));
+        if(da >= 0){
+            if(pa->dims[da] != 1) *ia += idx * sa;
+            sa *= pa->dims[da];
         }
-    }
-    if(out->prevs[1]->requires_grad == true){
-        switch (out->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float32[i] += out->prevs[0]->data.float32[i] * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->size; i++){
-                    out->prevs[1]->grad.float64[i] += out->prevs[0]->data.float64[i] * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
+        if(db >= 0){
+            if(pb->dims[db] != 1) *ib += idx * sb;
+            sb *= pb->dims[db];
         }
     }
 }
 
-//dot preoduct
-Tensor * matmul(Tensor *t1, Tensor *t2){
-    if (!t1 || !t2) return NULL;
-    int m = t1->dims[0];
-    int n = t2->dims[1];
-    int l = t1->dims[1];
-    int dims[] = {m, n};
-    if (t1->dims[1] != t2->dims[0] || t1->dtype != t2->dtype){
-        return NULL;
-    }
-    bool require_grad = (t1->requires_grad == true  || t2->requires_grad == true ) ? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, dims, require_grad);
-    if(!t) return NULL;
-    switch(t1->dtype){
-        case FLOAT32:
-#ifdef NAN_USE_OPENBLAS
-            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, l, 1.0f, t1->data.float32, l, t2->data.float32, n, 0.0f, t->data.float32, n);
+// B[l,n] is packed into panels of PACK_COLS columns, each stored k-major and zero padded on the right, so the
+// micro kernel streams one contiguous panel no matter how wide B is
+#define PACK_PANEL(T, F, ...) \
+static void pack_panel_##F(const T *B, int l, int n, int p, T *dst){ \
+    int j0 = p * PACK_COLS, w = n - j0 < PACK_COLS ? n - j0 : PACK_COLS; \
+    for(int k=0; k<l; k++){ \
+        const T *b = B + (size_t)k*n + j0; \
+        T *d = dst + (size_t)k*PACK_COLS; \
+        for(int jj=0; jj<w; jj++) d[jj] = b[jj]; \
+        for(int jj=w; jj<PACK_COLS; jj++) d[jj] = 0; \
+    } \
+}
 
+// the micro kernel relies on the fully unrolled tile being vectorized as straight-line code. GCC's loop vectorizer
+// otherwise turns the k loop into a reduction over every accumulator at -O3, which is several times slower
+#if defined(__GNUC__) && !defined(__clang__)
+#define GEMM_OPTIMIZE __attribute__((optimize("O3", "no-tree-loop-vectorize")))
 #else
-            #pragma omp parallel for collapse(2)
-            for (int i = 0; i < m; i++) {
-                for (int j = 0; j < n; j++) {
-                    float sum = 0.0f;
-                    for (int k = 0; k < l; k++) {
-                        sum += t1->data.float32[i * l + k] * t2->data.float32[k * n + j];
-                    }
-                    t->data.float32[i * n + j] = sum;
-                }
-            }
-#endif
-            break;
-        case FLOAT64:
-#ifdef NAN_USE_OPENBLAS
-            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, l, 1.0, t1->data.float64, l, t2->data.float64, n, 0.0, t->data.float64, n);
-#else
-            // Blocked matmul with OpenMP
-            #pragma omp parallel for collapse(2) 
-            for(int i=0; i<m; i++){
-                for(int j=0; j<n; j++){
-                    double sum = 0.0;
-                    for(int k=0; k<l; k++){
-                        sum += t1->data.float64[i * l + k] * t2->data.float64[k * n + j];
-                        // for (int ii = i; ii < i + BLOCK_SIZE && ii < m; ii++) {
-                            // for(int jj = j; jj < j + BLOCK_SIZE && jj < n; jj++) {
-                                // double sum = 0.0;
-                                // for(int kk = k; kk < k + BLOCK_SIZE && kk < l; kk++) {
-                                     // sum += t1->data.float64[ii*l + kk] * t2->data.float64[kk*n + jj];
-
-                                    // }
-                                // }
-                            // }
-                        // t->data.float64[ii*n + jj] += sum;
-                    }
-                    t->data.float64[i * n + j] = sum;
-                }
-            }
+#define GEMM_OPTIMIZE
 #endif
 
-            break;
-        case INT:
-            #pragma omp parallel for simd collapse(2) //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<m; i++){
-                for(int j=0; j<n; j++){
-                    for(int k=0; k<l; k++){
-                        t->data.Int[i*n + j] += t1->data.Int[i*l + k] * t2->data.Int[k*n + j];
-                    }
-                }
-            }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
+// C[rows, w] = A[rows, l] @ panel, MATMUL_MICRO_ROWS rows at a time with the whole tile of C in registers
+#define GEMM_PANEL(T, F, ...) FOR_EACH_ISA(GEMM_PANEL_ISA, T, F)
+#define GEMM_PANEL_ISA(T, F, ISA, ATTR) \
+ATTR GEMM_OPTIMIZE static void gemm_panel_##F##ISA(const T *A, int lda, const T *panel, int l, T *C, int ldc, int rows, int w){ \
+    int i = 0; \
+    for(; i + MATMUL_MICRO_ROWS <= rows; i += MATMUL_MICRO_ROWS){ \
+        T acc[MATMUL_MICRO_ROWS][PACK_COLS] = {{0}}; \
+        for(int k=0; k<l; k++){ \
+            const T *b = panel + (size_t)k*PACK_COLS; \
+            _Pragma("GCC unroll 8") \
+            for(int r=0; r<MATMUL_MICRO_ROWS; r++){ \
+                T a = A[(size_t)(i + r)*lda + k]; \
+                for(int jj=0; jj<PACK_COLS; jj++) acc[r][jj] += a * b[jj]; \
+            } \
+        } \
+        for(int r=0; r<MATMUL_MICRO_ROWS; r++) \
+            for(int jj=0; jj<w; jj++) C[(size_t)(i + r)*ldc + jj] = acc[r][jj]; \
+    } \
+    for(; i<rows; i++){ \
+        T acc[PACK_COLS] = {0}; \
+        for(int k=0; k<l; k++){ \
+            const T *b = panel + (size_t)k*PACK_COLS; \
+            T a = A[(size_t)i*lda + k]; \
+            for(int jj=0; jj<PACK_COLS; jj++) acc[jj] += a * b[jj]; \
+        } \
+        for(int jj=0; jj<w; jj++) C[(size_t)i*ldc + jj] = acc[jj]; \
+    } \
+}
 
-    t->op = MATMUL;
-    t->prevs[0] = t1;
-    t->prevs[1] = t2;
-    t->num_prevs = 2;
-    return t;
+// C[rows, w] = A[rows, l] @ B[l, w] for a handful of rows (row stride of B and C is n). Packing would cost as much
+// as the product itself here, so B is streamed row by row, four at a time, into the rows of C
+#define GEMM_SKINNY(T, F, ...) FOR_EACH_ISA(GEMM_SKINNY_ISA, T, F)
+#define GEMM_SKINNY_ISA(T, F, ISA, ATTR) \
+ATTR static void gemm_skinny_##F##ISA(const T *A, const T *B, T *C, int rows, int l, int n, int w){ \
+    for(int r=0; r<rows; r++) \
+        for(int jj=0; jj<w; jj++) C[(size_t)r*n + jj] = 0; \
+    int k = 0; \
+    for(; k + 4 <= l; k += 4){ \
+        const T *b0 = B + (size_t)k*n, *b1 = b0 + n, *b2 = b1 + n, *b3 = b2 + n; \
+        for(int r=0; r<rows; r++){ \
+            const T *a = A + (size_t)r*l + k; \
+            T a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3]; \
+            T *c = C + (size_t)r*n; \
+            _Pragma("omp simd") \
+            for(int jj=0; jj<w; jj++) c[jj] += a0*b0[jj] + a1*b1[jj] + a2*b2[jj] + a3*b3[jj]; \
+        } \
+    } \
+    for(; k<l; k++){ \
+        const T *b = B + (size_t)k*n; \
+        for(int r=0; r<rows; r++){ \
+            T a = A[(size_t)r*l + k]; \
+            T *c = C + (size_t)r*n; \
+            _Pragma("omp simd") \
+            for(int jj=0; jj<w; jj++) c[jj] += a * b[jj]; \
+        } \
+    } \
 }
 
-void matmul_backward(Tensor * out){
-    if(!out) return;
-    int m = out->prevs[0]->dims[0];
-    int n = out->prevs[1]->dims[1];
-    int l = out->prevs[1]->dims[0];
-    switch(out->dtype){
-        case FLOAT32:
-            if(out->prevs[0]->requires_grad == true){
-                // #pragma omp parallel for simd collapse(2) //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<m; i++){
-                    for(int k=0; k<l; k++){
-                        for(int j=0; j<n; j++){
-                            out->prevs[0]->grad.float32[i*l + k] += out->grad.float32[i*n + j] * out->prevs[1]->data.float32[j*l + k];
-                        }
-                    }
-                }
-            }
-            if(out->prevs[1]->requires_grad == true){
-                // #pragma omp parallel for simd collapse(2) //multithreading or Parallelize the loop with SIMD
-                for(int k=0; k<l; k++){
-                    for(int j=0; j<n; j++){
-                        for(int i=0; i<m; i++){
-                            out->prevs[1]->grad.float32[k*n + j] += out->prevs[0]->data.float32[k*m + i] * out->grad.float32[i*n + j];
-                        }
-                    }
-                }
-            }
-            break;
-        case FLOAT64:
-            if(out->prevs[0]->requires_grad == true){
-                // #pragma omp parallel for simd collapse(2) //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<m; i++){
-                    for(int k=0; k<l; k++){
-                        for(int j=0; j<n; j++){
-                            out->prevs[0]->grad.float64[i*l + k] += out->grad.float64[i*n + j] * out->prevs[1]->data.float64[j*l + k];
-                        }
-                    }
-                }
-            }
-            if(out->prevs[1]->requires_grad == true){
-                // #pragma omp parallel for simd collapse(2) //multithreading or Parallelize the loop with SIMD
-                for(int k=0; k<l; k++){
-                    for(int j=0; j<n; j++){
-                        for(int i=0; i<m; i++){
-                            out->prevs[1]->grad.float64[k*n + j] += out->prevs[0]->data.float64[k*m + i] * out->grad.float64[i*n + j];
-                        }
-                    }
-                }
-            }
-            break;
-        default:
-            // t_free(out);
-            fprintf(stderr, "Unsupported data type \n");
-            return;
+// C[..., m, n] = A[..., m, l] @ B[..., l, n]. Each distinct B matrix is packed once and shared by every batch entry
+// that broadcasts it; the threads split (batch, row block, panel) tiles.
+#define MATMUL_FORWARD(T, F, ...) FOR_EACH_ISA(MATMUL_FORWARD_ISA, T, F)
+#define MATMUL_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void matmul_forward_##F##ISA(Tensor *out){ \
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1]; \
+    int m = out->dims[out->ndim - 2], n = out->dims[out->ndim - 1], l = pa->dims[pa->ndim - 1]; \
+    int batch = matmul_batches(out), nb = matmul_batches(pb); \
+    if(m <= MATMUL_SKINNY_ROWS){ \
+        /* threads only pay off once there is enough work to split across column chunks */ \
+        int chunks = (n + SKINNY_COLS - 1) / SKINNY_COLS; \
+        _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)batch * m * n * l > MATMUL_PARALLEL_MIN && batch * chunks > 1)") \
+        for(int b=0; b<batch; b++){ \
+            for(int c=0; c<chunks; c++){ \
+                int ia, ib, j0 = c * SKINNY_COLS; \
+                matmul_batch_index(out, b, &ia, &ib); \
+                gemm_skinny_##F##ISA(pa->data.F + (size_t)ia*m*l, pb->data.F + (size_t)ib*l*n + j0, \
+                                     out->data.F + (size_t)b*m*n + j0, m, l, n, n - j0 < SKINNY_COLS ? n - j0 : SKINNY_COLS); \
+            } \
+        } \
+        return; \
+    } \
+    int panels = (n + PACK_COLS - 1) / PACK_COLS, row_blocks = (m + MATMUL_ROW_BLOCK - 1) / MATMUL_ROW_BLOCK; \
+    size_t packed = (size_t)panels * l * PACK_COLS; \
+    T *Bp = (T *)data_alloc(nb * packed * sizeof(T)); \
+    if(!Bp){ \
+        fprintf(stderr, "Memory allocation failed \n"); \
+        return; \
+    } \
+    _Pragma("omp parallel for collapse(2) schedule(static)") \
+    for(int b=0; b<nb; b++) \
+        for(int p=0; p<panels; p++) \
+            pack_panel_##F(pb->data.F + (size_t)b*l*n, l, n, p, Bp + b*packed + (size_t)p*l*PACK_COLS); \
+    _Pragma("omp parallel for collapse(3) schedule(static)") \
+    for(int b=0; b<batch; b++){ \
+        for(int r=0; r<row_blocks; r++){ \
+            for(int p=0; p<panels; p++){ \
+                int ia, ib; \
+                matmul_batch_index(out, b, &ia, &ib); \
+                int i0 = r * MATMUL_ROW_BLOCK, j0 = p * PACK_COLS; \
+                int rows = m - i0 < MATMUL_ROW_BLOCK ? m - i0 : MATMUL_ROW_BLOCK; \
+                int w = n - j0 < PACK_COLS ? n - j0 : PACK_COLS; \
+                gemm_panel_##F##ISA(pa->data.F + ((size_t)ia*m + i0)*l, l, Bp + ib*packed + (size_t)p*l*PACK_COLS, l, \
+                                    out->data.F + ((size_t)b*m + i0)*n + j0, n, rows, w); \
+            } \
+        } \
+    } \
+    free(Bp); \
+}
+
+// dA[m,l] += dC @ B^T,  dB[l,n] += A^T @ dC for every batch entry. Entries run one after the other because
+// broadcast operands accumulate the gradients of several entries; each one is parallel over rows.
+#define MATMUL_BACKWARD(T, F, ...) FOR_EACH_ISA(MATMUL_BACKWARD_ISA, T, F)
+#define MATMUL_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void matmul_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0], *p1 = out->prevs[1]; \
+    int m = out->dims[out->ndim - 2], n = out->dims[out->ndim - 1], l = p0->dims[p0->ndim - 1]; \
+    int batch = matmul_batches(out); \
+    if(p0->requires_grad == true){ \
+        /* B^T so that both updates below stream along contiguous rows */ \
+        T *Bt = (T *)malloc((size_t)l * n * sizeof(T)); \
+        if(!Bt){ \
+            fprintf(stderr, "Memory allocation failed \n"); \
+            return; \
+        } \
+        int transposed = -1; \
+        for(int b=0; b<batch; b++){ \
+            int ia, ib; \
+            matmul_batch_index(out, b, &ia, &ib); \
+            const T *B = p1->data.F + (size_t)ib*l*n, *dC = out->grad.F + (size_t)b*m*n; \
+            T *dA = p0->grad.F + (size_t)ia*m*l; \
+            if(ib != transposed){ \
+                for(int k=0; k<l; k++) \
+                    for(int j=0; j<n; j++) \
+                        Bt[(size_t)j*l + k] = B[(size_t)k*n + j]; \
+                transposed = ib; \
+            } \
+            _Pragma("omp parallel for schedule(static)") \
+            for(int i=0; i<m; i++){ \
+                T *da = dA + (size_t)i*l; \
+                for(int j=0; j<n; j++){ \
+                    T g = dC[(size_t)i*n + j]; \
+                    const T *bt = Bt + (size_t)j*l; \
+                    _Pragma("omp simd") \
+                    for(int k=0; k<l; k++){ \
+                        da[k] += g * bt[k]; \
+                    } \
+                } \
+            } \
+        } \
+        free(Bt); \
+    } \
+    if(p1->requires_grad == true){ \
+        for(int b=0; b<batch; b++){ \
+            int ia, ib; \
+            matmul_batch_index(out, b, &ia, &ib); \
+            const T *A = p0->data.F + (size_t)ia*m*l, *dC = out->grad.F + (size_t)b*m*n; \
+            T *dB = p1->grad.F + (size_t)ib*l*n; \
+            _Pragma("omp parallel for schedule(static)") \
+            for(int k=0; k<l; k++){ \
+                T *db = dB + (size_t)k*n; \
+                for(int i=0; i<m; i++){ \
+                    T a = A[(size_t)i*l + k]; \
+                    const T *dc = dC + (size_t)i*n; \
+                    _Pragma("omp simd") \
+                    for(int j=0; j<n; j++){ \
+                        db[j] += a * dc[j]; \
+                    } \
+                } \
+            } \
+        } \
+    } \
+}
+
+// x[..., l] @ W where W comes from pack_weights(): prevs[1] already holds the panels ([panels, l, PACK_COLS],
+// extra = n), so nothing is packed per call. The leading dims of x are folded into rows since W is shared.
+#define MATMUL_PACKED_FORWARD(T, F, ...) FOR_EACH_ISA(MATMUL_PACKED_FORWARD_ISA, T, F)
+#define MATMUL_PACKED_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void matmul_packed_forward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0], *pw = out->prevs[1]; \
+    int panels = pw->dims[0], l = pw->dims[1], n = out->dims[out->ndim - 1], m = px->size / l; \
+    int row_blocks = (m + MATMUL_ROW_BLOCK - 1) / MATMUL_ROW_BLOCK; \
+    _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)m * n * l > MATMUL_PARALLEL_MIN)") \
+    for(int r=0; r<row_blocks; r++){ \
+        for(int p=0; p<panels; p++){ \
+            int i0 = r * MATMUL_ROW_BLOCK, j0 = p * PACK_COLS; \
+            int rows = m - i0 < MATMUL_ROW_BLOCK ? m - i0 : MATMUL_ROW_BLOCK; \
+            int w = n - j0 < PACK_COLS ? n - j0 : PACK_COLS; \
+            gemm_panel_##F##ISA(px->data.F + (size_t)i0*l, l, pw->data.F + (size_t)p*l*PACK_COLS, l, \
+                                out->data.F + (size_t)i0*n + j0, n, rows, w); \
+        } \
+    } \
+}
+
+// dx[i, k] += sum_j dC[i, j] * W[k, j], read straight from the panels. Packed weights are constants, so only x
+// gets a gradient.
+#define MATMUL_PACKED_BACKWARD(T, F, ...) FOR_EACH_ISA(MATMUL_PACKED_BACKWARD_ISA, T, F)
+#define MATMUL_PACKED_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void matmul_packed_backward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0], *pw = out->prevs[1]; \
+    if(px->requires_grad != true) return; \
+    int panels = pw->dims[0], l = pw->dims[1], n = out->dims[out->ndim - 1], m = px->size / l; \
+    _Pragma("omp parallel for schedule(static)") \
+    for(int i=0; i<m; i++){ \
+        const T *dc = out->grad.F + (size_t)i*n; \
+        T *dx = px->grad.F + (size_t)i*l; \
+        for(int p=0; p<panels; p++){ \
+            const T *panel = pw->data.F + (size_t)p*l*PACK_COLS; \
+            int j0 = p * PACK_COLS, w = n - j0 < PACK_COLS ? n - j0 : PACK_COLS; \
+            for(int k=0; k<l; k++){ \
+                T acc = 0; \
+                for(int jj=0; jj<w; jj++) acc += dc[j0 + jj] * panel[(size_t)k*PACK_COLS + jj]; \
+                dx[k] += acc; \
+            } \
+        } \
+    } \
+}
+
+FOR_ALL_DTYPES(PACK_PANEL)
+FOR_ALL_DTYPES(GEMM_PANEL)
+FOR_ALL_DTYPES(GEMM_SKINNY)
+FOR_ALL_DTYPES(MATMUL_FORWARD)
+FOR_FLOAT_DTYPES(MATMUL_BACKWARD)
+FOR_ALL_DTYPES(MATMUL_PACKED_FORWARD)
+FOR_FLOAT_DTYPES(MATMUL_PACKED_BACKWARD)
+
+// sparse matrices
+// A sparse [rows, cols] matrix is a leaf whose data holds its nnz values (dims [nnz]) and whose t->saved holds the
+// index below in one block: the entries by row (CSR) for the forward, and the same entries by column (CSC) for the
+// backward, so that both run in parallel without two threads writing the same output row.
+typedef struct{
+    int rows, cols, nnz;
+    int *row_ptr;   // [rows + 1]: the entries of row i are row_ptr[i] .. row_ptr[i + 1] - 1, by column
+    int *col;       // [nnz] column of each entry
+    int *col_ptr;   // [cols + 1]: the entries of column k in CSC order
+    int *row;       // [nnz] row of each entry in CSC order
+    int *pos;       // [nnz] index into the values of each entry in CSC order
+}SparseIndex;
+
+// the index of a sparse matrix, or NULL for a dense tensor (op outputs keep their own state in t->saved)
+static const SparseIndex * sparse_index(Tensor *t){
+    return t && t->num_prevs == 0 && t->op == (Op)-1 ? (const SparseIndex *)t->saved : NULL;
+}
+
+// C[i, :] = sum of A[i, k] * B[k, :] over the stored entries of row i. The nnz per row varies, so rows are
+// handed out in chunks.
+#define SPARSE_MATMUL_FORWARD(T, F, ...) FOR_EACH_ISA(SPARSE_MATMUL_FORWARD_ISA, T, F)
+#define SPARSE_MATMUL_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void sparse_matmul_forward_##F##ISA(Tensor *out){ \
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1]; \
+    const SparseIndex *s = (const SparseIndex *)pa->saved; \
+    int n = out->dims[1]; \
+    _Pragma("omp parallel for schedule(dynamic, SPARSE_ROW_CHUNK) if((size_t)s->nnz * n > MATMUL_PARALLEL_MIN)") \
+    for(int i=0; i<s->rows; i++){ \
+        T *c = out->data.F + (size_t)i*n; \
+        for(int j=0; j<n; j++) c[j] = 0; \
+        for(int e=s->row_ptr[i]; e<s->row_ptr[i + 1]; e++){ \
+            T v = pa->data.F[e]; \
+            const T *b = pb->data.F + (size_t)s->col[e]*n; \
+            _Pragma("omp simd") \
+            for(int j=0; j<n; j++) c[j] += v * b[j]; \
+        } \
+    } \
+}
+
+// dB = A^T dC walks the entries by column, so each row of dB has one owner. The values of A get
+// dA[e] = dot(dC[i, :], B[k, :]) for their entry (i, k) only, when A itself takes a gradient.
+#define SPARSE_MATMUL_BACKWARD(T, F, ...) FOR_EACH_ISA(SPARSE_MATMUL_BACKWARD_ISA, T, F)
+#define SPARSE_MATMUL_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void sparse_matmul_backward_##F##ISA(Tensor *out){ \
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1]; \
+    const SparseIndex *s = (const SparseIndex *)pa->saved; \
+    int n = out->dims[1]; \
+    bool parallel = (size_t)s->nnz * n > MATMUL_PARALLEL_MIN; \
+    if(pb->requires_grad == true){ \
+        _Pragma("omp parallel for schedule(dynamic, SPARSE_ROW_CHUNK) if(parallel)") \
+        for(int k=0; k<s->cols; k++){ \
+            T *db = pb->grad.F + (size_t)k*n; \
+            for(int e=s->col_ptr[k]; e<s->col_ptr[k + 1]; e++){ \
+                T v = pa->data.F[s->pos[e]]; \
+                const T *dc = out->grad.F + (size_t)s->row[e]*n; \
+                _Pragma("omp simd") \
+                for(int j=0; j<n; j++) db[j] += v * dc[j]; \
+            } \
+        } \
+    } \
+    if(pa->requires_grad == true){ \
+        _Pragma("omp parallel for schedule(dynamic, SPARSE_ROW_CHUNK) if(parallel)") \
+        for(int i=0; i<s->rows; i++){ \
+            const T *dc = out->grad.F + (size_t)i*n; \
+            for(int e=s->row_ptr[i]; e<s->row_ptr[i + 1]; e++){ \
+                const T *b = pb->data.F + (size_t)s->col[e]*n; \
+                T acc = 0; \
+                _Pragma("omp simd reduction(+:acc)") \
+                for(int j=0; j<n; j++) acc += dc[j] * b[j]; \
+                pa->grad.F[e] += acc; \
+            } \
+        } \
+    } \
+}
+
+FOR_ALL_DTYPES(SPARSE_MATMUL_FORWARD)
+FOR_FLOAT_DTYPES(SPARSE_MATMUL_BACKWARD)
+
+#ifdef NAN_USE_OPENBLAS
+static void matmul_forward_blas_float32(Tensor *out){
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1];
+    int m = out->dims[out->ndim - 2], n = out->dims[out->ndim - 1], l = pa->dims[pa->ndim - 1];
+    for(int b=0; b<matmul_batches(out); b++){
+        int ia, ib;
+        matmul_batch_index(out, b, &ia, &ib);
+        if(m == 1)
+            cblas_sgemv(CblasRowMajor, CblasTrans, l, n, 1.0f, pb->data.float32 + (size_t)ib*l*n, n, pa->data.float32 + (size_t)ia*l, 1, 0.0f, out->data.float32 + (size_t)b*n, 1);
+        else
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, l, 1.0f, pa->data.float32 + (size_t)ia*m*l, l, pb->data.float32 + (size_t)ib*l*n, n, 0.0f, out->data.float32 + (size_t)b*m*n, n);
     }
 }
 
-Tensor * Div( Tensor * t1, Tensor *t2){
-    if(!t1 || !t2) return NULL;
-    if(t1->dtype != t2->dtype || t1->ndim != t2->ndim) return NULL;
-    for (int i = 0; i < t1->ndim; i++)
-    {
-        if(t1->dims[i]!= t2->dims[i]) return NULL;
+static void matmul_forward_blas_float64(Tensor *out){
+    Tensor *pa = out->prevs[0], *pb = out->prevs[1];
+    int m = out->dims[out->ndim - 2], n = out->dims[out->ndim - 1], l = pa->dims[pa->ndim - 1];
+    for(int b=0; b<matmul_batches(out); b++){
+        int ia, ib;
+        matmul_batch_index(out, b, &ia, &ib);
+        if(m == 1)
+            cblas_dgemv(CblasRowMajor, CblasTrans, l, n, 1.0, pb->data.float64 + (size_t)ib*l*n, n, pa->data.float64 + (size_t)ia*l, 1, 0.0, out->data.float64 + (size_t)b*n, 1);
+        else
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, l, 1.0, pa->data.float64 + (size_t)ia*m*l, l, pb->data.float64 + (size_t)ib*l*n, n, 0.0, out->data.float64 + (size_t)b*m*n, n);
     }
+}
+#define MATMUL_FLOAT32 matmul_forward_blas_float32
+#define MATMUL_FLOAT64 matmul_forward_blas_float64
+#else
+#define MATMUL_FLOAT32 matmul_forward_float32
+#define MATMUL_FLOAT64 matmul_forward_float64
+#endif
 
-    bool require_grad = (t1->requires_grad == true  || t2->requires_grad == true ) ? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
+// softmax along dimension `dim` (t->extra): the tensor is viewed as [outer, len, inner]
+static void softmax_layout(Tensor *t, int dim, int *outer, int *len, int *inner){
+    *outer = 1;
+    *inner = 1;
+    for(int i=0; i<dim; i++) *outer *= t->dims[i];
+    for(int i=dim+1; i<t->ndim; i++) *inner *= t->dims[i];
+    *len = t->dims[dim];
+}
 
-    switch (t1->dtype){
-    case FLOAT32:
-        // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-        for (int i = 0; i < t1->size; i++){
-            t->data.float32[i] = t1->data.float32[i] / t2->data.float32[i];
-        }
-        break;
-    case FLOAT64:
-        // #pragma omp parallel for simd  //multithreading or Parallelize the loop with SIMD
-        for (int i = 0; i < t1->size; i++){
-            t->data.float64[i] = t1->data.float64[i] / t2->data.float64[i];
-        }
-        break;
-    case INT:
-        // #pragma omp parallel for simd  //multithreading or Parallelize the loop with SIMD
-        for(int i=0; i<t1->size; i++){
-            t->data.float32[i] = t1->data.Int[i] / t2->data.Int[i];
+#define SOFTMAX_FORWARD(T, F, ...) FOR_EACH_ISA(SOFTMAX_FORWARD_ISA, T, F)
+#define SOFTMAX_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void softmax_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    T *o = out->data.F; \
+    int outer, len, inner; \
+    softmax_layout(out, (int)out->extra, &outer, &len, &inner); \
+    for(int p=0; p<outer; p++){ \
+        for(int q=0; q<inner; q++){ \
+            const T *xs = x + p*len*inner + q; \
+            T *os = o + p*len*inner + q; \
+            T max_val = xs[0]; \
+            for(int i=1; i<len; i++) if(xs[i*inner] > max_val) max_val = xs[i*inner]; \
+            T s = 0; \
+            for(int i=0; i<len; i++){ \
+                os[i*inner] = nan_exp(xs[i*inner] - max_val); \
+                s += os[i*inner]; \
+            } \
+            for(int i=0; i<len; i++) os[i*inner] /= s; \
+        } \
+    } \
+}
+
+// dx_i = s_i * (g_i - sum_j g_j s_j), the Jacobian-vector product of diag(s) - s s^T
+#define SOFTMAX_BACKWARD(T, F, ...) FOR_EACH_ISA(SOFTMAX_BACKWARD_ISA, T, F)
+#define SOFTMAX_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void softmax_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0]; \
+    if(p0->requires_grad != true) return; \
+    const T *s = out->data.F, *g = out->grad.F; \
+    T *gx = p0->grad.F; \
+    int outer, len, inner; \
+    softmax_layout(out, (int)out->extra, &outer, &len, &inner); \
+    for(int p=0; p<outer; p++){ \
+        for(int q=0; q<inner; q++){ \
+            int base = p*len*inner + q; \
+            T dot = 0; \
+            for(int i=0; i<len; i++) dot += g[base + i*inner] * s[base + i*inner]; \
+            for(int i=0; i<len; i++) gx[base + i*inner] += s[base + i*inner] * (g[base + i*inner] - dot); \
+        } \
+    } \
+}
+
+FOR_FLOAT_DTYPES(SOFTMAX_FORWARD)
+FOR_FLOAT_DTYPES(SOFTMAX_BACKWARD)
+
+// normalization over the last dim: x is viewed as [rows, n] and weight/bias are [n]. Row statistics come from
+// one pass (Welford for layer_norm, a sum of squares for rms_norm) and only mean/rstd per row are kept in
+// t->saved for the backward. eps is t->extra.
+
+// Welford over 8 interleaved lanes, which all see the same count so that 1/count is shared, merged at the end.
+// The data is shifted by x[0] so that rows with a large mean keep their precision.
+#define ROW_MOMENTS(T, F, ...) FOR_EACH_ISA(ROW_MOMENTS_ISA, T, F)
+#define ROW_MOMENTS_ISA(T, F, ISA, ATTR) \
+ATTR static void row_moments_##F##ISA(const T *x, int n, T *mean_out, T *var_out){ \
+    T mean[8] = {0}, m2[8] = {0}, shift = x[0]; \
+    int i = 0, cnt = 0; \
+    for(; i+8<=n; i+=8){ \
+        cnt++; \
+        T inv = (T)1 / cnt; \
+        for(int j=0; j<8; j++){ \
+            T xs = x[i+j] - shift; \
+            T delta = xs - mean[j]; \
+            mean[j] += delta * inv; \
+            m2[j] += delta * (xs - mean[j]); \
+        } \
+    } \
+    T mu = 0, M2 = 0; \
+    for(int j=0; j<8; j++) mu += mean[j]; \
+    mu = cnt ? mu / 8 : 0; \
+    for(int j=0; j<8; j++) M2 += m2[j] + cnt * (mean[j] - mu) * (mean[j] - mu); \
+    int total = 8 * cnt; \
+    for(; i<n; i++){ \
+        total++; \
+        T delta = (x[i] - shift) - mu; \
+        mu += delta / total; \
+        M2 += delta * ((x[i] - shift) - mu); \
+    } \
+    *mean_out = mu + shift; \
+    *var_out = M2 / n; \
+}
+
+// y = (x - mean) * rstd * w + b
+#define LAYER_NORM_FORWARD(T, F, ...) FOR_EACH_ISA(LAYER_NORM_FORWARD_ISA, T, F)
+#define LAYER_NORM_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void layer_norm_forward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0]; \
+    const T *w = out->prevs[1]->data.F, *bias = out->prevs[2]->data.F; \
+    int n = px->dims[px->ndim - 1], rows = px->size / n; \
+    T eps = (T)out->extra; \
+    T *stats = NULL; \
+    if(out->requires_grad == true){ \
+        if(!out->saved) out->saved = malloc((size_t)2 * rows * sizeof(T)); \
+        if(!out->saved){ \
+            fprintf(stderr, "Memory allocation failed \n"); \
+            return; \
+        } \
+        stats = (T *)out->saved; \
+    } \
+    _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+    for(int r=0; r<rows; r++){ \
+        const T *x = px->data.F + (size_t)r*n; \
+        T *y = out->data.F + (size_t)r*n; \
+        T mean, var; \
+        row_moments_##F##ISA(x, n, &mean, &var); \
+        T rstd = nan_rsqrt(var + eps); \
+        for(int j=0; j<n; j++) y[j] = (x[j] - mean) * rstd * w[j] + bias[j]; \
+        if(stats){ \
+            stats[2*r] = mean; \
+            stats[2*r + 1] = rstd; \
+        } \
+    } \
+}
+
+// with xh = (x - mean) * rstd and g = dy * w:  dx = rstd * (g - mean(g) - xh * mean(g * xh)),
+// dw = sum over rows of dy * xh, db = sum over rows of dy. dx is parallel over rows, dw/db over column blocks
+// so that every thread owns its slice of the parameter grads
+#define LAYER_NORM_BACKWARD(T, F, ...) FOR_EACH_ISA(LAYER_NORM_BACKWARD_ISA, T, F)
+#define LAYER_NORM_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void layer_norm_backward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0], *pw = out->prevs[1], *pb = out->prevs[2]; \
+    if(!out->saved) return; \
+    const T *stats = (const T *)out->saved, *w = pw->data.F, *dy = out->grad.F; \
+    int n = px->dims[px->ndim - 1], rows = px->size / n; \
+    if(px->requires_grad == true){ \
+        _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+        for(int r=0; r<rows; r++){ \
+            const T *x = px->data.F + (size_t)r*n, *g = dy + (size_t)r*n; \
+            T *dx = px->grad.F + (size_t)r*n; \
+            T mean = stats[2*r], rstd = stats[2*r + 1]; \
+            T sg = 0, sgx = 0; \
+            for(int j=0; j<n; j++){ \
+                T gw = g[j] * w[j]; \
+                sg += gw; \
+                sgx += gw * (x[j] - mean) * rstd; \
+            } \
+            sg /= n; \
+            sgx /= n; \
+            for(int j=0; j<n; j++){ \
+                T xh = (x[j] - mean) * rstd; \
+                dx[j] += rstd * (g[j] * w[j] - sg - xh * sgx); \
+            } \
+        } \
+    } \
+    if(pw->requires_grad == true || pb->requires_grad == true){ \
+        T *dw = pw->requires_grad == true ? pw->grad.F : NULL, *db = pb->requires_grad == true ? pb->grad.F : NULL; \
+        int blocks = (n + NORM_COL_BLOCK - 1) / NORM_COL_BLOCK; \
+        _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+        for(int b=0; b<blocks; b++){ \
+            int j0 = b * NORM_COL_BLOCK, j1 = j0 + NORM_COL_BLOCK < n ? j0 + NORM_COL_BLOCK : n; \
+            for(int r=0; r<rows; r++){ \
+                const T *x = px->data.F + (size_t)r*n, *g = dy + (size_t)r*n; \
+                T mean = stats[2*r], rstd = stats[2*r + 1]; \
+                if(dw) for(int j=j0; j<j1; j++) dw[j] += g[j] * (x[j] - mean) * rstd; \
+                if(db) for(int j=j0; j<j1; j++) db[j] += g[j]; \
+            } \
+        } \
+    } \
+}
+
+// y = x * rstd * w with rstd = 1 / sqrt(mean(x^2) + eps)
+#define RMS_NORM_FORWARD(T, F, ...) FOR_EACH_ISA(RMS_NORM_FORWARD_ISA, T, F)
+#define RMS_NORM_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void rms_norm_forward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0]; \
+    const T *w = out->prevs[1]->data.F; \
+    int n = px->dims[px->ndim - 1], rows = px->size / n; \
+    T eps = (T)out->extra; \
+    T *stats = NULL; \
+    if(out->requires_grad == true){ \
+        if(!out->saved) out->saved = malloc((size_t)rows * sizeof(T)); \
+        if(!out->saved){ \
+            fprintf(stderr, "Memory allocation failed \n"); \
+            return; \
+        } \
+        stats = (T *)out->saved; \
+    } \
+    _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+    for(int r=0; r<rows; r++){ \
+        const T *x = px->data.F + (size_t)r*n; \
+        T *y = out->data.F + (size_t)r*n; \
+        T part[8] = {0}, ss = 0; \
+        int i = 0; \
+        for(; i+8<=n; i+=8) \
+            for(int j=0; j<8; j++) part[j] += x[i+j] * x[i+j]; \
+        for(; i<n; i++) ss += x[i] * x[i]; \
+        for(int j=0; j<8; j++) ss += part[j]; \
+        T rstd = nan_rsqrt(ss / n + eps); \
+        for(int j=0; j<n; j++) y[j] = x[j] * rstd * w[j]; \
+        if(stats) stats[r] = rstd; \
+    } \
+}
+
+// with xh = x * rstd and g = dy * w:  dx = rstd * (g - xh * mean(g * xh)),  dw = sum over rows of dy * xh
+#define RMS_NORM_BACKWARD(T, F, ...) FOR_EACH_ISA(RMS_NORM_BACKWARD_ISA, T, F)
+#define RMS_NORM_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void rms_norm_backward_##F##ISA(Tensor *out){ \
+    Tensor *px = out->prevs[0], *pw = out->prevs[1]; \
+    if(!out->saved) return; \
+    const T *rstds = (const T *)out->saved, *w = pw->data.F, *dy = out->grad.F; \
+    int n = px->dims[px->ndim - 1], rows = px->size / n; \
+    if(px->requires_grad == true){ \
+        _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+        for(int r=0; r<rows; r++){ \
+            const T *x = px->data.F + (size_t)r*n, *g = dy + (size_t)r*n; \
+            T *dx = px->grad.F + (size_t)r*n; \
+            T rstd = rstds[r], sgx = 0; \
+            for(int j=0; j<n; j++) sgx += g[j] * w[j] * x[j] * rstd; \
+            sgx /= n; \
+            for(int j=0; j<n; j++) dx[j] += rstd * (g[j] * w[j] - x[j] * rstd * sgx); \
+        } \
+    } \
+    if(pw->requires_grad == true){ \
+        T *dw = pw->grad.F; \
+        int blocks = (n + NORM_COL_BLOCK - 1) / NORM_COL_BLOCK; \
+        _Pragma("omp parallel for schedule(static) if((size_t)rows * n > MATMUL_PARALLEL_MIN)") \
+        for(int b=0; b<blocks; b++){ \
+            int j0 = b * NORM_COL_BLOCK, j1 = j0 + NORM_COL_BLOCK < n ? j0 + NORM_COL_BLOCK : n; \
+            for(int r=0; r<rows; r++){ \
+                const T *x = px->data.F + (size_t)r*n, *g = dy + (size_t)r*n; \
+                T rstd = rstds[r]; \
+                for(int j=j0; j<j1; j++) dw[j] += g[j] * x[j] * rstd; \
+            } \
+        } \
+    } \
+}
+
+FOR_FLOAT_DTYPES(ROW_MOMENTS)
+FOR_FLOAT_DTYPES(LAYER_NORM_FORWARD)
+FOR_FLOAT_DTYPES(LAYER_NORM_BACKWARD)
+FOR_FLOAT_DTYPES(RMS_NORM_FORWARD)
+FOR_FLOAT_DTYPES(RMS_NORM_BACKWARD)
+
+// indexing: index_select and embedding pick whole slices of prevs[0] along dim t->extra with the INT indices in
+// prevs[1]; the source is viewed as [outer, len, inner] and the output as [outer, count, inner]. The backward
+// scatter-adds each output slice into the slice of the grad it came from, so only the rows that were looked up
+// are touched however large the table is. Threads own (outer, column block) pairs and walk the indices in
+// order, so repeated indices accumulate without atomics.
+static void index_layout(Tensor *src, int dim, int *outer, int *len, int *inner){
+    *outer = 1;
+    *inner = 1;
+    for(int i=0; i<dim; i++) *outer *= src->dims[i];
+    for(int i=dim+1; i<src->ndim; i++) *inner *= src->dims[i];
+    *len = src->dims[dim];
+}
+
+#define INDEX_SELECT_FORWARD(T, F, ...) FOR_EACH_ISA(INDEX_SELECT_FORWARD_ISA, T, F)
+#define INDEX_SELECT_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void index_select_forward_##F##ISA(Tensor *out){ \
+    Tensor *src = out->prevs[0]; \
+    const int *idx = out->prevs[1]->data.Int; \
+    int count = out->prevs[1]->size, outer, len, inner; \
+    index_layout(src, (int)out->extra, &outer, &len, &inner); \
+    _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)outer * count * inner > MATMUL_PARALLEL_MIN)") \
+    for(int o=0; o<outer; o++){ \
+        for(int i=0; i<count; i++){ \
+            memcpy(out->data.F + ((size_t)o*count + i)*inner, src->data.F + ((size_t)o*len + idx[i])*inner, \
+                   (size_t)inner * sizeof(T)); \
+        } \
+    } \
+}
+
+#define INDEX_SELECT_BACKWARD(T, F, ...) FOR_EACH_ISA(INDEX_SELECT_BACKWARD_ISA, T, F)
+#define INDEX_SELECT_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void index_select_backward_##F##ISA(Tensor *out){ \
+    Tensor *src = out->prevs[0]; \
+    if(src->requires_grad != true) return; \
+    const int *idx = out->prevs[1]->data.Int; \
+    int count = out->prevs[1]->size, outer, len, inner; \
+    index_layout(src, (int)out->extra, &outer, &len, &inner); \
+    int blocks = (inner + SCATTER_COL_BLOCK - 1) / SCATTER_COL_BLOCK; \
+    _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)outer * count * inner > MATMUL_PARALLEL_MIN)") \
+    for(int o=0; o<outer; o++){ \
+        for(int b=0; b<blocks; b++){ \
+            int j0 = b * SCATTER_COL_BLOCK, w = inner - j0 < SCATTER_COL_BLOCK ? inner - j0 : SCATTER_COL_BLOCK; \
+            for(int i=0; i<count; i++){ \
+                const T *g = out->grad.F + ((size_t)o*count + i)*inner + j0; \
+                T *gs = src->grad.F + ((size_t)o*len + idx[i])*inner + j0; \
+                for(int j=0; j<w; j++) gs[j] += g[j]; \
+            } \
+        } \
+    } \
+}
+
+// gather: out[o, i, k] = src[o, index[o, i, k], k] along dim t->extra, index having the shape of the output.
+// Every (o, k) fibre is independent, so the backward runs fibres in parallel and scatter-adds within each.
+#define GATHER_FORWARD(T, F, ...) FOR_EACH_ISA(GATHER_FORWARD_ISA, T, F)
+#define GATHER_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void gather_forward_##F##ISA(Tensor *out){ \
+    Tensor *src = out->prevs[0], *pi = out->prevs[1]; \
+    const int *idx = pi->data.Int; \
+    int dim = (int)out->extra, outer, len, inner, count = pi->dims[dim]; \
+    index_layout(src, dim, &outer, &len, &inner); \
+    _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)out->size > MATMUL_PARALLEL_MIN)") \
+    for(int o=0; o<outer; o++){ \
+        for(int i=0; i<count; i++){ \
+            size_t base = ((size_t)o*count + i)*inner; \
+            const T *s = src->data.F + (size_t)o*len*inner; \
+            for(int k=0; k<inner; k++) out->data.F[base + k] = s[(size_t)idx[base + k]*inner + k]; \
+        } \
+    } \
+}
+
+#define GATHER_BACKWARD(T, F, ...) FOR_EACH_ISA(GATHER_BACKWARD_ISA, T, F)
+#define GATHER_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void gather_backward_##F##ISA(Tensor *out){ \
+    Tensor *src = out->prevs[0], *pi = out->prevs[1]; \
+    if(src->requires_grad != true) return; \
+    const int *idx = pi->data.Int; \
+    int dim = (int)out->extra, outer, len, inner, count = pi->dims[dim]; \
+    index_layout(src, dim, &outer, &len, &inner); \
+    _Pragma("omp parallel for collapse(2) schedule(static) if((size_t)out->size > MATMUL_PARALLEL_MIN)") \
+    for(int o=0; o<outer; o++){ \
+        for(int k=0; k<inner; k++){ \
+            T *gs = src->grad.F + (size_t)o*len*inner + k; \
+            for(int i=0; i<count; i++){ \
+                size_t at = ((size_t)o*count + i)*inner + k; \
+                gs[(size_t)idx[at]*inner] += out->grad.F[at]; \
+            } \
+        } \
+    } \
+}
+
+FOR_ALL_DTYPES(INDEX_SELECT_FORWARD)
+FOR_FLOAT_DTYPES(INDEX_SELECT_BACKWARD)
+FOR_ALL_DTYPES(GATHER_FORWARD)
+FOR_FLOAT_DTYPES(GATHER_BACKWARD)
+
+// dropout
+// Element i of a call keeps its value when hash(i, key) >= p * 2^32: a counter-based generator has no state to
+// carry between elements, so the mask loop vectorizes and splits across threads like any elementwise op. Each
+// call draws a fresh 64-bit key from dropout_state. The mask is kept as one bit per element in t->saved.
+static uint64_t dropout_state = 0x853c49e6748fea9bULL;
+
+static inline uint32_t dropout_hash(uint32_t x){
+    x ^= x >> 16; x *= 0x7feb352dU;
+    x ^= x >> 15; x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint64_t dropout_next_key(void){
+    uint64_t z;
+    #pragma omp atomic capture
+    { dropout_state += 0x9e3779b97f4a7c15ULL; z = dropout_state; }
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// sets the generator behind every dropout mask that follows; not meant to race with a forward that draws masks
+void dropout_seed(uint64_t seed){
+    dropout_state = seed;
+}
+
+// one mask word (64 elements) per iteration, built 32 bits at a time so that the shifts stay in 32-bit lanes;
+// bits past the end of the tensor are drawn but never used
+#define DROPOUT_FORWARD(T, F, ...) FOR_EACH_ISA(DROPOUT_FORWARD_ISA, T, F)
+#define DROPOUT_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void dropout_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    T *o = out->data.F; \
+    int n = out->size, words = (n + 63) / 64; \
+    double p = out->extra; \
+    uint32_t threshold = (uint32_t)(p * 4294967296.0); \
+    T scale = (T)(1.0 / (1.0 - p)); \
+    uint64_t key = dropout_next_key(); \
+    uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32); \
+    uint64_t *mask = NULL; \
+    if(out->requires_grad){ \
+        if(!out->saved) out->saved = malloc(sizeof(uint64_t) * words); \
+        mask = out->saved; \
+        /* without the mask the backward would have nothing to apply */ \
+        if(!mask){ \
+            fprintf(stderr, "dropout: out of memory for the mask\n"); \
+            exit(EXIT_FAILURE); \
+        } \
+    } \
+    _Pragma("omp parallel for schedule(static) if((size_t)n > MATMUL_PARALLEL_MIN)") \
+    for(int w=0; w<words; w++){ \
+        uint64_t bits = 0; \
+        for(int j=0; j<2; j++){ \
+            int i0 = w*64 + j*32, count = n - i0 < 32 ? n - i0 : 32; \
+            uint32_t b = 0; \
+            _Pragma("omp simd reduction(|:b)") \
+            for(uint32_t k=0; k<32; k++){ \
+                uint32_t h = dropout_hash(dropout_hash(((uint32_t)i0 + k) ^ k0) ^ k1); \
+                b |= (uint32_t)(h >= threshold) << k; \
+            } \
+            _Pragma("omp simd") \
+            for(int k=0; k<count; k++) o[i0 + k] = x[i0 + k] * ((T)((b >> k) & 1) * scale); \
+            bits |= (uint64_t)b << (32*j); \
+        } \
+        if(mask) mask[w] = bits; \
+    } \
+}
+
+#define DROPOUT_BACKWARD(T, F, ...) FOR_EACH_ISA(DROPOUT_BACKWARD_ISA, T, F)
+#define DROPOUT_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void dropout_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0]; \
+    const uint64_t *mask = out->saved; \
+    if(p0->requires_grad != true) return; \
+    const T *go = out->grad.F; \
+    T *gx = p0->grad.F; \
+    int n = out->size, words = (n + 63) / 64; \
+    T scale = (T)(1.0 / (1.0 - out->extra)); \
+    _Pragma("omp parallel for schedule(static) if((size_t)n > MATMUL_PARALLEL_MIN)") \
+    for(int w=0; w<words; w++){ \
+        for(int j=0; j<2; j++){ \
+            int i0 = w*64 + j*32, count = n - i0 < 32 ? n - i0 : 32; \
+            uint32_t b = (uint32_t)(mask[w] >> (32*j)); \
+            _Pragma("omp simd") \
+            for(int k=0; k<count; k++) gx[i0 + k] += go[i0 + k] * ((T)((b >> k) & 1) * scale); \
+        } \
+    } \
+}
+
+FOR_FLOAT_DTYPES(DROPOUT_FORWARD)
+FOR_FLOAT_DTYPES(DROPOUT_BACKWARD)
+
+// scaled dot-product attention
+// q [..., Lq, d], k [..., Lk, d], v [..., Lk, dv] -> [..., Lq, dv]; every leading index is one head. Keys are
+// visited ATTN_BLOCK_K at a time with an online softmax (running max m, running sum l, unnormalised output acc),
+// so nothing of size Lq x Lk is ever stored. With `causal` (t->extra) query i sees keys up to i + Lk - Lq,
+// which lines the last query up with the last key when Lq < Lk (decoding against a longer history). When
+// Lq > Lk the first Lq - Lk queries see no key at all and, like fully masked rows, come out as zeros.
+
+// folds one block of `keys` keys into the softmax state of `rows` queries. S is ATTN_BLOCK_Q x ATTN_BLOCK_K
+// scratch and Kt d x ATTN_BLOCK_K scratch for the transposed keys, so that scores are computed for a whole
+// row of keys at once; for a few rows (decoding) the transpose costs more than it saves and plain dot
+// products are used instead. mask (if any) points at the mask entry of (row 0, key 0) of the block, row stride ldm.
+// Query row r is at absolute position q0 + r and key c at k0 + c; with `causal` it sees keys up to q0 + r + shift.
+#define ATTENTION_BLOCK(T, F, ...) FOR_EACH_ISA(ATTENTION_BLOCK_ISA, T, F)
+#define ATTENTION_BLOCK_ISA(T, F, ISA, ATTR) \
+ATTR static void attention_block_##F##ISA(const T *Q, int rows, int d, const T *K, const T *V, int keys, int dv, \
+                                          const T *mask, int ldm, int q0, int k0, bool causal, int shift, T scale, \
+                                          T *S, T *Kt, T *mrow, T *lrow, T *acc){ \
+    bool transposed = rows >= ATTN_TRANSPOSE_ROWS; \
+    if(transposed) \
+        for(int c=0; c<keys; c++) \
+            for(int j=0; j<d; j++) Kt[(size_t)j*ATTN_BLOCK_K + c] = K[(size_t)c*d + j]; \
+    for(int r=0; r<rows; r++){ \
+        const T *q = Q + (size_t)r*d; \
+        T *s = S + (size_t)r*ATTN_BLOCK_K; \
+        int visible = keys; \
+        if(causal){ \
+            visible = q0 + r + shift - k0 + 1; \
+            if(visible > keys) visible = keys; \
+            if(visible <= 0) continue; \
+        } \
+        if(transposed){ \
+            for(int c=0; c<visible; c++) s[c] = 0; \
+            for(int j=0; j<d; j++){ \
+                T qj = q[j] * scale; \
+                const T *kt = Kt + (size_t)j*ATTN_BLOCK_K; \
+                _Pragma("omp simd") \
+                for(int c=0; c<visible; c++) s[c] += qj * kt[c]; \
+            } \
+        }else{ \
+            for(int c=0; c<visible; c++){ \
+                const T *kc = K + (size_t)c*d; \
+                T dot = 0; \
+                _Pragma("omp simd reduction(+:dot)") \
+                for(int j=0; j<d; j++) dot += q[j] * kc[j]; \
+                s[c] = dot * scale; \
+            } \
+        } \
+        if(mask) \
+            for(int c=0; c<visible; c++) s[c] += mask[(size_t)r*ldm + c]; \
+        T mx = mrow[r]; \
+        for(int c=0; c<visible; c++) mx = s[c] > mx ? s[c] : mx; \
+        /* every key so far is masked out */ \
+        if(mx == -INFINITY) continue; \
+        T corr = mrow[r] == -INFINITY ? 0 : nan_exp(mrow[r] - mx); \
+        T sum = 0; \
+        for(int c=0; c<visible; c++){ \
+            s[c] = nan_exp(s[c] - mx); \
+            sum += s[c]; \
+        } \
+        lrow[r] = lrow[r] * corr + sum; \
+        mrow[r] = mx; \
+        T *a = acc + (size_t)r*dv; \
+        for(int j=0; j<dv; j++) a[j] *= corr; \
+        for(int c=0; c<visible; c++){ \
+            T p = s[c]; \
+            const T *vc = V + (size_t)c*dv; \
+            _Pragma("omp simd") \
+            for(int j=0; j<dv; j++) a[j] += p * vc[j]; \
+        } \
+    } \
+}
+
+// (head, query block) tiles run in parallel. The logsumexp m + log(l) of every query row is kept in t->saved
+// so that the backward can rebuild each probability without a second pass over the keys.
+#define ATTENTION_FORWARD(T, F, ...) FOR_EACH_ISA(ATTENTION_FORWARD_ISA, T, F)
+#define ATTENTION_FORWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void attention_forward_##F##ISA(Tensor *out){ \
+    Tensor *pq = out->prevs[0], *pk = out->prevs[1], *pv = out->prevs[2]; \
+    Tensor *pm = out->num_prevs > 3 ? out->prevs[3] : NULL; \
+    int nd = out->ndim, Lq = pq->dims[nd - 2], d = pq->dims[nd - 1], Lk = pk->dims[nd - 2], dv = pv->dims[nd - 1]; \
+    int heads = out->size / (Lq * dv), qblocks = (Lq + ATTN_BLOCK_Q - 1) / ATTN_BLOCK_Q; \
+    bool causal = out->extra != 0; \
+    int shift = Lk - Lq; \
+    size_t mask_stride = pm && pm->ndim > 2 ? (size_t)Lq * Lk : 0; \
+    T scale = 1 / nan_sqrt((T)d); \
+    T *lse = NULL; \
+    if(out->requires_grad == true){ \
+        if(!out->saved) out->saved = malloc((size_t)heads * Lq * sizeof(T)); \
+        if(!out->saved){ \
+            fprintf(stderr, "Memory allocation failed \n"); \
+            return; \
+        } \
+        lse = (T *)out->saved; \
+    } \
+    _Pragma("omp parallel") \
+    { \
+        T *S = (T *)malloc(((size_t)ATTN_BLOCK_Q * (ATTN_BLOCK_K + 2 + dv) + (size_t)d * ATTN_BLOCK_K) * sizeof(T)); \
+        if(!S) fprintf(stderr, "Memory allocation failed \n"); \
+        _Pragma("omp for collapse(2) schedule(static)") \
+        for(int h=0; h<heads; h++){ \
+            for(int qb=0; qb<qblocks; qb++){ \
+                if(!S) continue; \
+                T *mrow = S + (size_t)ATTN_BLOCK_Q * ATTN_BLOCK_K, *lrow = mrow + ATTN_BLOCK_Q, *acc = lrow + ATTN_BLOCK_Q; \
+                T *Kt = acc + (size_t)ATTN_BLOCK_Q * dv; \
+                int q0 = qb * ATTN_BLOCK_Q, rows = Lq - q0 < ATTN_BLOCK_Q ? Lq - q0 : ATTN_BLOCK_Q; \
+                const T *Q = pq->data.F + ((size_t)h*Lq + q0)*d; \
+                const T *K = pk->data.F + (size_t)h*Lk*d, *V = pv->data.F + (size_t)h*Lk*dv; \
+                const T *M = pm ? pm->data.F + h*mask_stride + (size_t)q0*Lk : NULL; \
+                for(int r=0; r<rows; r++){ \
+                    mrow[r] = -INFINITY; \
+                    lrow[r] = 0; \
+                } \
+                memset(acc, 0, (size_t)rows * dv * sizeof(T)); \
+                for(int k0=0; k0<Lk; k0+=ATTN_BLOCK_K){ \
+                    if(causal && k0 > q0 + rows - 1 + shift) break; \
+                    int keys = Lk - k0 < ATTN_BLOCK_K ? Lk - k0 : ATTN_BLOCK_K; \
+                    attention_block_##F##ISA(Q, rows, d, K + (size_t)k0*d, V + (size_t)k0*dv, keys, dv, \
+                                             M ? M + k0 : NULL, Lk, q0, k0, causal, shift, scale, S, Kt, mrow, lrow, acc); \
+                } \
+                T *O = out->data.F + ((size_t)h*Lq + q0)*dv; \
+                for(int r=0; r<rows; r++){ \
+                    /* a row whose keys are all masked out attends to nothing */ \
+                    T inv = lrow[r] > 0 ? 1 / lrow[r] : 0; \
+                    for(int j=0; j<dv; j++) O[(size_t)r*dv + j] = acc[(size_t)r*dv + j] * inv; \
+                    if(lse) lse[(size_t)h*Lq + q0 + r] = lrow[r] > 0 ? mrow[r] + nan_log(lrow[r]) : -INFINITY; \
+                } \
+            } \
+        } \
+        free(S); \
+    } \
+}
+
+// with P = exp(S - lse) rebuilt block by block and D_i = dO_i . O_i:
+//   dV += P^T dO,  dS = P * (dO V^T - D),  dQ += scale dS K,  dK += scale dS^T Q
+// tiled like the forward. Heads run in parallel; within a head every gradient row has a single writer.
+// The mask is a constant and gets no gradient.
+#define ATTENTION_BACKWARD(T, F, ...) FOR_EACH_ISA(ATTENTION_BACKWARD_ISA, T, F)
+#define ATTENTION_BACKWARD_ISA(T, F, ISA, ATTR) \
+ATTR static void attention_backward_##F##ISA(Tensor *out){ \
+    Tensor *pq = out->prevs[0], *pk = out->prevs[1], *pv = out->prevs[2]; \
+    Tensor *pm = out->num_prevs > 3 ? out->prevs[3] : NULL; \
+    if(!out->saved) return; \
+    bool gq = pq->requires_grad == true, gk = pk->requires_grad == true, gv = pv->requires_grad == true; \
+    if(!gq && !gk && !gv) return; \
+    int nd = out->ndim, Lq = pq->dims[nd - 2], d = pq->dims[nd - 1], Lk = pk->dims[nd - 2], dv = pv->dims[nd - 1]; \
+    int heads = out->size / (Lq * dv); \
+    bool causal = out->extra != 0; \
+    int shift = Lk - Lq; \
+    size_t mask_stride = pm && pm->ndim > 2 ? (size_t)Lq * Lk : 0; \
+    T scale = 1 / nan_sqrt((T)d); \
+    const T *lse = (const T *)out->saved; \
+    _Pragma("omp parallel") \
+    { \
+        /* P and dS rows, D per query row, the transposed key and value blocks */ \
+        T *P = (T *)malloc(((size_t)2 * ATTN_BLOCK_K + ATTN_BLOCK_Q + (size_t)(d + dv) * ATTN_BLOCK_K) * sizeof(T)); \
+        if(!P) fprintf(stderr, "Memory allocation failed \n"); \
+        _Pragma("omp for schedule(dynamic)") \
+        for(int h=0; h<heads; h++){ \
+            if(!P) continue; \
+            T *dS = P + ATTN_BLOCK_K, *Drow = dS + ATTN_BLOCK_K, *Kt = Drow + ATTN_BLOCK_Q, *Vt = Kt + (size_t)d*ATTN_BLOCK_K; \
+            const T *Q = pq->data.F + (size_t)h*Lq*d, *K = pk->data.F + (size_t)h*Lk*d, *V = pv->data.F + (size_t)h*Lk*dv; \
+            const T *O = out->data.F + (size_t)h*Lq*dv, *dO = out->grad.F + (size_t)h*Lq*dv; \
+            const T *M = pm ? pm->data.F + h*mask_stride : NULL; \
+            T *dQ = gq ? pq->grad.F + (size_t)h*Lq*d : NULL; \
+            T *dK = gk ? pk->grad.F + (size_t)h*Lk*d : NULL; \
+            T *dV = gv ? pv->grad.F + (size_t)h*Lk*dv : NULL; \
+            for(int q0=0; q0<Lq; q0+=ATTN_BLOCK_Q){ \
+                int rows = Lq - q0 < ATTN_BLOCK_Q ? Lq - q0 : ATTN_BLOCK_Q; \
+                for(int r=0; r<rows; r++){ \
+                    const T *o = O + (size_t)(q0 + r)*dv, *go = dO + (size_t)(q0 + r)*dv; \
+                    T D = 0; \
+                    for(int j=0; j<dv; j++) D += go[j] * o[j]; \
+                    Drow[r] = D; \
+                } \
+                for(int k0=0; k0<Lk; k0+=ATTN_BLOCK_K){ \
+                    if(causal && k0 > q0 + rows - 1 + shift) break; \
+                    int keys = Lk - k0 < ATTN_BLOCK_K ? Lk - k0 : ATTN_BLOCK_K; \
+                    for(int c=0; c<keys; c++){ \
+                        for(int j=0; j<d; j++) Kt[(size_t)j*ATTN_BLOCK_K + c] = K[(size_t)(k0 + c)*d + j]; \
+                        for(int j=0; j<dv; j++) Vt[(size_t)j*ATTN_BLOCK_K + c] = V[(size_t)(k0 + c)*dv + j]; \
+                    } \
+                    for(int r=0; r<rows; r++){ \
+                        int i = q0 + r; \
+                        T row_lse = lse[(size_t)h*Lq + i]; \
+                        if(row_lse == -INFINITY) continue; \
+                        const T *q = Q + (size_t)i*d, *go = dO + (size_t)i*dv; \
+                        int visible = keys; \
+                        if(causal){ \
+                            visible = i + shift - k0 + 1; \
+                            if(visible > keys) visible = keys; \
+                            if(visible <= 0) continue; \
+                        } \
+                        for(int c=0; c<visible; c++){ \
+                            P[c] = M ? M[(size_t)i*Lk + k0 + c] - row_lse : -row_lse; \
+                            dS[c] = -Drow[r]; \
+                        } \
+                        for(int j=0; j<d; j++){ \
+                            T qj = q[j] * scale; \
+                            const T *kt = Kt + (size_t)j*ATTN_BLOCK_K; \
+                            _Pragma("omp simd") \
+                            for(int c=0; c<visible; c++) P[c] += qj * kt[c]; \
+                        } \
+                        for(int j=0; j<dv; j++){ \
+                            T gj = go[j]; \
+                            const T *vt = Vt + (size_t)j*ATTN_BLOCK_K; \
+                            _Pragma("omp simd") \
+                            for(int c=0; c<visible; c++) dS[c] += gj * vt[c]; \
+                        } \
+                        for(int c=0; c<visible; c++){ \
+                            /* masked keys come out as exp(-inf) = 0 */ \
+                            P[c] = P[c] == -INFINITY ? 0 : nan_exp(P[c]); \
+                            dS[c] *= P[c] * scale; \
+                        } \
+                        for(int c=0; c<visible; c++){ \
+                            T p = P[c], ds = dS[c]; \
+                            if(dV){ \
+                                T *dvc = dV + (size_t)(k0 + c)*dv; \
+                                _Pragma("omp simd") \
+                                for(int j=0; j<dv; j++) dvc[j] += p * go[j]; \
+                            } \
+                            if(dK){ \
+                                T *dkc = dK + (size_t)(k0 + c)*d; \
+                                _Pragma("omp simd") \
+                                for(int j=0; j<d; j++) dkc[j] += ds * q[j]; \
+                            } \
+                            if(dQ){ \
+                                T *dq = dQ + (size_t)i*d; \
+                                const T *kc = K + (size_t)(k0 + c)*d; \
+                                _Pragma("omp simd") \
+                                for(int j=0; j<d; j++) dq[j] += ds * kc[j]; \
+                            } \
+                        } \
+                    } \
+                } \
+            } \
+        } \
+        free(P); \
+    } \
+}
+
+FOR_FLOAT_DTYPES(ATTENTION_BLOCK)
+FOR_FLOAT_DTYPES(ATTENTION_FORWARD)
+FOR_FLOAT_DTYPES(ATTENTION_BACKWARD)
+
+// KV cache
+// Keys and values of past tokens for incremental decoding, stored per layer in pages of `block_size` tokens.
+// A page is [heads, block_size, d] (values: dv), so the keys of one head inside a page are contiguous and
+// attention walks them in place with attention_block. Pages never move: the cache grows by adding pages to
+// the page table, so appending a token costs a copy of that token only.
+typedef struct{
+    DType dtype;
+    int layers, heads, d, dv;
+    int block_size;   // tokens per page
+    int *len;         // tokens stored, per layer
+    int *num_pages;   // pages allocated, per layer
+    int *page_cap;    // size of the page tables, per layer
+    void ***k_pages;  // [layer][page] -> [heads, block_size, d]
+    void ***v_pages;  // [layer][page] -> [heads, block_size, dv]
+}KVCache;
+
+// out[heads, Lq, dv] = attention of q[heads, Lq, d] over the `len` cached tokens of `layer`
+#define KV_ATTENTION(T, F, ...) FOR_EACH_ISA(KV_ATTENTION_ISA, T, F)
+#define KV_ATTENTION_ISA(T, F, ISA, ATTR) \
+ATTR static void kv_attention_##F##ISA(const KVCache *c, int layer, const T *Qd, int Lq, T *Od, bool causal){ \
+    int len = c->len[layer], bs = c->block_size, d = c->d, dv = c->dv, heads = c->heads; \
+    int qblocks = (Lq + ATTN_BLOCK_Q - 1) / ATTN_BLOCK_Q, shift = len - Lq; \
+    T scale = 1 / nan_sqrt((T)d); \
+    _Pragma("omp parallel if((size_t)heads * Lq * len * (d + dv) > MATMUL_PARALLEL_MIN)") \
+    { \
+        T *S = (T *)malloc(((size_t)ATTN_BLOCK_Q * (ATTN_BLOCK_K + 2 + dv) + (size_t)d * ATTN_BLOCK_K) * sizeof(T)); \
+        if(!S) fprintf(stderr, "Memory allocation failed \n"); \
+        _Pragma("omp for collapse(2) schedule(static)") \
+        for(int h=0; h<heads; h++){ \
+            for(int qb=0; qb<qblocks; qb++){ \
+                if(!S) continue; \
+                T *mrow = S + (size_t)ATTN_BLOCK_Q * ATTN_BLOCK_K, *lrow = mrow + ATTN_BLOCK_Q, *acc = lrow + ATTN_BLOCK_Q; \
+                T *Kt = acc + (size_t)ATTN_BLOCK_Q * dv; \
+                int q0 = qb * ATTN_BLOCK_Q, rows = Lq - q0 < ATTN_BLOCK_Q ? Lq - q0 : ATTN_BLOCK_Q; \
+                const T *Q = Qd + ((size_t)h*Lq + q0)*d; \
+                for(int r=0; r<rows; r++){ \
+                    mrow[r] = -INFINITY; \
+                    lrow[r] = 0; \
+                } \
+                memset(acc, 0, (size_t)rows * dv * sizeof(T)); \
+                for(int p=0; p*bs < len; p++){ \
+                    const T *K = (const T *)c->k_pages[layer][p] + (size_t)h*bs*d; \
+                    const T *V = (const T *)c->v_pages[layer][p] + (size_t)h*bs*dv; \
+                    int in_page = len - p*bs < bs ? len - p*bs : bs; \
+                    for(int off=0; off<in_page; off+=ATTN_BLOCK_K){ \
+                        int k0 = p*bs + off; \
+                        if(causal && k0 > q0 + rows - 1 + shift) break; \
+                        int keys = in_page - off < ATTN_BLOCK_K ? in_page - off : ATTN_BLOCK_K; \
+                        attention_block_##F##ISA(Q, rows, d, K + (size_t)off*d, V + (size_t)off*dv, keys, dv, \
+                                                 NULL, 0, q0, k0, causal, shift, scale, S, Kt, mrow, lrow, acc); \
+                    } \
+                } \
+                T *O = Od + ((size_t)h*Lq + q0)*dv; \
+                for(int r=0; r<rows; r++){ \
+                    T inv = lrow[r] > 0 ? 1 / lrow[r] : 0; \
+                    for(int j=0; j<dv; j++) O[(size_t)r*dv + j] = acc[(size_t)r*dv + j] * inv; \
+                } \
+            } \
+        } \
+        free(S); \
+    } \
+}
+
+FOR_FLOAT_DTYPES(KV_ATTENTION)
+
+// reductions to a scalar; SCALE turns the sum into the op's value (1 for sum, 1/n for mean).
+// `one` is a T-typed 1 so that scale expressions stay in the kernel's precision
+#define REDUCE_FORWARD(T, F, NAME, SCALE) FOR_EACH_ISA(REDUCE_FORWARD_ISA, T, F, NAME, SCALE)
+#define REDUCE_FORWARD_ISA(T, F, NAME, SCALE, ISA, ATTR) \
+ATTR static void NAME##_forward_##F##ISA(Tensor *out){ \
+    const T *x = out->prevs[0]->data.F; \
+    int n = out->prevs[0]->size; \
+    const T one = 1; \
+    (void)one; \
+    /* independent partial sums so the loop vectorizes without reassociation flags */ \
+    T part[8] = {0}; \
+    int i = 0; \
+    for(; i+8<=n; i+=8){ \
+        for(int j=0; j<8; j++) part[j] += x[i+j]; \
+    } \
+    T acc = 0; \
+    for(; i<n; i++) acc += x[i]; \
+    for(int j=0; j<8; j++) acc += part[j]; \
+    out->data.F[0] = acc * (SCALE); \
+}
+
+#define REDUCE_BACKWARD(T, F, NAME, SCALE) FOR_EACH_ISA(REDUCE_BACKWARD_ISA, T, F, NAME, SCALE)
+#define REDUCE_BACKWARD_ISA(T, F, NAME, SCALE, ISA, ATTR) \
+ATTR static void NAME##_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0]; \
+    if(p0->requires_grad != true) return; \
+    int n = p0->size; \
+    const T one = 1; \
+    (void)one; \
+    T g = out->grad.F[0] * (SCALE); \
+    for(int i=0; i<n; i++) p0->grad.F[i] += g; \
+}
+
+FOR_ALL_DTYPES(REDUCE_FORWARD, sum, 1)
+FOR_FLOAT_DTYPES(REDUCE_BACKWARD, sum, 1)
+
+FOR_FLOAT_DTYPES(REDUCE_FORWARD, mean, one / n)
+FOR_FLOAT_DTYPES(REDUCE_BACKWARD, mean, one / n)
+
+// losses over (yTrue, yPred): LOSS accumulates per element pair, SCALE normalises the total, DPRED is d(loss)/d(yPred[i])
+#define LOSS_FORWARD(T, F, NAME, LOSS, SCALE, DPRED) FOR_EACH_ISA(LOSS_FORWARD_ISA, T, F, NAME, LOSS, SCALE, DPRED)
+#define LOSS_FORWARD_ISA(T, F, NAME, LOSS, SCALE, DPRED, ISA, ATTR) \
+ATTR static void NAME##_forward_##F##ISA(Tensor *out){ \
+    const T *yt = out->prevs[0]->data.F, *yp = out->prevs[1]->data.F; \
+    int n = out->prevs[1]->size; \
+    const T one = 1; \
+    (void)one; \
+    T part[8] = {0}; \
+    int i = 0; \
+    for(; i+8<=n; i+=8){ \
+        for(int j=0; j<8; j++){ \
+            T a = yt[i+j], b = yp[i+j]; \
+            part[j] += (LOSS); \
+        } \
+    } \
+    T acc = 0; \
+    for(; i<n; i++){ \
+        T a = yt[i], b = yp[i]; \
+        acc += (LOSS); \
+    } \
+    for(int j=0; j<8; j++) acc += part[j]; \
+    out->data.F[0] = acc * (SCALE); \
+}
+
+#define LOSS_BACKWARD(T, F, NAME, LOSS, SCALE, DPRED) FOR_EACH_ISA(LOSS_BACKWARD_ISA, T, F, NAME, LOSS, SCALE, DPRED)
+#define LOSS_BACKWARD_ISA(T, F, NAME, LOSS, SCALE, DPRED, ISA, ATTR) \
+ATTR static void NAME##_backward_##F##ISA(Tensor *out){ \
+    Tensor *p0 = out->prevs[0], *p1 = out->prevs[1]; \
+    const T *yt = p0->data.F, *yp = p1->data.F; \
+    int n = p1->size; \
+    const T one = 1; \
+    (void)one; \
+    T g = out->grad.F[0]; \
+    for(int i=0; i<n; i++){ \
+        T a = yt[i], b = yp[i]; \
+        T d = g * (DPRED); \
+        if(p1->requires_grad == true) p1->grad.F[i] += d; \
+        if(p0->requires_grad == true) p0->grad.F[i] -= d; \
+    } \
+}
+
+#define MSE_ARGS mse, (a - b) * (a - b), one / (2 * n), (b - a) / n
+#define MAE_ARGS mae, nan_abs(a - b), one / n, ((b > a) - (b < a)) * one / n
+
+FOR_FLOAT_DTYPES(LOSS_FORWARD, MSE_ARGS)
+FOR_FLOAT_DTYPES(LOSS_BACKWARD, MSE_ARGS)
+FOR_FLOAT_DTYPES(LOSS_FORWARD, MAE_ARGS)
+FOR_FLOAT_DTYPES(LOSS_BACKWARD, MAE_ARGS)
+
+// shape functions
+static bool shape_same(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)extra;
+    for(int k=1; k<n; k++){
+        if(in[k]->ndim != in[0]->ndim) return false;
+        for(int i=0; i<in[0]->ndim; i++){
+            if(in[k]->dims[i] != in[0]->dims[i]) return false;
         }
-        break;
-    default:
-        // t_free(t);
-        fprintf(stderr, "Unsupported data type \n");
-        return NULL;
-        break;
     }
-    t->op=DIV;
-    t->num_prevs=2;
-    t->prevs[0]= t1;
-    t->prevs[1]= t2;
-    
-    return t;
+    *ndim = in[0]->ndim;
+    memcpy(dims, in[0]->dims, sizeof(int) * in[0]->ndim);
+    return true;
 }
 
-void Div_backward(Tensor *out){
-    if(!out) return;
+static bool shape_scalar(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)in; (void)n; (void)extra;
+    dims[0] = 1;
+    *ndim = 1;
+    return true;
+}
 
-    switch (out->dtype){
-    case FLOAT32:
-        if(out->prevs[0]->requires_grad==true){
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < out->size; i++){
-                out->prevs[0]->grad.float32[i] += out->grad.float32[i]/out->prevs[1]->data.float32[i]; 
-            }
+static bool shape_loss(Tensor **in, int n, double extra, int *dims, int *ndim){
+    return shape_same(in, n, extra, dims, ndim) && shape_scalar(in, n, extra, dims, ndim);
+}
+
+// [..., m, l] @ [..., l, n] -> [..., m, n], leading dims broadcast from the right
+static bool shape_matmul(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n; (void)extra;
+    Tensor *a = in[0], *b = in[1];
+    if(a->ndim < 2 || b->ndim < 2 || a->dims[a->ndim - 1] != b->dims[b->ndim - 2]) return false;
+    int nd = a->ndim > b->ndim ? a->ndim : b->ndim;
+    for(int d=0; d<nd-2; d++){
+        int da = d - (nd - a->ndim), db = d - (nd - b->ndim);
+        int sa = da >= 0 ? a->dims[da] : 1, sb = db >= 0 ? b->dims[db] : 1;
+        if(sa != sb && sa != 1 && sb != 1) return false;
+        dims[d] = sa > sb ? sa : sb;
+    }
+    dims[nd - 2] = a->dims[a->ndim - 2];
+    dims[nd - 1] = b->dims[b->ndim - 1];
+    *ndim = nd;
+    return true;
+}
+
+// [..., m, l] @ packed [l, n] -> [..., m, n]
+static bool shape_matmul_packed(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n; (void)extra;
+    Tensor *x = in[0], *w = in[1];
+    if(w->ndim != 3 || w->dims[2] != PACK_COLS || x->dims[x->ndim - 1] != w->dims[1]) return false;
+    memcpy(dims, x->dims, sizeof(int) * x->ndim);
+    dims[x->ndim - 1] = (int)w->extra;
+    *ndim = x->ndim;
+    return true;
+}
+
+// sparse [m, l] @ [l, n] -> [m, n]; the first input must come from sparse_from_coo() or sparse_from_dense()
+static bool shape_sparse_matmul(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n; (void)extra;
+    Tensor *a = in[0], *b = in[1];
+    const SparseIndex *s = sparse_index(a);
+    if(!s || b->ndim != 2 || b->dims[0] != s->cols) return false;
+    dims[0] = s->rows;
+    dims[1] = b->dims[1];
+    *ndim = 2;
+    return true;
+}
+
+// q [..., Lq, d], k [..., Lk, d], v [..., Lk, dv] (+ mask [Lq, Lk] or [..., Lq, Lk]) -> [..., Lq, dv]
+static bool shape_attention(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)extra;
+    Tensor *q = in[0], *k = in[1], *v = in[2];
+    int nd = q->ndim;
+    if(nd < 2 || k->ndim != nd || v->ndim != nd) return false;
+    for(int i=0; i<nd-2; i++){
+        if(k->dims[i] != q->dims[i] || v->dims[i] != q->dims[i]) return false;
+    }
+    if(k->dims[nd - 1] != q->dims[nd - 1] || v->dims[nd - 2] != k->dims[nd - 2]) return false;
+    if(n > 3){
+        Tensor *m = in[3];
+        if(m->ndim != 2 && m->ndim != nd) return false;
+        for(int i=0; i<m->ndim-2; i++){
+            if(m->dims[i] != q->dims[i]) return false;
         }
-        if(out->prevs[1]->requires_grad==true){
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < out->size; i++){
-                out->prevs[1]->grad.float32[i] += (-out->grad.float32[i] * out->prevs[0]->data.float32[i]) / pow(out->prevs[1]->data.float32[i] , 2);
-            }
+        if(m->dims[m->ndim - 2] != q->dims[nd - 2] || m->dims[m->ndim - 1] != k->dims[nd - 2]) return false;
+    }
+    memcpy(dims, q->dims, sizeof(int) * nd);
+    dims[nd - 1] = v->dims[nd - 1];
+    *ndim = nd;
+    return true;
+}
+
+// x [..., n] with weight (and bias) [n] -> [..., n]
+static bool shape_norm(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)extra;
+    Tensor *x = in[0];
+    for(int i=1; i<n; i++){
+        if(in[i]->ndim != 1 || in[i]->dims[0] != x->dims[x->ndim - 1]) return false;
+    }
+    *ndim = x->ndim;
+    memcpy(dims, x->dims, sizeof(int) * x->ndim);
+    return true;
+}
+
+// t [..., len, ...] with 1-d indices [count] along dim -> [..., count, ...]
+static bool shape_index_select(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n;
+    if(in[1]->ndim != 1) return false;
+    *ndim = in[0]->ndim;
+    memcpy(dims, in[0]->dims, sizeof(int) * in[0]->ndim);
+    dims[(int)extra] = in[1]->size;
+    return true;
+}
+
+// weight [V, D] looked up with indices [...] -> [..., D]
+static bool shape_embedding(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n; (void)extra;
+    if(in[0]->ndim != 2 || in[1]->ndim + 1 > MAX_DIMS) return false;
+    memcpy(dims, in[1]->dims, sizeof(int) * in[1]->ndim);
+    dims[in[1]->ndim] = in[0]->dims[1];
+    *ndim = in[1]->ndim + 1;
+    return true;
+}
+
+// the index has the shape of the output and matches t on every dim but the gathered one
+static bool shape_gather(Tensor **in, int n, double extra, int *dims, int *ndim){
+    (void)n; (void)extra;
+    if(in[1]->ndim != in[0]->ndim) return false;
+    *ndim = in[1]->ndim;
+    memcpy(dims, in[1]->dims, sizeof(int) * in[1]->ndim);
+    return true;
+}
+
+// nominal forward FLOPs of the ops that do more than a few per element (multiply-adds count as two)
+static double flops_matmul(Tensor *out){
+    Tensor *a = out->prevs[0];
+    return 2.0 * out->size * a->dims[a->ndim - 1];
+}
+
+static double flops_matmul_packed(Tensor *out){
+    return 2.0 * out->size * out->prevs[1]->dims[1];
+}
+
+static double flops_sparse_matmul(Tensor *out){
+    return 2.0 * out->prevs[0]->size * out->dims[1];
+}
+
+// scores and the weighted sum of values, for every (query, key) pair; causal masking is not discounted
+static double flops_attention(Tensor *out){
+    Tensor *q = out->prevs[0], *k = out->prevs[1];
+    int nd = q->ndim, d = q->dims[nd - 1], dv = out->dims[nd - 1];
+    return 2.0 * (out->size / dv) * k->dims[nd - 2] * (d + dv);
+}
+
+#define FLOAT_KERNELS(NAME) {NAME##_float32, NAME##_float64, NULL}
+#define ALL_KERNELS(NAME) {NAME##_float32, NAME##_float64, NAME##_Int}
+
+static OpDesc op_table[NUM_OPS] = {
+    [ADD]        = {"add", 2, OP_ELEMENTWISE | OP_FUSABLE, shape_same, ALL_KERNELS(add_forward), FLOAT_KERNELS(add_backward)},
+    [SUB]        = {"sub", 2, OP_ELEMENTWISE | OP_FUSABLE, shape_same, ALL_KERNELS(sub_forward), FLOAT_KERNELS(sub_backward)},
+    [MUL]        = {"mul", 2, OP_ELEMENTWISE | OP_FUSABLE, shape_same, ALL_KERNELS(mul_forward), FLOAT_KERNELS(mul_backward)},
+    [DIV]        = {"div", 2, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(div_forward), FLOAT_KERNELS(div_backward)},
+    [MATMUL]     = {"matmul", 2, 0, shape_matmul, {MATMUL_FLOAT32, MATMUL_FLOAT64, matmul_forward_Int}, FLOAT_KERNELS(matmul_backward), flops_matmul},
+    [MATMUL_PACKED] = {"matmul_packed", 2, 0, shape_matmul_packed, ALL_KERNELS(matmul_packed_forward), FLOAT_KERNELS(matmul_packed_backward), flops_matmul_packed},
+    [SPARSE_MATMUL] = {"sparse_matmul", 2, 0, shape_sparse_matmul, ALL_KERNELS(sparse_matmul_forward), FLOAT_KERNELS(sparse_matmul_backward), flops_sparse_matmul},
+    [ATTENTION]  = {"scaled_dot_product_attention", 3, 0, shape_attention, FLOAT_KERNELS(attention_forward), FLOAT_KERNELS(attention_backward), flops_attention},
+    [ATTENTION_MASKED] = {"scaled_dot_product_attention", 4, 0, shape_attention, FLOAT_KERNELS(attention_forward), FLOAT_KERNELS(attention_backward), flops_attention},
+    [LAYER_NORM] = {"layer_norm", 3, 0, shape_norm, FLOAT_KERNELS(layer_norm_forward), FLOAT_KERNELS(layer_norm_backward)},
+    [RMS_NORM]   = {"rms_norm", 2, 0, shape_norm, FLOAT_KERNELS(rms_norm_forward), FLOAT_KERNELS(rms_norm_backward)},
+    [INDEX_SELECT] = {"index_select", 2, OP_INDEXED, shape_index_select, ALL_KERNELS(index_select_forward), FLOAT_KERNELS(index_select_backward)},
+    // an embedding lookup is index_select along dim 0 with indices of any shape
+    [EMBEDDING]  = {"embedding", 2, OP_INDEXED, shape_embedding, ALL_KERNELS(index_select_forward), FLOAT_KERNELS(index_select_backward)},
+    [GATHER]     = {"gather", 2, OP_INDEXED, shape_gather, ALL_KERNELS(gather_forward), FLOAT_KERNELS(gather_backward)},
+    // elementwise but not fusable: every run draws a new mask
+    [DROPOUT]    = {"dropout", 1, OP_ELEMENTWISE, shape_same, FLOAT_KERNELS(dropout_forward), FLOAT_KERNELS(dropout_backward)},
+    [POW]        = {"pow", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, ALL_KERNELS(pow_forward), FLOAT_KERNELS(pow_backward)},
+    [EXP]        = {"exp", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(exp_forward), FLOAT_KERNELS(exp_backward)},
+    [RELU]       = {"relu", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, ALL_KERNELS(relu_forward), FLOAT_KERNELS(relu_backward)},
+    [LEAKY_RELU] = {"leaky_relu", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(leaky_relu_forward), FLOAT_KERNELS(leaky_relu_backward)},
+    [TANH]       = {"tanh", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(tanh_forward), FLOAT_KERNELS(tanh_backward)},
+    [SIGMOID]    = {"sigmoid", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(sigmoid_forward), FLOAT_KERNELS(sigmoid_backward)},
+    [GELU]       = {"gelu", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(gelu_forward), FLOAT_KERNELS(gelu_backward)},
+    [SOFTMAX]    = {"softmax", 1, 0, shape_same, FLOAT_KERNELS(softmax_forward), FLOAT_KERNELS(softmax_backward)},
+    [SUM]        = {"sum", 1, OP_REDUCE, shape_scalar, ALL_KERNELS(sum_forward), FLOAT_KERNELS(sum_backward)},
+    [MEAN]       = {"mean", 1, OP_REDUCE, shape_scalar, FLOAT_KERNELS(mean_forward), FLOAT_KERNELS(mean_backward)},
+    [MSE]        = {"mse_loss", 2, OP_REDUCE, shape_loss, FLOAT_KERNELS(mse_forward), FLOAT_KERNELS(mse_backward)},
+    [MAE]        = {"mae_loss", 2, OP_REDUCE, shape_loss, FLOAT_KERNELS(mae_forward), FLOAT_KERNELS(mae_backward)},
+    [LOG]        = {"log", 1, OP_ELEMENTWISE | OP_FUSABLE, shape_same, FLOAT_KERNELS(log_forward), FLOAT_KERNELS(log_backward)},
+    // the forward of a checkpoint is the user's segment; only its backward goes through the table
+    [CHECKPOINT] = {"checkpoint", 1, 0, shape_same, {NULL, NULL, NULL}, {checkpoint_backward, checkpoint_backward, NULL}},
+};
+
+// float kernels that are compiled per instruction set, as (op, kernel prefix)
+#define DISPATCH_KERNELS(M) \
+    M(ADD, add) M(SUB, sub) M(MUL, mul) M(DIV, div) M(MATMUL, matmul) M(MATMUL_PACKED, matmul_packed) M(SPARSE_MATMUL, sparse_matmul) \
+    M(POW, pow) M(EXP, exp) M(LOG, log) M(RELU, relu) M(LEAKY_RELU, leaky_relu) M(TANH, tanh) M(SIGMOID, sigmoid) \
+    M(GELU, gelu) M(SOFTMAX, softmax) M(ATTENTION, attention) M(ATTENTION_MASKED, attention) M(LAYER_NORM, layer_norm) M(RMS_NORM, rms_norm) \
+    M(INDEX_SELECT, index_select) M(EMBEDDING, index_select) M(GATHER, gather) M(DROPOUT, dropout) \
+    M(SUM, sum) M(MEAN, mean) M(MSE, mse) M(MAE, mae)
+
+#define SELECT_KERNELS(OP, NAME, ISA) \
+    op_table[OP].forward[FLOAT32] = NAME##_forward_float32##ISA; \
+    op_table[OP].forward[FLOAT64] = NAME##_forward_float64##ISA; \
+    op_table[OP].backward[FLOAT32] = NAME##_backward_float32##ISA; \
+    op_table[OP].backward[FLOAT64] = NAME##_backward_float64##ISA;
+#define SELECT_BASELINE(OP, NAME) SELECT_KERNELS(OP, NAME, )
+#define SELECT_AVX2(OP, NAME) SELECT_KERNELS(OP, NAME, _avx2)
+#define SELECT_AVX512(OP, NAME) SELECT_KERNELS(OP, NAME, _avx512)
+
+static CpuLevel cpu_active = CPU_BASELINE;
+static int kernels_ready = 0;
+
+// highest level the CPU (and the compiler) supports
+CpuLevel cpu_detect(void){
+#ifdef NAN_X86_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+       __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")) return CPU_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return CPU_AVX2;
+#endif
+    return CPU_BASELINE;
+}
+
+const char * cpu_level_name(CpuLevel level){
+    switch(level){
+        case CPU_AVX2: return "avx2";
+        case CPU_AVX512: return "avx512";
+        default:
+#if defined(__x86_64__)
+            return "sse2";
+#elif defined(__aarch64__)
+            return "neon";
+#else
+            return "generic";
+#endif
+    }
+}
+
+// switches every dispatched op to the kernels for `level`, clamped to what the CPU supports; returns the level in use
+CpuLevel set_cpu_level(CpuLevel level){
+    CpuLevel detected = cpu_detect();
+    if(level > detected){
+        fprintf(stderr, "cpu level '%s' not supported, using '%s'\n", cpu_level_name(level), cpu_level_name(detected));
+        level = detected;
+    }
+    #pragma omp critical(nan_kernels_init)
+    {
+        switch(level){
+#ifdef NAN_X86_DISPATCH
+            case CPU_AVX512: DISPATCH_KERNELS(SELECT_AVX512) break;
+            case CPU_AVX2: DISPATCH_KERNELS(SELECT_AVX2) break;
+#endif
+            default: DISPATCH_KERNELS(SELECT_BASELINE) break;
         }
-        break;
+#ifdef NAN_USE_OPENBLAS
+        op_table[MATMUL].forward[FLOAT32] = MATMUL_FLOAT32;
+        op_table[MATMUL].forward[FLOAT64] = MATMUL_FLOAT64;
+#endif
+        cpu_active = level;
+        #pragma omp atomic write
+        kernels_ready = 1;
+    }
+    return level;
+}
 
-    case FLOAT64:
-        if(out->prevs[0]->requires_grad==true){
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < out->size; i++){
-                out->prevs[0]->grad.float64[i] += out->grad.float64[i]/out->prevs[1]->data.float64[i]; 
+static CpuLevel cpu_level_from_env(void){
+    const char *env = getenv("NAN_CPU");
+    CpuLevel detected = cpu_detect();
+    if(!env || !*env) return detected;
+    if(!strcmp(env, "avx512")) return CPU_AVX512;
+    if(!strcmp(env, "avx2")) return CPU_AVX2;
+    if(!strcmp(env, "baseline") || !strcmp(env, "sse2") || !strcmp(env, "neon") || !strcmp(env, "generic")) return CPU_BASELINE;
+    fprintf(stderr, "NAN_CPU: unknown level '%s', using '%s'\n", env, cpu_level_name(detected));
+    return detected;
+}
+
+static void kernels_init(void){
+    int ready;
+    #pragma omp atomic read
+    ready = kernels_ready;
+    if(!ready) set_cpu_level(cpu_level_from_env());
+}
+
+// level of the kernels currently in use
+CpuLevel cpu_level(void){
+    kernels_init();
+    return cpu_active;
+}
+
+// profiler
+// Opt-in: between profiler_start() and profiler_stop() every forward kernel run by op_apply and every backward
+// dispatch is recorded with its time span, thread, dtype, output and input shapes, the bytes allocated for its
+// output (data and grad) and its nominal FLOPs. While it is off the only cost is one branch per op.
+typedef struct{
+    Op op;
+    bool backward;
+    DType dtype;
+    int thread;
+    double start, end;                // microseconds since profiler_start()
+    int num_shapes;                   // the output, then every input
+    int ndim[MAX_PREVS + 1];
+    int dims[MAX_PREVS + 1][MAX_DIMS];
+    size_t bytes;
+    double flops;
+} ProfileEvent;
+
+static bool profiler_on = false;
+static ProfileEvent *profile_events = NULL;
+static int profile_count = 0, profile_cap = 0;
+static double profile_origin = 0;
+
+static double profile_clock(void){
+#ifdef _OPENMP
+    return omp_get_wtime() * 1e6;
+#elif defined(_WIN32)
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#endif
+}
+
+// runs kernel(t) and records it; a backward is counted at twice the forward's FLOPs and allocates nothing
+static void profile_kernel(Kernel kernel, Tensor *t, bool backward){
+    double start = profile_clock();
+    kernel(t);
+    double end = profile_clock();
+
+    const OpDesc *desc = &op_table[t->op];
+    ProfileEvent ev;
+    ev.op = (Op)t->op;
+    ev.backward = backward;
+    ev.dtype = t->dtype;
+#ifdef _OPENMP
+    ev.thread = omp_get_thread_num();
+#else
+    ev.thread = 0;
+#endif
+    ev.start = start - profile_origin;
+    ev.end = end - profile_origin;
+    ev.num_shapes = 1 + t->num_prevs;
+    for(int i=0; i<ev.num_shapes; i++){
+        Tensor *s = i ? t->prevs[i - 1] : t;
+        ev.ndim[i] = s->ndim;
+        memcpy(ev.dims[i], s->dims, sizeof(int) * s->ndim);
+    }
+    ev.flops = desc->flops ? desc->flops(t) : (desc->flags & OP_REDUCE) ? t->prevs[0]->size : t->size;
+    ev.bytes = 0;
+    if(backward) ev.flops *= 2;
+    else ev.bytes = t->size * dtype_size(t->dtype) * (t->requires_grad ? 2 : 1);
+
+    #pragma omp critical(nan_profiler)
+    {
+        if(profile_count == profile_cap){
+            int cap = profile_cap ? profile_cap * 2 : 1024;
+            ProfileEvent *grown = realloc(profile_events, sizeof(ProfileEvent) * cap);
+            if(grown){
+                profile_events = grown;
+                profile_cap = cap;
             }
         }
-        if(out->prevs[1]->requires_grad==true){
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < out->size; i++){
-                out->prevs[1]->grad.float64[i] += (-out->grad.float64[i] * out->prevs[0]->data.float64[i]) / pow(out->prevs[1]->data.float64[i] , 2);
-            }  
-        }
-        break;    
-    default:
-        // t_free(out);
-        fprintf(stderr, "Unsupported data type \n");
-        return;
-        break;
+        if(profile_count < profile_cap) profile_events[profile_count++] = ev;
     }
 }
 
-Tensor* Pow(Tensor *t1, double exponent){
-    if(!t1)return NULL;
-    bool require_grad = (t1->requires_grad == true )? true: false;
+// drops what was recorded and starts recording
+void profiler_start(void){
+    profile_count = 0;
+    profile_origin = profile_clock();
+    profiler_on = true;
+}
 
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = powf(t1->data.float32[i], (float)exponent);
-            }
-            break;
+void profiler_stop(void){
+    profiler_on = false;
+}
 
-        case FLOAT64: 
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < t1->size; i++){
-                t->data.float64[i] = pow(t1->data.float64[i], exponent);
-            }
-            break;
+// frees the recorded events
+void profiler_reset(void){
+    profiler_on = false;
+    free(profile_events);
+    profile_events = NULL;
+    profile_count = profile_cap = 0;
+}
 
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            Tensor *t2 = ones(t1->dtype, t1->dims, require_grad);
-            for (int i = 0; i < t1->size; i++){
-                for (int j = 0; j < (int)exponent; j++) {    
-                    t2->data.Int[i] *= (int)t1->data.Int[i];
-                }
-                t->data.Int[i] = t2->data.Int[i];
-            }
-            // if (!t1->requires_grad)
-            // {
-            //     fprintf(stderr, "Gradient calculation not supported for integer types.\n");
-            //     t_free(t);
-            //     return NULL;
-            // }else{
-            //     t->grad.float32 = NULL;
-            // }
-            break;
+// per (op, pass) totals, most expensive first
+void profiler_summary(FILE *f){
+    typedef struct{ int op, calls; bool backward; double us, flops; size_t bytes; } Row;
+    Row rows[2 * NUM_OPS];
+    int n = 0;
+    double total = 0;
+    for(int i=0; i<profile_count; i++){
+        ProfileEvent *ev = &profile_events[i];
+        int r = 0;
+        while(r < n && (rows[r].op != (int)ev->op || rows[r].backward != ev->backward)) r++;
+        if(r == n) rows[n++] = (Row){ev->op, 0, ev->backward, 0, 0, 0};
+        rows[r].calls++;
+        rows[r].us += ev->end - ev->start;
+        rows[r].flops += ev->flops;
+        rows[r].bytes += ev->bytes;
+        total += ev->end - ev->start;
+    }
+    for(int i=1; i<n; i++){
+        Row row = rows[i];
+        int j = i;
+        while(j > 0 && rows[j - 1].us < row.us){ rows[j] = rows[j - 1]; j--; }
+        rows[j] = row;
+    }
+    fprintf(f, "%-30s %-8s %7s %11s %6s %11s %9s %11s\n", "op", "pass", "calls", "total(ms)", "%", "mean(us)", "GFLOP/s", "alloc(MB)");
+    for(int r=0; r<n; r++){
+        fprintf(f, "%-30s %-8s %7d %11.3f %6.1f %11.2f %9.2f %11.2f\n", op_table[rows[r].op].name,
+                rows[r].backward ? "backward" : "forward", rows[r].calls, rows[r].us * 1e-3,
+                total > 0 ? 100 * rows[r].us / total : 0, rows[r].us / rows[r].calls,
+                rows[r].us > 0 ? rows[r].flops / rows[r].us * 1e-3 : 0, rows[r].bytes / 1048576.0);
+    }
+    fprintf(f, "%d events, %.3f ms in kernels\n", profile_count, total * 1e-3);
+}
 
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-            break;           
+static void profile_write_shape(FILE *f, const int *dims, int ndim){
+    fputc('[', f);
+    for(int d=0; d<ndim; d++) fprintf(f, d ? ", %d" : "%d", dims[d]);
+    fputc(']', f);
+}
+
+// writes the events in Chrome's trace_event format (chrome://tracing, Perfetto); 0 on success
+int profiler_export_trace(const char *path){
+    FILE *f = fopen(path, "w");
+    if(!f){
+        fprintf(stderr, "profiler: cannot open '%s'\n", path);
+        return -1;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for(int i=0; i<profile_count; i++){
+        ProfileEvent *ev = &profile_events[i];
+        fprintf(f, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"dtype\": \"%s\", \"shape\": \"", i ? "," : "", op_table[ev->op].name,
+                ev->backward ? "backward" : "forward", ev->thread, ev->start, ev->end - ev->start, dtype_name(ev->dtype));
+        profile_write_shape(f, ev->dims[0], ev->ndim[0]);
+        fprintf(f, "\", \"inputs\": \"");
+        for(int k=1; k<ev->num_shapes; k++){
+            if(k > 1) fputc(' ', f);
+            profile_write_shape(f, ev->dims[k], ev->ndim[k]);
+        }
+        fprintf(f, "\", \"bytes\": %zu, \"flops\": %.0f}}", ev->bytes, ev->flops);
+    }
+    fprintf(f, "\n]}\n");
+    int failed = ferror(f);
+    fclose(f);
+    return failed ? -1 : 0;
+}
+
+void memory_report(FILE *f);
+
+static void memory_report_at_exit(void){
+    if(memory_on && mem_count){
+        fprintf(stderr, "memory: %zu tensor(s) still alive at exit\n", mem_count);
+        memory_report(stderr);
     }
-    t->op=POW;
-    t->num_prevs=1;
-    t->prevs[0]= t1;
-    t->extra = exponent;
+}
 
-    return t;
+// starts recording with empty counters; tensors created before this are never reported
+void memory_track_start(void){
+    static bool registered = false;
+    if(!registered){
+        atexit(memory_report_at_exit);
+        registered = true;
+    }
+    #pragma omp critical(nan_memory)
+    {
+        free(mem_table);
+        mem_table = NULL;
+        mem_cap = mem_count = 0;
+        mem_seq = 0;
+        mem_step = 0;
+        mem_live_bytes = mem_peak = mem_step_peak = 0;
+        memset(mem_dtype_count, 0, sizeof(mem_dtype_count));
+        memset(mem_dtype_bytes, 0, sizeof(mem_dtype_bytes));
+        memset(mem_op_count, 0, sizeof(mem_op_count));
+        memset(mem_op_bytes, 0, sizeof(mem_op_bytes));
+    }
+    memory_on = true;
 }
 
-void Pow_backward(Tensor * out){
-    if(!out)return;
-    switch (out->dtype){
-        case FLOAT32:
-            if(out->prevs[0]->requires_grad==true){
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float32[i] += out->grad.float32[i] * ((float)out->extra * powf(out->prevs[0]->data.float32[i],(float)out->extra-1));
-                }
-            }
-            break;
+// stops recording and forgets every record
+void memory_track_stop(void){
+    memory_on = false;
+    #pragma omp critical(nan_memory)
+    {
+        free(mem_table);
+        mem_table = NULL;
+        mem_cap = mem_count = 0;
+        free(mem_step_peaks);
+        mem_step_peaks = NULL;
+        mem_steps_cap = 0;
+    }
+}
 
-        case FLOAT64:
-            if(out->prevs[0]->requires_grad==true){
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->grad.float64[i] * out->extra * pow(out->prevs[0]->data.float64[i],(double)out->extra-1);
-                }
+// ends the current step: returns its high-water mark in bytes and starts the next one from what is live now
+size_t memory_step(void){
+    size_t peak;
+    #pragma omp critical(nan_memory)
+    {
+        peak = mem_step_peak;
+        if(mem_step == mem_steps_cap){
+            int cap = mem_steps_cap ? mem_steps_cap * 2 : 64;
+            size_t *grown = (size_t *)realloc(mem_step_peaks, cap * sizeof(size_t));
+            if(grown){
+                mem_step_peaks = grown;
+                mem_steps_cap = cap;
             }
-            break;
-        default:
-        // t_free(out);
-        fprintf(stderr, "Unsupported data type \n");
-        return ;
-        break;
+        }
+        if(mem_step < mem_steps_cap) mem_step_peaks[mem_step] = peak;
+        mem_step++;
+        mem_step_peak = mem_live_bytes;
     }
+    return peak;
 }
 
-Tensor * Exp(Tensor *t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true: false;
-    Tensor *t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
+size_t memory_live_bytes(void){ return mem_live_bytes; }
+size_t memory_peak_bytes(void){ return mem_peak; }
+int memory_live_tensors(void){ return (int)mem_count; }
 
-    switch (t1->dtype)
+static int mem_compare_seq(const void *a, const void *b){
+    unsigned long x = (*(const MemRecord * const *)a)->seq, y = (*(const MemRecord * const *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+// live tensors and bytes per dtype and per op, the high-water marks, and every tensor still alive in creation order
+void memory_report(FILE *f){
+    #pragma omp critical(nan_memory)
     {
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < t1->size; i++){
-                t->data.float32[i] = expf(t->data.float32[i]);
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < t1->size; i++){
-                t->data.float64[i] = exp(t->data.float64[i]);
+        fprintf(f, "live: %zu tensor(s), %.3f MB; peak %.3f MB\n", mem_count, mem_live_bytes / 1048576.0, mem_peak / 1048576.0);
+        for(int d=0; d<3; d++){
+            if(mem_dtype_count[d]) fprintf(f, "  %-30s %8zu %12.3f MB\n", dtype_name((DType)d), mem_dtype_count[d], mem_dtype_bytes[d] / 1048576.0);
+        }
+        for(int op=0; op<=NUM_OPS; op++){
+            if(mem_op_count[op]) fprintf(f, "  %-30s %8zu %12.3f MB\n", op < NUM_OPS ? op_table[op].name : "(tensor)",
+                                         mem_op_count[op], mem_op_bytes[op] / 1048576.0);
+        }
+        if(mem_step){
+            fprintf(f, "peak per step (MB):");
+            for(int s=0; s<mem_step && s<mem_steps_cap; s++) fprintf(f, " %.3f", mem_step_peaks[s] / 1048576.0);
+            fprintf(f, "\n");
+        }
+        MemRecord **live = mem_count ? (MemRecord **)malloc(mem_count * sizeof(MemRecord *)) : NULL;
+        if(live){
+            size_t n = 0;
+            for(size_t i=0; i<mem_cap; i++) if(mem_table[i].t) live[n++] = &mem_table[i];
+            qsort(live, n, sizeof(MemRecord *), mem_compare_seq);
+            for(size_t i=0; i<n; i++){
+                Tensor *t = live[i]->t;
+                fprintf(f, "  #%lu %s %s [", live[i]->seq, live[i]->op < NUM_OPS ? op_table[live[i]->op].name : "(tensor)", dtype_name(t->dtype));
+                for(int d=0; d<t->ndim; d++) fprintf(f, d ? ", %d" : "%d", t->dims[d]);
+                fprintf(f, "] %zu bytes, step %d, refs %d\n", live[i]->bytes, live[i]->step, t->ref_count);
             }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for (int i = 0; i < t1->size; i++){
-                t->data.float32[i] = exp((float)t->data.Int[i]);
+            free(live);
+        }
+    }
+}
+
+// validates the inputs of `op`, allocates its output, links it into the graph and runs the forward kernel
+static Tensor * op_apply(Op op, Tensor **in, double extra){
+    kernels_init();
+    const OpDesc *desc = &op_table[op];
+    for(int i=0; i<desc->num_inputs; i++){
+        if(!in[i]) return NULL;
+        if(i == 1 && (desc->flags & OP_INDEXED)){
+            if(in[i]->dtype != INT){
+                fprintf(stderr, "%s: indices must be an int tensor\n", desc->name);
+                return NULL;
             }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
+            continue;
+        }
+        if(in[i]->dtype != in[0]->dtype){
+            fprintf(stderr, "%s: tensors must have the same dtype\n", desc->name);
             return NULL;
-            break;           
+        }
+    }
+
+    DType dtype = in[0]->dtype;
+    if((unsigned)dtype > INT || !desc->forward[dtype]){
+        fprintf(stderr, " \"%s\" not implemented for '%s' \n", desc->name, dtype_name(dtype));
+        return NULL;
     }
-    t->op=EXP;
-    t->num_prevs=1;
-    t->prevs[0]= t1;
 
+    int dims[MAX_DIMS];
+    int ndim = 0;
+    if(!desc->shape(in, desc->num_inputs, extra, dims, &ndim)){
+        fprintf(stderr, "%s: incompatible tensor dimensions\n", desc->name);
+        return NULL;
+    }
+
+    bool require_grad = false;
+    for(int i=0; i<desc->num_inputs; i++){
+        if(in[i]->requires_grad == true) require_grad = true;
+    }
+    if(dtype == INT) require_grad = false;
+
+    Tensor *t = tensor_nd(NULL, dtype, dims, ndim, require_grad);
+    if(!t) return NULL;
+    t->extra = extra;
+    graph_link(t, op, in, desc->num_inputs);
+    if(profiler_on) profile_kernel(desc->forward[dtype], t, false);
+    else desc->forward[dtype](t);
     return t;
 }
 
-void Exp_backward(Tensor * out){
-    if(!out)return;
-    switch (out->dtype){
-        case FLOAT32:
-            if(out->prevs[0]->requires_grad==true){
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float32[i] += out->grad.float32[i] * expf(out->prevs[0]->data.float32[i]);
-                }
-            }
-            break;
+// element-wise addition
+Tensor * add(Tensor * t1, Tensor * t2){
+    return op_apply(ADD, (Tensor *[]){t1, t2}, 0);
+}
 
-        case FLOAT64:
-            if(out->prevs[0]->requires_grad==true){
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->grad.float64[i] * exp(out->prevs[0]->data.float64[i]);
-                }
-            }
-            break;
-        default:
-        // t_free(out);
-        fprintf(stderr, "Unsupported data type \n");
-        return ;
-        break;
+//element-wise subtraction
+Tensor * sub(Tensor * t1, Tensor * t2){
+    return op_apply(SUB, (Tensor *[]){t1, t2}, 0);
+}
+
+//element-wise multiplication
+Tensor * mul(Tensor *t1, Tensor *t2){
+    return op_apply(MUL, (Tensor *[]){t1, t2}, 0);
+}
+
+//dot preoduct; operands with more than 2 dims are stacks of matrices and their leading dims broadcast
+Tensor * matmul(Tensor *t1, Tensor *t2){
+    return op_apply(MATMUL, (Tensor *[]){t1, t2}, 0);
+}
+
+// batched matmul: [b, m, l] @ [b, l, n] -> [b, m, n]
+Tensor * bmm(Tensor *t1, Tensor *t2){
+    if(!t1 || !t2) return NULL;
+    if(t1->ndim != 3 || t2->ndim != 3 || t1->dims[0] != t2->dims[0]){
+        fprintf(stderr, "bmm: expected [b, m, l] and [b, l, n] tensors\n");
+        return NULL;
     }
+    return op_apply(MATMUL, (Tensor *[]){t1, t2}, 0);
 }
 
-Tensor * relu(Tensor *t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true: false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = (t1->data.float32[i]<0) ? 0 : (t1->data.float32[i]);
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = (t1->data.float64[i]<0) ? 0 : (t1->data.float64[i]);
+// copies a [l, n] weight matrix into the panel layout of the matmul kernel, once, so that matmul_packed() can
+// reuse it for every input. The result is a constant: it does not follow later updates of `w` and takes no grad.
+Tensor * pack_weights(Tensor *w){
+    if(!w) return NULL;
+    if(w->ndim != 2){
+        fprintf(stderr, "pack_weights: expected a [l, n] tensor\n");
+        return NULL;
+    }
+    int l = w->dims[0], n = w->dims[1], panels = (n + PACK_COLS - 1) / PACK_COLS;
+    Tensor *packed = tensor_nd(NULL, w->dtype, (int []){panels, l, PACK_COLS}, 3, false);
+    if(!packed) return NULL;
+    packed->extra = n;
+    #pragma omp parallel for schedule(static)
+    for(int p=0; p<panels; p++){
+        size_t offset = (size_t)p * l * PACK_COLS;
+        switch(w->dtype){
+            case FLOAT32: pack_panel_float32(w->data.float32, l, n, p, packed->data.float32 + offset); break;
+            case FLOAT64: pack_panel_float64(w->data.float64, l, n, p, packed->data.float64 + offset); break;
+            case INT: pack_panel_Int(w->data.Int, l, n, p, packed->data.Int + offset); break;
+        }
+    }
+    return packed;
+}
+
+// x[..., l] @ w for weights prepared by pack_weights()
+Tensor * matmul_packed(Tensor *x, Tensor *packed){
+    return op_apply(MATMUL_PACKED, (Tensor *[]){x, packed}, 0);
+}
+
+// a sparse [rows, cols] matrix with room for nnz entries; the caller fills row_ptr, col and the values, then
+// sparse_index_columns() derives the column order
+static Tensor * sparse_alloc(DType dtype, int rows, int cols, int nnz, bool requires_grad){
+    size_t ints = (size_t)rows + 1 + (size_t)cols + 1 + (size_t)3 * nnz;
+    SparseIndex *s = (SparseIndex *)malloc(sizeof(SparseIndex) + ints * sizeof(int));
+    Tensor *t = s ? tensor_nd(NULL, dtype, (int []){nnz}, 1, requires_grad) : NULL;
+    if(!t){
+        free(s);
+        fprintf(stderr, "Memory allocation for sparse matrix failed\n");
+        return NULL;
+    }
+    s->rows = rows;
+    s->cols = cols;
+    s->nnz = nnz;
+    s->row_ptr = (int *)(s + 1);
+    s->col = s->row_ptr + rows + 1;
+    s->col_ptr = s->col + nnz;
+    s->row = s->col_ptr + cols + 1;
+    s->pos = s->row + nnz;
+    t->saved = s;
+    return t;
+}
+
+// counting sort of the CSR entries by column; rows stay ascending within a column
+static void sparse_index_columns(SparseIndex *s){
+    memset(s->col_ptr, 0, sizeof(int) * (s->cols + 1));
+    for(int e=0; e<s->nnz; e++) s->col_ptr[s->col[e] + 1]++;
+    for(int k=0; k<s->cols; k++) s->col_ptr[k + 1] += s->col_ptr[k];
+    for(int i=0; i<s->rows; i++){
+        for(int e=s->row_ptr[i]; e<s->row_ptr[i + 1]; e++){
+            int d = s->col_ptr[s->col[e]]++;
+            s->row[d] = i;
+            s->pos[d] = e;
+        }
+    }
+    for(int k=s->cols; k>0; k--) s->col_ptr[k] = s->col_ptr[k - 1];
+    s->col_ptr[0] = 0;
+}
+
+// builds a sparse [rows, cols] matrix from nnz (row[e], col[e], values[e]) triplets in any order; `values` holds
+// nnz elements of `dtype` and entries given more than once are summed
+Tensor * sparse_from_coo(DType dtype, int rows, int cols, const int *row, const int *col, const void *values, int nnz,
+                         bool requires_grad){
+    if(rows <= 0 || cols <= 0 || nnz < 0 || (nnz > 0 && (!row || !col || !values))){
+        fprintf(stderr, "sparse_from_coo: expected a [rows, cols] shape and nnz triplets\n");
+        return NULL;
+    }
+    for(int e=0; e<nnz; e++){
+        if((unsigned)row[e] >= (unsigned)rows || (unsigned)col[e] >= (unsigned)cols){
+            fprintf(stderr, "sparse_from_coo: entry (%d, %d) is outside [%d, %d]\n", row[e], col[e], rows, cols);
+            return NULL;
+        }
+    }
+
+    // two stable counting sorts, by column and then by row, leave the triplets in CSR order
+    int buckets = rows > cols ? rows : cols;
+    int *by_col = (int *)malloc(sizeof(int) * (nnz + 1));
+    int *order = (int *)malloc(sizeof(int) * (nnz + 1));
+    int *count = (int *)malloc(sizeof(int) * (buckets + 1));
+    Tensor *t = NULL;
+    if(by_col && order && count){
+        memset(count, 0, sizeof(int) * (cols + 1));
+        for(int e=0; e<nnz; e++) count[col[e] + 1]++;
+        for(int k=0; k<cols; k++) count[k + 1] += count[k];
+        for(int e=0; e<nnz; e++) by_col[count[col[e]]++] = e;
+        memset(count, 0, sizeof(int) * (rows + 1));
+        for(int e=0; e<nnz; e++) count[row[e] + 1]++;
+        for(int i=0; i<rows; i++) count[i + 1] += count[i];
+        for(int k=0; k<nnz; k++) order[count[row[by_col[k]]]++] = by_col[k];
+
+        int unique = 0;
+        for(int k=0; k<nnz; k++){
+            int e = order[k], p = k ? order[k - 1] : -1;
+            unique += p < 0 || row[p] != row[e] || col[p] != col[e];
+        }
+        t = sparse_alloc(dtype, rows, cols, unique, requires_grad);
+    }else{
+        fprintf(stderr, "Memory allocation for sparse_from_coo failed\n");
+    }
+    if(t){
+        SparseIndex *s = (SparseIndex *)t->saved;
+        memset(t->data.raw_data, 0, (size_t)s->nnz * dtype_size(dtype));
+        memset(s->row_ptr, 0, sizeof(int) * (rows + 1));
+        int u = -1;
+        for(int k=0; k<nnz; k++){
+            int e = order[k], p = k ? order[k - 1] : -1;
+            if(p < 0 || row[p] != row[e] || col[p] != col[e]){
+                s->col[++u] = col[e];
+                s->row_ptr[row[e] + 1]++;
             }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.Int[i] = (t1->data.Int[i]<0) ? 0 : (t1->data.Int[i]);
+            switch(dtype){
+                case FLOAT32: t->data.float32[u] += ((const float *)values)[e]; break;
+                case FLOAT64: t->data.float64[u] += ((const double *)values)[e]; break;
+                case INT: t->data.Int[u] += ((const int *)values)[e]; break;
             }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
+        }
+        for(int i=0; i<rows; i++) s->row_ptr[i + 1] += s->row_ptr[i];
+        sparse_index_columns(s);
     }
-    t->op=RELU;
-    t->prevs[0]= t1;
-    t->num_prevs = 1;
+    free(by_col);
+    free(order);
+    free(count);
     return t;
 }
 
-void relu_backward(Tensor * out){
-    if(!out) return;
-    if(out->prevs[0]->requires_grad == true){
-        switch(out->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float32[i] += (out->data.float32[i] < 0) ? 0 : (out->grad.float32[i]);
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float64[i] += (out->data.float64[i] < 0) ? 0 : (out->grad.float64[i]);
+static bool sparse_nonzero(Tensor *t, size_t i){
+    switch(t->dtype){
+        case FLOAT32: return t->data.float32[i] != 0;
+        case FLOAT64: return t->data.float64[i] != 0;
+        case INT: return t->data.Int[i] != 0;
+        default: return false;
+    }
+}
+
+// keeps the nonzero elements of a [rows, cols] tensor. The result is a constant: it does not follow later updates
+// of `t` and takes no grad.
+Tensor * sparse_from_dense(Tensor *t){
+    if(!t) return NULL;
+    if(t->ndim != 2 || sparse_index(t)){
+        fprintf(stderr, "sparse_from_dense: expected a dense [rows, cols] tensor\n");
+        return NULL;
+    }
+    int rows = t->dims[0], cols = t->dims[1];
+    int *counts = (int *)malloc(sizeof(int) * (rows + 1));
+    if(!counts){
+        fprintf(stderr, "Memory allocation for sparse_from_dense failed\n");
+        return NULL;
+    }
+    counts[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for(int i=0; i<rows; i++){
+        int c = 0;
+        for(int j=0; j<cols; j++) c += sparse_nonzero(t, (size_t)i*cols + j);
+        counts[i + 1] = c;
+    }
+    for(int i=0; i<rows; i++) counts[i + 1] += counts[i];
+
+    Tensor *sp = sparse_alloc(t->dtype, rows, cols, counts[rows], false);
+    if(sp){
+        SparseIndex *s = (SparseIndex *)sp->saved;
+        memcpy(s->row_ptr, counts, sizeof(int) * (rows + 1));
+        size_t bytes = dtype_size(t->dtype);
+        #pragma omp parallel for schedule(static)
+        for(int i=0; i<rows; i++){
+            int e = s->row_ptr[i];
+            for(int j=0; j<cols; j++){
+                size_t at = (size_t)i*cols + j;
+                if(!sparse_nonzero(t, at)) continue;
+                s->col[e] = j;
+                memcpy((char *)sp->data.raw_data + e * bytes, (char *)t->data.raw_data + at * bytes, bytes);
+                e++;
             }
-            break;
-        default:
-            // t_free(out);
-            fprintf(stderr, "Unsupported data type \n");
-            return;
         }
+        sparse_index_columns(s);
     }
+    free(counts);
+    return sp;
+}
+
+// the dense [rows, cols] copy of a sparse matrix, as a new leaf
+Tensor * sparse_to_dense(Tensor *sp){
+    const SparseIndex *s = sparse_index(sp);
+    if(!s){
+        fprintf(stderr, "sparse_to_dense: expected a sparse matrix\n");
+        return NULL;
+    }
+    Tensor *t = tensor(NULL, sp->dtype, (int []){s->rows, s->cols}, false);
+    if(!t) return NULL;
+    size_t bytes = dtype_size(sp->dtype);
+    memset(t->data.raw_data, 0, (size_t)t->size * bytes);
+    #pragma omp parallel for schedule(static)
+    for(int i=0; i<s->rows; i++){
+        for(int e=s->row_ptr[i]; e<s->row_ptr[i + 1]; e++){
+            memcpy((char *)t->data.raw_data + ((size_t)i*s->cols + s->col[e]) * bytes,
+                   (char *)sp->data.raw_data + e * bytes, bytes);
+        }
+    }
+    return t;
+}
+
+// sparse [m, l] @ dense [l, n] -> dense [m, n]; the work is proportional to the stored entries of `a`. Gradients
+// flow to `b`, and to the values of `a` when it was built with requires_grad.
+Tensor * sparse_matmul(Tensor *a, Tensor *b){
+    if(a && !sparse_index(a)){
+        fprintf(stderr, "sparse_matmul: the first operand must be a sparse matrix\n");
+        return NULL;
+    }
+    return op_apply(SPARSE_MATMUL, (Tensor *[]){a, b}, 0);
+}
+
+Tensor * Div( Tensor * t1, Tensor *t2){
+    return op_apply(DIV, (Tensor *[]){t1, t2}, 0);
+}
+
+Tensor* Pow(Tensor *t1, double exponent){
+    return op_apply(POW, (Tensor *[]){t1}, exponent);
+}
+
+Tensor * Exp(Tensor *t1){
+    return op_apply(EXP, (Tensor *[]){t1}, 0);
+}
+
+// natural logarithm
+Tensor * Log(Tensor *t1){
+    return op_apply(LOG, (Tensor *[]){t1}, 0);
+}
+
+Tensor * relu(Tensor *t1){
+    return op_apply(RELU, (Tensor *[]){t1}, 0);
 }
 
 Tensor * leaky_relu(double negative_slope, Tensor *t1){
+    return op_apply(LEAKY_RELU, (Tensor *[]){t1}, negative_slope);
+}
+
+Tensor * Tanh(Tensor * t1){
+    return op_apply(TANH, (Tensor *[]){t1}, 0);
+}
+
+Tensor * Sigmoid(Tensor * t1){
+    return op_apply(SIGMOID, (Tensor *[]){t1}, 0);
+}
+
+// exact (erf based) GELU, not the tanh approximation
+Tensor * gelu(Tensor * t1){
+    return op_apply(GELU, (Tensor *[]){t1}, 0);
+}
+
+Tensor * softmax(Tensor *t1, int dim){
     if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true: false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = (t1->data.float32[i]<0) ? ((float)negative_slope * t1->data.float32[i]) : (t1->data.float32[i]);
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = (t1->data.float64[i]<0) ? (negative_slope * t1->data.float64[i]) : (t1->data.float64[i]);
-            }
-            break;
-        case INT:
-            t_free(t);
-            fprintf(stderr, " \"leaky_relu\" not implemented for 'int32' \n");
-            return NULL;
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
+    if(dim < 0 || dim >= t1->ndim){
+        fprintf(stderr, "softmax: dim %d out of range for a tensor with %d dimensions\n", dim, t1->ndim);
+        return NULL;
+    }
+    return op_apply(SOFTMAX, (Tensor *[]){t1}, dim);
+}
+
+// (x - mean) / sqrt(var + eps) * weight + bias over the last dim; weight and bias are [n]
+Tensor * layer_norm(Tensor *x, Tensor *weight, Tensor *bias, double eps){
+    return op_apply(LAYER_NORM, (Tensor *[]){x, weight, bias}, eps);
+}
+
+// x / sqrt(mean(x^2) + eps) * weight over the last dim; weight is [n]
+Tensor * rms_norm(Tensor *x, Tensor *weight, double eps){
+    return op_apply(RMS_NORM, (Tensor *[]){x, weight}, eps);
+}
+
+// every index must address an existing slice of size `limit`
+static bool indices_in_range(const char *name, Tensor *indices, int limit){
+    if(indices->dtype != INT){
+        fprintf(stderr, "%s: indices must be an int tensor\n", name);
+        return false;
+    }
+    for(int i=0; i<indices->size; i++){
+        if(indices->data.Int[i] < 0 || indices->data.Int[i] >= limit){
+            fprintf(stderr, "%s: index %d out of range [0, %d)\n", name, indices->data.Int[i], limit);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the slices of t along `dim` listed by the 1-d int tensor `indices`
+Tensor * index_select(Tensor *t, int dim, Tensor *indices){
+    if(!t || !indices) return NULL;
+    if(dim < 0 || dim >= t->ndim){
+        fprintf(stderr, "index_select: dim %d out of range for a tensor with %d dimensions\n", dim, t->ndim);
+        return NULL;
+    }
+    if(!indices_in_range("index_select", indices, t->dims[dim])) return NULL;
+    return op_apply(INDEX_SELECT, (Tensor *[]){t, indices}, dim);
+}
+
+// rows of weight [V, D] for every entry of the int tensor indices [...] -> [..., D]
+Tensor * embedding(Tensor *weight, Tensor *indices){
+    if(!weight || !indices) return NULL;
+    if(weight->ndim != 2){
+        fprintf(stderr, "embedding: expected a [V, D] weight\n");
+        return NULL;
+    }
+    if(!indices_in_range("embedding", indices, weight->dims[0])) return NULL;
+    return op_apply(EMBEDDING, (Tensor *[]){weight, indices}, 0);
+}
+
+// out[..., i, ...] = t[..., index[..., i, ...], ...] along `dim`; index is an int tensor of t's shape except
+// along dim
+Tensor * gather(Tensor *t, int dim, Tensor *index){
+    if(!t || !index) return NULL;
+    if(dim < 0 || dim >= t->ndim){
+        fprintf(stderr, "gather: dim %d out of range for a tensor with %d dimensions\n", dim, t->ndim);
+        return NULL;
+    }
+    if(index->ndim != t->ndim){
+        fprintf(stderr, "gather: index must have as many dimensions as the tensor\n");
+        return NULL;
+    }
+    for(int i=0; i<t->ndim; i++){
+        if(i != dim && index->dims[i] != t->dims[i]){
+            fprintf(stderr, "gather: index and tensor differ on dim %d\n", i);
             return NULL;
+        }
     }
-    t->op=LEAKY_RELU;
-    t->prevs[0] = t1;
-    t->extra = negative_slope;
-    t->num_prevs = 1;
-    return t;
+    if(!indices_in_range("gather", index, t->dims[dim])) return NULL;
+    return op_apply(GATHER, (Tensor *[]){t, index}, dim);
 }
 
-void leaky_relu_backward(Tensor * out){
-    if(!out) return;
+// zeroes each element with probability p and scales the rest by 1 / (1 - p) while training; outside of training
+// (or with p == 0) t itself is returned
+Tensor * dropout(Tensor *t, double p, bool training){
+    if(!t) return NULL;
+    if(!(p >= 0 && p < 1)){
+        fprintf(stderr, "dropout: p must be in [0, 1), got %g\n", p);
+        return NULL;
+    }
+    if(!training || p == 0) return t;
+    return op_apply(DROPOUT, (Tensor *[]){t}, p);
+}
 
-    if(out->prevs[0]->requires_grad == true){
-        switch(out->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float32[i] += (out->data.float32[i]<0) ? ((float)out->extra * out->grad.float32[i]) : (out->grad.float32[i]);
-            }
-            break;
+// softmax(q k^T / sqrt(d) + mask) v over the last two dims, every leading index being a separate head.
+// `mask` (may be NULL) is added to the scores, -INFINITY removes a key; it is [Lq, Lk] shared by all heads or
+// [..., Lq, Lk]. With `causal`, query i only sees keys up to i + Lk - Lq.
+Tensor * scaled_dot_product_attention(Tensor *q, Tensor *k, Tensor *v, Tensor *mask, bool causal){
+    if(mask) return op_apply(ATTENTION_MASKED, (Tensor *[]){q, k, v, mask}, causal);
+    return op_apply(ATTENTION, (Tensor *[]){q, k, v}, causal);
+}
 
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float64[i] += (out->data.float64[i]<0) ? (out->extra * out->grad.float64[i]) : (out->grad.float64[i]);
-            }
-            break;
+#define KV_ATTENTION_CALL(ISA) \
+    if(c->dtype == FLOAT32) kv_attention_float32##ISA(c, layer, (const float *)q, Lq, (float *)out, causal); \
+    else kv_attention_float64##ISA(c, layer, (const double *)q, Lq, (double *)out, causal);
+
+// the cache is not a tensor, so its kernel is picked here rather than through op_table
+static void kv_attention(const KVCache *c, int layer, const void *q, int Lq, void *out, bool causal){
+    switch(cpu_level()){
+#ifdef NAN_X86_DISPATCH
+        case CPU_AVX512: KV_ATTENTION_CALL(_avx512) break;
+        case CPU_AVX2: KV_ATTENTION_CALL(_avx2) break;
+#endif
+        default: KV_ATTENTION_CALL() break;
+    }
+}
+
+void kv_cache_free(KVCache *c){
+    if(!c) return;
+    for(int l=0; l<c->layers; l++){
+        for(int p=0; p<(c->num_pages ? c->num_pages[l] : 0); p++){
+            free(c->k_pages[l][p]);
+            free(c->v_pages[l][p]);
+        }
+        if(c->k_pages) free(c->k_pages[l]);
+        if(c->v_pages) free(c->v_pages[l]);
+    }
+    free(c->k_pages);
+    free(c->v_pages);
+    free(c->len);
+    free(c->num_pages);
+    free(c->page_cap);
+    free(c);
+}
+
+// makes sure `layer` has at least `pages` pages; existing pages stay where they are
+static bool kv_cache_reserve(KVCache *c, int layer, int pages){
+    size_t es = dtype_size(c->dtype);
+    if(pages > c->page_cap[layer]){
+        int cap = c->page_cap[layer] ? c->page_cap[layer] : 4;
+        while(cap < pages) cap *= 2;
+        void **k = (void **)realloc(c->k_pages[layer], cap * sizeof(void *));
+        if(k) c->k_pages[layer] = k;
+        void **v = (void **)realloc(c->v_pages[layer], cap * sizeof(void *));
+        if(v) c->v_pages[layer] = v;
+        if(!k || !v){
+            fprintf(stderr, "Memory allocation for kv cache failed\n");
+            return false;
+        }
+        c->page_cap[layer] = cap;
+    }
+    while(c->num_pages[layer] < pages){
+        int p = c->num_pages[layer];
+        c->k_pages[layer][p] = data_alloc((size_t)c->heads * c->block_size * c->d * es);
+        c->v_pages[layer][p] = data_alloc((size_t)c->heads * c->block_size * c->dv * es);
+        if(!c->k_pages[layer][p] || !c->v_pages[layer][p]){
+            fprintf(stderr, "Memory allocation for kv cache failed\n");
+            free(c->k_pages[layer][p]);
+            free(c->v_pages[layer][p]);
+            return false;
+        }
+        c->num_pages[layer]++;
+    }
+    return true;
+}
+
+// paged KV cache for `layers` layers of `heads` heads, with room for `reserve` tokens per layer up front
+KVCache * kv_cache(DType dtype, int layers, int heads, int d, int dv, int block_size, int reserve){
+    if(dtype != FLOAT32 && dtype != FLOAT64){
+        fprintf(stderr, "kv_cache: only float32 and float64 are supported\n");
+        return NULL;
+    }
+    if(layers <= 0 || heads <= 0 || d <= 0 || dv <= 0 || block_size <= 0){
+        fprintf(stderr, "kv_cache: invalid dimensions\n");
+        return NULL;
+    }
+    KVCache *c = (KVCache *)calloc(1, sizeof(KVCache));
+    if(!c){
+        fprintf(stderr, "Memory allocation for kv cache failed\n");
+        return NULL;
+    }
+    c->dtype = dtype;
+    c->layers = layers;
+    c->heads = heads;
+    c->d = d;
+    c->dv = dv;
+    c->block_size = block_size;
+    c->len = (int *)calloc(layers, sizeof(int));
+    c->num_pages = (int *)calloc(layers, sizeof(int));
+    c->page_cap = (int *)calloc(layers, sizeof(int));
+    c->k_pages = (void ***)calloc(layers, sizeof(void **));
+    c->v_pages = (void ***)calloc(layers, sizeof(void **));
+    if(!c->len || !c->num_pages || !c->page_cap || !c->k_pages || !c->v_pages){
+        fprintf(stderr, "Memory allocation for kv cache failed\n");
+        kv_cache_free(c);
+        return NULL;
+    }
+    int pages = reserve > 0 ? (reserve + block_size - 1) / block_size : 0;
+    for(int l=0; l<layers; l++){
+        if(!kv_cache_reserve(c, l, pages)){
+            kv_cache_free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
 
-        default:
-            // t_free(out);
-            fprintf(stderr, "Unsupported data type \n");
-            return;
+// k [..., T, d] and v [..., T, dv] (leading dims multiplying out to `heads`) are appended to `layer`.
+// Returns the number of tokens now cached for the layer, or -1 on error.
+int kv_cache_append(KVCache *c, int layer, Tensor *k, Tensor *v){
+    if(!c || !k || !v) return -1;
+    if(layer < 0 || layer >= c->layers){
+        fprintf(stderr, "kv_cache_append: layer %d out of range\n", layer);
+        return -1;
+    }
+    int T = k->ndim >= 2 ? k->dims[k->ndim - 2] : 0;
+    if(k->dtype != c->dtype || v->dtype != c->dtype || k->ndim < 2 || v->ndim != k->ndim ||
+       k->dims[k->ndim - 1] != c->d || v->dims[v->ndim - 1] != c->dv || v->dims[v->ndim - 2] != T ||
+       k->size != c->heads * T * c->d){
+        fprintf(stderr, "kv_cache_append: expected [heads, T, d] and [heads, T, dv] tensors matching the cache\n");
+        return -1;
+    }
+    int len = c->len[layer], bs = c->block_size;
+    if(!kv_cache_reserve(c, layer, (len + T + bs - 1) / bs)) return -1;
+    size_t es = dtype_size(c->dtype);
+    for(int t=0; t<T; t++){
+        int p = (len + t) / bs, off = (len + t) % bs;
+        for(int h=0; h<c->heads; h++){
+            memcpy((char *)c->k_pages[layer][p] + ((size_t)h*bs + off) * c->d * es,
+                   (char *)k->data.raw_data + ((size_t)h*T + t) * c->d * es, c->d * es);
+            memcpy((char *)c->v_pages[layer][p] + ((size_t)h*bs + off) * c->dv * es,
+                   (char *)v->data.raw_data + ((size_t)h*T + t) * c->dv * es, c->dv * es);
         }
     }
+    c->len[layer] = len + T;
+    return c->len[layer];
+}
 
+// attention of q [..., Lq, d] over everything cached for `layer`, read in place -> [..., Lq, dv].
+// With `causal` the last query lines up with the last cached token. Inference only: the result is not part
+// of a graph and, like an op result, is returned unowned.
+Tensor * kv_cache_attention(KVCache *c, int layer, Tensor *q, bool causal){
+    if(!c || !q) return NULL;
+    if(layer < 0 || layer >= c->layers){
+        fprintf(stderr, "kv_cache_attention: layer %d out of range\n", layer);
+        return NULL;
+    }
+    int Lq = q->ndim >= 2 ? q->dims[q->ndim - 2] : 0;
+    if(q->dtype != c->dtype || q->ndim < 2 || q->dims[q->ndim - 1] != c->d || q->size != c->heads * Lq * c->d){
+        fprintf(stderr, "kv_cache_attention: expected a [heads, Lq, d] query matching the cache\n");
+        return NULL;
+    }
+    if(causal && c->len[layer] < Lq){
+        fprintf(stderr, "kv_cache_attention: %d queries but only %d cached tokens\n", Lq, c->len[layer]);
+        return NULL;
+    }
+    int dims[MAX_DIMS];
+    memcpy(dims, q->dims, sizeof(int) * q->ndim);
+    dims[q->ndim - 1] = c->dv;
+    Tensor *out = tensor_nd(NULL, c->dtype, dims, q->ndim, false);
+    if(!out) return NULL;
+    out->ref_count = 0;
+    kv_attention(c, layer, q->data.raw_data, Lq, out->data.raw_data, causal);
+    return out;
 }
 
-Tensor * Tanh(Tensor * t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
+// forgets every cached token but keeps the pages for the next sequence
+void kv_cache_reset(KVCache *c){
+    if(!c) return;
+    for(int l=0; l<c->layers; l++) c->len[l] = 0;
+}
 
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = (exp(2*t1->data.float32[i]) - 1) / (exp(2*t1->data.float32[i]) + 1);
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = (exp(2*t1->data.float64[i]) - 1) / (exp(2*t1->data.float64[i]) + 1);
-            }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = (exp(2*t1->data.Int[i]) - 1) / (exp(2*t1->data.Int[i]) + 1);
-            }
-            break;
+Tensor * sum(Tensor * t1){
+    return op_apply(SUM, (Tensor *[]){t1}, 0);
+}
 
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
+Tensor * mean(Tensor * t1){
+    return op_apply(MEAN, (Tensor *[]){t1}, 0);
+}
 
-    t->prevs[0]=t1;
-    t->op=TANH;
-    t->num_prevs = 1;
+Tensor *MSELoss(Tensor * yTrue, Tensor * yPred){
+    return op_apply(MSE, (Tensor *[]){yTrue, yPred}, 0);
+}
 
-    return t;
+Tensor * MAELoss(Tensor * yTrue, Tensor * yPred){
+    return op_apply(MAE, (Tensor *[]){yTrue, yPred}, 0);
 }
 
-void Tanh_backward(Tensor * out){
-    if(!out) return;
+static void backward_step(Tensor * t){
+    Kernel kernel = ((unsigned)t->op < NUM_OPS && (unsigned)t->dtype <= INT) ? op_table[t->op].backward[t->dtype] : NULL;
+    if(!kernel){
+        fprintf(stderr, "Backward pass not implemented for this op/dtype\n");
+        return;
+    }
+    if(profiler_on) profile_kernel(kernel, t, true);
+    else kernel(t);
+}
 
-    if(out->prevs[0]->requires_grad==true){
-        switch(out->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float32[i] += (1 - powf(out->data.float32[i], 2)) * out->grad.float32[i];
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float64[i] += (1 - pow(out->data.float64[i], 2)) * out->grad.float64[i];
-            }
-            break;
+static unsigned int graph_epoch = 0;
 
-        default:
-            // t_free(out);
-            fprintf(stderr, "Unsupported data type \n");
-            return;
+// post-order DFS: every node is placed after all of its prevs. `stop` (if any) is left out together with everything behind it
+static void build_topo(Tensor *t, Tensor *stop, Tensor ***topo, int *n, int *cap){
+    if(!t || t == stop || t->visit == graph_epoch) return;
+    t->visit = graph_epoch;
+    for(int i=0; i<t->num_prevs; i++){
+        build_topo(t->prevs[i], stop, topo, n, cap);
+    }
+    if(*n == *cap){
+        *cap = *cap ? *cap * 2 : 64;
+        Tensor **grown = (Tensor **)realloc(*topo, *cap * sizeof(Tensor *));
+        if(!grown){
+            fprintf(stderr, "Memory allocation for backward graph failed\n");
+            exit(EXIT_FAILURE);
         }
+        *topo = grown;
     }
+    (*topo)[(*n)++] = t;
 }
 
-Tensor * Sigmoid(Tensor * t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true:false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
+#ifdef _OPENMP
+static omp_lock_t grad_locks[GRAD_LOCKS];
+static bool grad_locks_ready = false;
 
-    switch(t1->dtype){
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = 1 / (1 + expf(-t1->data.float32[i]));
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float64[i] = 1 / (1 + exp(-t1->data.float64[i]));
-            }
-            break;
-        case INT:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i=0; i<t1->size; i++){
-                t->data.float32[i] = 1 / (1 + exp(-t1->data.Int[i]));
-            }
-            break;
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
-    }
+static int grad_lock_index(Tensor *t){
+    return (int)(((size_t)t >> 6) % GRAD_LOCKS);
+}
+#endif
 
-    t->op = SIGMOID;
-    t->prevs[0] = t1;
-    t->num_prevs = 1;
+// runs one node's backward while holding the locks of every tensor whose grad it accumulates into
+static void backward_step_locked(Tensor * node){
+#ifdef _OPENMP
+    // a checkpoint re-enters the scheduler for its segment, whose nodes take their own locks
+    if(node->op == CHECKPOINT){
+        backward_step(node);
+        return;
+    }
+    int idx[MAX_PREVS];
+    int n = 0;
+    for(int i=0; i<node->num_prevs; i++){
+        int k = grad_lock_index(node->prevs[i]);
+        int j = n;
+        bool seen = false;
+        for(int m=0; m<n; m++) if(idx[m] == k) seen = true;
+        if(seen) continue;
+        // keep ascending order so two nodes never wait on each other
+        while(j > 0 && idx[j-1] > k){ idx[j] = idx[j-1]; j--; }
+        idx[j] = k;
+        n++;
+    }
+    for(int i=0; i<n; i++) omp_set_lock(&grad_locks[idx[i]]);
+    backward_step(node);
+    for(int i=n-1; i>=0; i--) omp_unset_lock(&grad_locks[idx[i]]);
+#else
+    backward_step(node);
+#endif
+}
 
-    return t;
+// runs one node's backward and drops its edges; every prev whose last consumer it was is appended to ready[]
+static void backward_task(Tensor * node, Tensor * root, unsigned int epoch, Tensor ** ready, int * num_ready){
+    // a leaf root has no kernel and nothing to push its grad into
+    if(node->num_prevs > 0) backward_step_locked(node);
+
+    for(int i=0; i<node->num_prevs; i++){
+        Tensor *p = node->prevs[i];
+        // leaves and the segment boundary are not scheduled; leaves stay alive through the edges below
+        if(p->num_prevs == 0 || p->visit != epoch) continue;
+        int remaining;
+        // acq_rel: whoever takes `p` sees the grad writes of every other consumer
+        #pragma omp atomic capture acq_rel
+        remaining = --p->pending;
+        if(remaining == 0){
+            // every consumer of `p` is done, its grad is complete
+            int slot;
+            #pragma omp atomic capture
+            slot = (*num_ready)++;
+            ready[slot] = p;
+        }
+    }
+    for(int i=0; i<node->num_prevs; i++){
+        t_release(node->prevs[i]);
+    }
+    node->num_prevs = 0;
+    if(node != root){
+        t_release(node);
+    }
 }
 
-void Sigmoid_backward(Tensor * out){
-    if(!out) return;
+/*
+Dependency-counting backward scheduler.
+Every node counts the consumers that still have to push gradient into it. The root runs first; whenever
+a node finishes it decrements the count of each of its prevs, and a prev that reaches zero becomes ready.
+Ready nodes are taken in waves. While at most one of them is large (a chain, or a branch next to a few
+small ops) the wave runs on the calling thread, so each kernel's own parallel loops get the whole team.
+Only when independent branches (e.g. the two operands of an add whose subgraphs share no intermediates)
+are both ready does a wave run as OpenMP tasks, one per node. Accumulation into a grad shared by
+concurrent nodes (a weight used in both branches) is serialised by striped locks keyed on the tensor.
+
+As soon as a node has pushed its gradient into its prevs, its edges are released; an intermediate that
+nothing else references is freed right away together with its data and grad, so peak memory shrinks
+while the pass runs. The graph is consumed: `t` keeps its data and grad but loses its prevs, leaves
+(parameters, inputs) keep their accumulated grads, and t_release(t) afterwards frees what is left.
+*/
+static void backward_graph(Tensor * t, Tensor * stop){
+    Tensor **topo = NULL;
+    int n = 0, cap = 0;
+    unsigned int epoch = ++graph_epoch;
+    build_topo(t, stop, &topo, &n, &cap);
+
+    for(int i=0; i<n; i++){
+        topo[i]->pending = 0;
+    }
+    for(int i=0; i<n; i++){
+        for(int j=0; j<topo[i]->num_prevs; j++){
+            // only count edges inside this traversal; `stop` belongs to an enclosing pass
+            if(topo[i]->prevs[j]->visit == epoch) topo[i]->prevs[j]->pending++;
+        }
+    }
+    // hold every inner node (the caller owns the root) until its own backward has run
+    for(int i=0; i<n; i++){
+        if(topo[i] != t && topo[i]->num_prevs > 0) t_retain(topo[i]);
+    }
 
-    if(out->prevs[0]->requires_grad == true){
-        switch(out->prevs[0]->dtype){
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float32[i] += out->data.float32[i] * (1 - out->data.float32[i]) * out->grad.float32[i];
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i<out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->data.float64[i] * (1 - out->data.float64[i]) * out->grad.float64[i];
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
-            }
+#ifdef _OPENMP
+    if(!grad_locks_ready){
+        for(int i=0; i<GRAD_LOCKS; i++) omp_init_lock(&grad_locks[i]);
+        grad_locks_ready = true;
+    }
+#endif
+
+    // every node becomes ready once, so topo[] is reused as the queue: [head, tail) is the current wave
+    int head = 0, tail = 1;
+    topo[0] = t;
+    while(head < tail){
+        int end = tail, large = 0;
+        for(int i=head; i<end; i++) large += topo[i]->size >= BACKWARD_TASK_MIN_SIZE;
+        if(large < 2){
+            for(; head<end; head++) backward_task(topo[head], t, epoch, topo, &tail);
+            continue;
+        }
+        #pragma omp parallel
+        #pragma omp single
+        for(int i=head; i<end; i++){
+            #pragma omp task firstprivate(i)
+            backward_task(topo[i], t, epoch, topo, &tail);
+        }
+        head = end;
     }
+    free(topo);
 }
 
-Tensor * softmax(Tensor *t1, int dim){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true)? true : false;
-    Tensor * t = tensor(NULL, t1->dtype, t1->dims, require_grad);
-    if(!t) return NULL;
+void backward(Tensor * t){
+    //check if loss is NULL
+    if(!t) return;
+    backward_graph(t, NULL);
+}
 
-    
-    float max_val_float;
-    // double s_double = 0.0;
-    double max_val_double;
-    float *ex_float = (float *)malloc(t1->size * sizeof(float));
-    double *ex_double = (double *)malloc(t1->size * sizeof(double));
+/*
+Gradient checkpointing.
+checkpoint(fn, input, ctx) runs the segment fn(input, ctx) and keeps only its output: every intermediate
+built inside the segment is freed as soon as the forward returns. During backward the segment is run
+again from the saved input and its local graph is back-propagated on the spot, so activation memory
+for a stack of segments is one segment deep instead of the whole network, at the cost of a second
+forward per segment.
+
+`fn` must be deterministic and may only close over leaf tensors (parameters) through `ctx`;
+everything it derives from the outer graph has to come in through `input`.
+*/
+typedef Tensor *(*CheckpointFn)(Tensor *input, void *ctx);
 
-    switch(t1->dtype){
-        case FLOAT32:
-            if(!ex_float){
-                t_free(t);
-                fprintf(stderr, "Memory allocation failed \n");
-                return NULL;
-            }
+typedef struct{
+    CheckpointFn fn;
+    void *ctx;
+}CheckpointSegment;
 
-            max_val_float = t1->data.float32[0];
-            for(int i = 1; i < t1->size; i++) {
-                if(t1->data.float32[i] > max_val_float) {
-                    max_val_float = t1->data.float32[i];
-                }
-            }
-            if (dim == 1)
-            {
-                for( int i = 0; i<t1->dims[0]; i++)
-                {
-                    float s_float = 0.0f;
-                    for (int j = 0; j < t1->dims[1]; j++)
-                    {
-                        ex_float[i * t1->dims[1] + j] = expf(t1->data.float32[i * t1->dims[1] + j] - max_val_float);
-                        s_float += ex_float[i*t1->dims[1] + j]; 
-                    }
+Tensor * checkpoint(CheckpointFn fn, Tensor *input, void *ctx){
+    if(!fn || !input) return NULL;
 
-                    for (int j = 0; j < t1->dims[1]; j++)
-                    {
-                        t->data.float32[i * t1->dims[1] + j] = ex_float[i * t1->dims[1] + j] / s_float;
-                    }
-                    
-                }
-            }else if (dim == 0)
-            {
-                for( int j = 0; j<t1->dims[1]; j++)
-                {   
-                    float s_float = 0.0f;
-                    for (int i = 0; i < t1->dims[0]; i++)
-                    {
-                        ex_float[i*t1->dims[1] + j] = expf(t1->data.float32[i * t1->dims[1] + j] - max_val_float);
-                        s_float += ex_float[i*t1->dims[1] + j];
-                    }
+    CheckpointSegment *segment = (CheckpointSegment *)malloc(sizeof(CheckpointSegment));
+    if(!segment){
+        fprintf(stderr, "Memory allocation for checkpoint failed\n");
+        return NULL;
+    }
+    segment->fn = fn;
+    segment->ctx = ctx;
+
+    // an unowned input must survive the teardown of the segment graph below
+    t_retain(input);
+    Tensor *seg = fn(input, ctx);
+    if(!seg){
+        free(segment);
+        t_release(input);
+        return NULL;
+    }
 
-                    for (int i = 0; i < t1->dims[0]; i++)
-                    {
-                        t->data.float32[i * t1->dims[1] + j] = ex_float[i * t1->dims[1] + j] / s_float;
-                    }
-                    
-                }
-            }
-            free(ex_float);
-            break;
+    Tensor *t = tensor_nd(seg->data.raw_data, seg->dtype, seg->dims, seg->ndim, seg->requires_grad);
+    // drop the segment's graph; anything it still owns (besides `input`) goes with it
+    if(seg->ref_count == 0) t_free(seg);
+    if(!t){
+        free(segment);
+        t_release(input);
+        return NULL;
+    }
 
-        case FLOAT64:
-            if(!ex_double){
-                t_free(t);
-                fprintf(stderr, "Memory allocation failed \n");
-                return NULL;
-            }
+    graph_link(t, CHECKPOINT, (Tensor *[]){input}, 1);
+    t->saved = segment;
+    t_release(input);
+    return t;
+}
 
-            max_val_double = t1->data.float64[0];
-            for(int i = 1; i < t1->size; i++) {
-                if(t1->data.float64[i] > max_val_double) {
-                    max_val_double = t1->data.float64[i];
-                }
-            }
-            if (dim == 1)
-            {
-                for (int i = 0; i < t1->dims[0]; i++)
-                {
-                    double s_double = 0.0;
-                    for (int j = 0; j < t1->dims[1]; j++)
-                    {
-                        ex_double[i * t1->dims[1] + j] = exp(t1->data.float64[i * t1->dims[1] + j] - max_val_double);
-                        s_double += ex_double[i * t1->dims[1] + j];
-                    }
+static void checkpoint_recompute(Tensor * out){
+    CheckpointSegment *segment = (CheckpointSegment *)out->saved;
 
-                    for (int j = 0; j < t1->dims[1]; j++)
-                    {
-                        t1->data.float64[i * t1->dims[1] + j] = ex_double[i * t1->dims[1] + j] / s_double;
-                    }  
-                }  
-            }
-            else if (dim == 0)
-            {
-                for (int j = 0; j < t1->dims[1]; j++)
-                {
-                    double s_double = 0.0;
-                    for (int i = 0; i < t1->dims[0]; i++)
-                    {
-                        ex_double[i * t1->dims[1] + j] = exp(t1->data.float64[i * t1->dims[1] + j] - max_val_double);
-                        s_double += ex_double[i * t1->dims[1] + j];
-                    }
+    Tensor *seg = segment->fn(out->prevs[0], segment->ctx);
+    if(!seg){
+        fprintf(stderr, "Checkpoint recomputation failed\n");
+        return;
+    }
+    if(seg->requires_grad == true && seg->grad.float64 != NULL){
+        memcpy(seg->grad.float64, out->grad.float64, out->size * dtype_size(out->dtype));
+        backward_graph(seg, out->prevs[0]);
+    }
+    if(seg->ref_count == 0) t_free(seg);
+}
 
-                    for (int i = 0; i < t1->dims[0]; i++)
-                    {
-                        t1->data.float64[i * t1->dims[1] + j] = ex_double[i * t1->dims[1] + j] / s_double;
-                    }
-                }  
-            }
-            free(ex_double);
-            break;
+void checkpoint_backward(Tensor * out){
+    if(!out || out->requires_grad != true) return;
+    // segments are recomputed one at a time: the nested pass reuses the graph traversal marks
+    #pragma omp critical(nan_checkpoint)
+    checkpoint_recompute(out);
+}
 
-        case INT:
-            t_free(t);
-            fprintf(stderr, " \"softmax\" not implemented for 'int32' \n");
+// graph capture and replay
+// A captured graph is the op sequence behind a result, kept alive with its buffers. Replaying it runs the same
+// forward kernels in the same order into the same outputs, so a fixed-shape step costs its kernels only: no
+// shape checks, no allocation, no graph construction. New data goes into the leaves (inputs, targets, params)
+// in place before each replay. Validation done by the op functions is skipped too, so new index data must stay
+// in range.
+typedef struct{
+    Tensor *root;
+    Tensor **nodes;   // every op node, each after its inputs
+    Kernel *forward;  // forward kernel of every node, resolved at capture
+    int num_nodes;
+    char *workspace;        // buffer shared by the planned intermediates (graph_plan)
+    size_t workspace_size;
+    size_t unplanned_size;  // what the planned intermediates took as separate buffers
+} Graph;
+
+// records the graph behind `root` (which must not have gone through backward()); NULL if it cannot be replayed
+Graph * graph_capture(Tensor *root){
+    if(!root) return NULL;
+    Tensor **topo = NULL;
+    int n = 0, cap = 0;
+    ++graph_epoch;
+    build_topo(root, NULL, &topo, &n, &cap);
+
+    Graph *g = (Graph *)calloc(1, sizeof(Graph));
+    if(g){
+        g->nodes = (Tensor **)malloc(n * sizeof(Tensor *));
+        g->forward = (Kernel *)malloc(n * sizeof(Kernel));
+    }
+    if(!g || !g->nodes || !g->forward){
+        fprintf(stderr, "Memory allocation for graph capture failed\n");
+        if(g){ free(g->nodes); free(g->forward); free(g); }
+        free(topo);
+        return NULL;
+    }
+    for(int i=0; i<n; i++){
+        Tensor *t = topo[i];
+        if(t->num_prevs == 0) continue;
+        Kernel kernel = (unsigned)t->op < NUM_OPS ? op_table[t->op].forward[t->dtype] : NULL;
+        if(!kernel){
+            // a checkpoint's forward is user code, not a kernel
+            fprintf(stderr, "graph_capture: '%s' cannot be replayed\n", (unsigned)t->op < NUM_OPS ? op_table[t->op].name : "unknown op");
+            for(int k=0; k<g->num_nodes; k++) t_release(g->nodes[k]);
+            free(g->nodes); free(g->forward); free(g); free(topo);
             return NULL;
-            break;
+        }
+        g->nodes[g->num_nodes] = t_retain(t);
+        g->forward[g->num_nodes++] = kernel;
+    }
+    free(topo);
+    g->root = root;
+    if(!g->num_nodes || g->nodes[g->num_nodes - 1] != root) g->root = t_retain(root);
+    return g;
+}
 
-        default:
-            t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
+// re-runs every forward kernel; g->root holds the new result
+void graph_replay(Graph *g){
+    if(!g) return;
+    for(int i=0; i<g->num_nodes; i++){
+        if(profiler_on) profile_kernel(g->forward[i], g->nodes[i], false);
+        else g->forward[i](g->nodes[i]);
     }
+}
 
-    t->op=SOFTMAX;
-    t->prevs[0] = t1;
-    t->num_prevs = 1;
+// backward through the captured graph without consuming it: the root's grad is seeded with ones, the grads of
+// the other nodes restart from zero, and the leaves accumulate as with backward()
+void graph_backward(Graph *g){
+    if(!g || g->root->requires_grad != true) return;
+    for(int i=0; i<g->num_nodes; i++){
+        Tensor *t = g->nodes[i];
+        if(t->requires_grad == true && t != g->root) memset(t->grad.float64, 0, t->size * dtype_size(t->dtype));
+    }
+    grad_init(g->root);
+    for(int i=g->num_nodes-1; i>=0; i--){
+        if(g->nodes[i]->requires_grad == true) backward_step(g->nodes[i]);
+    }
+}
 
-    return t;
+// static memory planning
+// A node's buffer is live from the kernel that writes it to the last kernel that reads it, so intermediates whose
+// lifetimes do not overlap can share memory. graph_plan() packs them into one workspace: buffers are placed largest
+// first at the lowest offset that does not collide with a buffer live at the same time, and an elementwise op
+// writes over its input when that input is read for the last time by it. Only nodes that backward never reads are
+// planned (no grad on the node or on any consumer); the root always keeps its own buffer. After planning, the data
+// of a planned intermediate is only valid until a later kernel reuses its bytes, and it is gone after graph_free().
+typedef struct{
+    size_t offset, bytes;
+    int start, end;
+} PlanBuffer;
+
+static int plan_buffer_compare(const void *a, const void *b){
+    const PlanBuffer *x = *(const PlanBuffer **)a, *y = *(const PlanBuffer **)b;
+    if(x->bytes != y->bytes) return x->bytes < y->bytes ? 1 : -1;
+    return x->start - y->start;
 }
 
-void softmax_backward(Tensor *out){
-    if(!out) return;
+static int plan_offset_compare(const void *a, const void *b){
+    size_t x = (*(const PlanBuffer **)a)->offset, y = (*(const PlanBuffer **)b)->offset;
+    return (x > y) - (x < y);
+}
 
-    if(out->requires_grad == true ){
-        switch(out->prevs[0]->dtype){
-            case FLOAT32:
-                for( int i = 0; i < out->prevs[0]->dims[0]; i++)
-                {
-                    for (int j = 0; j < out->prevs[0]->dims[1]; j++)
-                    {
-                        if (i != j)
-                        {
-                            out->prevs[0]->grad.float32[i * out->prevs[0]->dims[1] + j] += -(out->prevs[0]->data.float32[i * out->prevs[0]->dims[1] + j] * out->prevs[0]->data.float32[i * out->prevs[0]->dims[1] + j]) * out->grad.float32[i * out->prevs[0]->dims[1] + j];
-                        }else if(i == j)
-                        {
-                            out->prevs[0]->grad.float32[i * out->prevs[0]->dims[1] + j] += out->prevs[0]->data.float32[i * out->prevs[0]->dims[1] + j] * (1 - out->prevs[0]->data.float32[i * out->prevs[0]->dims[1] + j]) * out->grad.float32[i * out->prevs[0]->dims[1] + j];
-                        } 
-                    }
-                }
-                break;
-            case FLOAT64:
-                for( int i = 0; i<out->prevs[0]->dims[0]; i++)
-                {
-                    for (int j = 0; j < out->prevs[0]->dims[1]; j++)
-                    {
-                        if (i != j)
-                        {
-                            out->prevs[0]->grad.float64[i * out->prevs[0]->dims[1] + j] += -(out->prevs[0]->data.float64[i * out->prevs[0]->dims[1] + j] * out->prevs[0]->data.float64[i * out->prevs[0]->dims[1] + j]) * out->grad.float64[i * out->prevs[0]->dims[1] + j];
-                        }else if(i == j)
-                        {
-                            out->prevs[0]->grad.float64[i * out->prevs[0]->dims[1] + j] += out->prevs[0]->data.float64[i * out->prevs[0]->dims[1] + j] * (1 - out->prevs[0]->data.float64[i * out->prevs[0]->dims[1] + j]) * out->grad.float64[i * out->prevs[0]->dims[1] + j];
-                        } 
-                    }
+// lays out the buffers of the nodes flagged in `plannable` and returns the workspace size. The nodes must be
+// marked with visit == epoch and their index in pending. A node runs at exec[i] (its own index if exec is NULL);
+// every input read by a node that runs at j lives until j. offset[i] receives the place of every planned node and
+// *unplanned the bytes the same buffers take one by one. Returns 0 if the plan cannot be allocated.
+static size_t plan_layout(Graph *g, unsigned int epoch, const bool *plannable, const int *exec, size_t *offset,
+                          size_t *unplanned){
+    int n = g->num_nodes;
+    int *last = (int *)malloc(n * sizeof(int));
+    int *group = (int *)malloc(n * sizeof(int));
+    PlanBuffer *buffers = (PlanBuffer *)malloc(n * sizeof(PlanBuffer));
+    PlanBuffer **order = (PlanBuffer **)malloc(2 * n * sizeof(PlanBuffer *));
+    *unplanned = 0;
+    if(!last || !group || !buffers || !order){
+        fprintf(stderr, "Memory allocation for the memory plan failed\n");
+        free(last); free(group); free(buffers); free(order);
+        return 0;
+    }
+    for(int i=0; i<n; i++){
+        last[i] = exec ? exec[i] : i;
+        group[i] = -1;
+    }
+    for(int j=0; j<n; j++){
+        Tensor *t = g->nodes[j];
+        int at = exec ? exec[j] : j;
+        for(int k=0; k<t->num_prevs; k++){
+            Tensor *p = t->prevs[k];
+            if(p->visit == epoch && last[p->pending] < at) last[p->pending] = at;
+        }
+    }
+
+    // every group of nodes that share one buffer gets an interval; an elementwise op joins the group of an input
+    // that dies at it
+    int num_buffers = 0;
+    for(int j=0; j<n; j++){
+        if(!plannable[j]) continue;
+        Tensor *t = g->nodes[j];
+        size_t bytes = ((size_t)t->size * dtype_size(t->dtype) + 63) & ~(size_t)63;
+        *unplanned += bytes;
+        // with exec, nodes that run inside j (a fused chain) come before it and read their inputs at j as well
+        for(int f=exec ? 0 : j; f<=j && group[j] < 0 && (op_table[t->op].flags & OP_ELEMENTWISE); f++){
+            Tensor *u = g->nodes[f];
+            if(f != j && exec[f] != j) continue;
+            for(int k=0; k<u->num_prevs && group[j] < 0; k++){
+                Tensor *p = u->prevs[k];
+                if(p->visit != epoch) continue;
+                int i = p->pending;
+                if(plannable[i] && last[i] == j && buffers[group[i]].end == j && p->dtype == t->dtype && p->size == t->size){
+                    group[j] = group[i];
+                    buffers[group[j]].end = last[j];
                 }
-                break;
+            }
+        }
+        if(group[j] < 0){
+            buffers[num_buffers] = (PlanBuffer){0, bytes, j, last[j]};
+            group[j] = num_buffers++;
+        }
+    }
 
-            default:
-                t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                return;
+    // greedy by size: each buffer takes the lowest gap between the placed buffers it is live with
+    size_t total = 0;
+    for(int b=0; b<num_buffers; b++) order[b] = &buffers[b];
+    qsort(order, num_buffers, sizeof(PlanBuffer *), plan_buffer_compare);
+    for(int b=0; b<num_buffers; b++){
+        PlanBuffer *buf = order[b], **live = order + n;
+        int num_live = 0;
+        for(int k=0; k<b; k++)
+            if(order[k]->start <= buf->end && buf->start <= order[k]->end) live[num_live++] = order[k];
+        qsort(live, num_live, sizeof(PlanBuffer *), plan_offset_compare);
+        size_t at = 0;
+        for(int k=0; k<num_live; k++){
+            if(live[k]->offset >= at + buf->bytes) break;
+            if(live[k]->offset + live[k]->bytes > at) at = live[k]->offset + live[k]->bytes;
         }
+        buf->offset = at;
+        if(at + buf->bytes > total) total = at + buf->bytes;
     }
+    for(int i=0; i<n; i++) offset[i] = plannable[i] ? buffers[group[i]].offset : 0;
+    free(last); free(group); free(buffers); free(order);
+    return total;
 }
 
-Tensor * sum(Tensor * t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true : false;
-    Tensor *t=tensor(NULL, t1->dtype, (int[]){1}, require_grad);
-    if (!t) return NULL;
-
-    switch(t1->dtype){
-        case FLOAT32:
-            float fsum = 0.0f;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:fsum) //multithreading and simd reduction(+:sum)
-            for(int i = 0; i<t1->size; i++){
-                fsum += t1->data.float32[i];
-            }
-            t->data.float32[0] = fsum;
-            break;
-        case FLOAT64:
-            double dsum = 0.0;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:dsum) //multithreading and simd reduction(+:sum)
-            for(int i = 0; i<t1->size; i++){
-                dsum += t1->data.float64[i];
-            }
-            t->data.float64[0] = dsum;
-            break;
-        case INT:
-           int isum = 0;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:isum) //multithreading and simd reduction(+:sum)
-            for(int i = 0; i<t1->size; i++){
-                isum += t1->data.Int[i];
-            }
-            t->data.Int[0] = isum;
-            break;
-        default:
-            free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
+// rebinds the plannable intermediates into a single workspace; returns its size in bytes (0 if nothing was planned)
+size_t graph_plan(Graph *g){
+    if(!g || g->workspace) return g ? g->workspace_size : 0;
+    int n = g->num_nodes;
+    int *uses = (int *)calloc(n, sizeof(int));
+    bool *plannable = (bool *)calloc(n, sizeof(bool));
+    size_t *offset = (size_t *)malloc(n * sizeof(size_t));
+    if(!uses || !plannable || !offset){
+        fprintf(stderr, "Memory allocation for the memory plan failed\n");
+        free(uses); free(plannable); free(offset);
+        return 0;
     }
 
-    t->op=SUM;
-    t->prevs[0] = t1;
+    // pending holds the node index while planning; inputs not marked in this epoch are leaves
+    unsigned int epoch = ++graph_epoch;
+    for(int i=0; i<n; i++){
+        Tensor *t = g->nodes[i];
+        t->visit = epoch;
+        t->pending = i;
+        plannable[i] = t != g->root && t->requires_grad != true && t->size > 0;
+    }
+    for(int j=0; j<n; j++){
+        Tensor *t = g->nodes[j];
+        for(int k=0; k<t->num_prevs; k++){
+            Tensor *p = t->prevs[k];
+            if(p->visit != epoch) continue;
+            uses[p->pending]++;
+            if(t->requires_grad == true) plannable[p->pending] = false;
+        }
+    }
+    // a node referenced from outside the graph (a variable the caller retained) keeps its buffer
+    for(int i=0; i<n; i++){
+        if(g->nodes[i]->ref_count != 1 + uses[i]) plannable[i] = false;
+    }
 
-    return t;
+    size_t unplanned, total = plan_layout(g, epoch, plannable, NULL, offset, &unplanned);
+    char *workspace = total ? (char *)data_alloc(total) : NULL;
+    if(total && !workspace) fprintf(stderr, "Memory allocation for the workspace failed\n");
+    if(workspace){
+        for(int i=0; i<n; i++){
+            if(!plannable[i]) continue;
+            Tensor *t = g->nodes[i];
+            free(t->data.float32);
+            t->data.float32 = (float *)(workspace + offset[i]);
+        }
+        g->workspace = workspace;
+        g->workspace_size = total;
+        g->unplanned_size = unplanned;
+    }
+    for(int i=0; i<n; i++) g->nodes[i]->pending = 0;
+    free(uses); free(plannable); free(offset);
+    return g->workspace_size;
 }
 
-void sum_backward(Tensor * out){
-    if (!out) return;
-    if (out->requires_grad == true )
-    {
-        switch (out->dtype)
-        {
-        case FLOAT32:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i = 0; i<out->prevs[0]->size; i++){
-                out->prevs[0]->grad.float32[i] += out->grad.float32[0] * 1.0f;
-            }
-            break;
-        case FLOAT64:
-            // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-            for(int i = 0; i<out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->grad.float64[0] * 1.0;
-                }
-            break;
-        default:
-            // t_free(out);
-            fprintf(stderr, "Unsupported data type \n");
-            return;
-            break;
-        }
-    } 
+void graph_free(Graph *g){
+    if(!g) return;
+    // the planned intermediates point into the workspace, which is freed once below
+    for(int i=0; i<g->num_nodes && g->workspace; i++){
+        char *data = (char *)g->nodes[i]->data.float32;
+        if(data >= g->workspace && data < g->workspace + g->workspace_size) g->nodes[i]->data.float32 = NULL;
+    }
+    bool root_held = !g->num_nodes || g->nodes[g->num_nodes - 1] != g->root;
+    // release from the root down so no node is freed before its consumers
+    for(int i=g->num_nodes-1; i>=0; i--) t_release(g->nodes[i]);
+    if(root_held) t_release(g->root);
+    free(g->nodes);
+    free(g->forward);
+    free(g->workspace);
+    free(g);
 }
 
-Tensor * mean(Tensor * t1){
-    if(!t1) return NULL;
-    bool require_grad = (t1->requires_grad == true )? true : false;
-    Tensor *t = tensor(NULL, t1->dtype, (int[]){1}, require_grad);
-    if(!t) return NULL;
+// ahead-of-time compilation
+// graph_emit_c() turns a captured graph into a standalone C file: one function that runs the forward pass with
+// every shape baked in as a constant, the leaves that are not inputs embedded as constant arrays and the
+// intermediates laid out in one static workspace by the memory planner. Each op becomes a plain loop for its dtype
+// and shapes, and a chain of fusable elementwise ops becomes a single loop that keeps the values in registers. The
+// file needs only <math.h> and <string.h>. Math calls go to libm, so results can differ from the runtime kernels in
+// the last bits.
+typedef struct{
+    Graph *g;
+    FILE *f;
+    unsigned int epoch;
+    Tensor **inputs;
+    int num_inputs;
+    Tensor **constants;  // the other leaves, in order of first use
+    int num_constants;
+    int *consumer;       // the one node reading each node, -1 if none, -2 if several
+    bool *fused;         // computed inside the loop of its consumer
+} Emitter;
+
+static const char *emit_ctype(DType dtype){
+    return dtype == FLOAT32 ? "float" : dtype == FLOAT64 ? "double" : "int";
+}
 
-    switch(t1->dtype){
-        case FLOAT32:
-            float fmean = 0.0f;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:fmean) //multithreading and simd reduction(+:mean)
-            for(int i = 0; i<t1->size; i++){
-                fmean += t1->data.float32[i];
-            }
-            fmean = fmean/t1->size;
-            t->data.float32[0] = fmean;
-            break;
-        case FLOAT64:
-            double dmean = 0.0;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:dmean) //multithreading and simd reduction(+:mean)
-            for(int i = 0; i<t1->size; i++){
-                dmean += t1->data.float64[i];
-            }
-            dmean = dmean/t1->size;
-            t->data.float64[0] = dmean;
-            break;
-        case INT:
-            t_free(t);
-            fprintf(stderr, " mean(): could not infer output dtype. Input dtype must be either a floating point or complex dtype. Got: int32 \n");
-            return NULL;
-            break;
+// libm name for the dtype: expf for float, exp for double
+static const char *emit_fn(DType dtype, const char *fn){
+    static char buf[4][16];
+    static int slot = 0;
+    char *s = buf[slot++ & 3];
+    snprintf(s, 16, "%s%s", fn, dtype == FLOAT32 ? "f" : "");
+    return s;
+}
 
-        default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
+static void emit_literal(FILE *f, DType dtype, double v){
+    if(dtype == INT){
+        fprintf(f, "%d", (int)v);
+        return;
     }
+    if(isnan(v)){ fprintf(f, "NAN"); return; }
+    if(isinf(v)){ fprintf(f, v > 0 ? "INFINITY" : "-INFINITY"); return; }
+    char buf[40];
+    snprintf(buf, sizeof(buf), dtype == FLOAT32 ? "%.9g" : "%.17g", dtype == FLOAT32 ? (double)(float)v : v);
+    if(!strpbrk(buf, ".e")) strcat(buf, ".0");
+    fprintf(f, "%s%s", buf, dtype == FLOAT32 ? "f" : "");
+}
 
-    t->op=MEAN;
-    t->prevs[0] = t1;
-    t->num_prevs =1;
+static void emit_name(Emitter *e, Tensor *t, char *buf){
+    if(t == e->g->root){ strcpy(buf, "out"); return; }
+    if(t->visit == e->epoch){ sprintf(buf, "t%d", t->pending); return; }
+    for(int k=0; k<e->num_inputs; k++)
+        if(e->inputs[k] == t){ sprintf(buf, "in%d", k); return; }
+    for(int k=0; k<e->num_constants; k++)
+        if(e->constants[k] == t){ sprintf(buf, "c%d", k); return; }
+    strcpy(buf, "?");
+}
 
-    return t;
+// element i of t: a register for fused nodes, a load otherwise
+static void emit_element(Emitter *e, Tensor *t, char *buf){
+    if(t->visit == e->epoch && e->fused[t->pending]){ sprintf(buf, "v%d", t->pending); return; }
+    emit_name(e, t, buf);
+    strcat(buf, "[i]");
 }
 
-void mean_backward(Tensor * out){
-    if(!out) return;
-    
-    if(out->requires_grad == true){
-        switch(out->dtype){
-            case FLOAT32:
-                // Ensure `out->grad` and `out->prevs[0]->grad` are allocated
-                if (!out->grad.float32 || !out->prevs[0]->grad.float32) {
-                    fprintf(stderr, "Gradient memory not allocated\n");
-                    return;
-                }
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float32[i] += out->grad.float32[0] / out->prevs[0]->size;
-                }
-                break;
-            case FLOAT64:
-                // Ensure `out->grad` and `out->prevs[0]->grad` are allocated
-                if (!out->grad.float64 || !out->prevs[0]->grad.float64) {
-                    fprintf(stderr, "Gradient memory not allocated\n");
-                    return;
-                }
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for(int i=0; i < out->prevs[0]->size; i++){
-                    out->prevs[0]->grad.float64[i] += out->grad.float64[0] / out->prevs[0]->size;
-                }
-                break;
-            default:
-                // t_free(out);
-                fprintf(stderr, "Unsupported data type \n");
-                break;
+// the value of elementwise node t at element i
+static void emit_expression(Emitter *e, Tensor *t){
+    FILE *f = e->f;
+    DType dt = t->dtype;
+    char a[40], b[40];
+    emit_element(e, t->prevs[0], a);
+    if(t->num_prevs > 1) emit_element(e, t->prevs[1], b);
+    switch(t->op){
+        case ADD: fprintf(f, "%s + %s", a, b); break;
+        case SUB: fprintf(f, "%s - %s", a, b); break;
+        case MUL: fprintf(f, "%s * %s", a, b); break;
+        case DIV: fprintf(f, "%s / %s", a, b); break;
+        case RELU: fprintf(f, "%s < 0 ? 0 : %s", a, a); break;
+        case LEAKY_RELU:
+            fprintf(f, "%s < 0 ? ", a);
+            emit_literal(f, dt, t->extra);
+            fprintf(f, " * %s : %s", a, a);
+            break;
+        case EXP: fprintf(f, "%s(%s)", emit_fn(dt, "exp"), a); break;
+        case LOG: fprintf(f, "%s(%s)", emit_fn(dt, "log"), a); break;
+        case TANH: fprintf(f, "%s(%s)", emit_fn(dt, "tanh"), a); break;
+        case SIGMOID: fprintf(f, "1 / (1 + %s(-%s))", emit_fn(dt, "exp"), a); break;
+        case GELU:
+            fprintf(f, "%s * %s * (1 + %s(%s * ", dt == FLOAT32 ? "0.5f" : "0.5", a, emit_fn(dt, "erf"), a);
+            emit_literal(f, dt, 0.70710678118654752);
+            fprintf(f, "))");
+            break;
+        case POW:{
+            double x = t->extra;
+            if(dt == INT) fprintf(f, "nan_ipow(%s, %d)", a, (int)x);
+            else if(x == 0) fprintf(f, "1");
+            else if(x == 1) fprintf(f, "%s", a);
+            else if(x == 2) fprintf(f, "%s * %s", a, a);
+            else if(x == 3) fprintf(f, "%s * %s * %s", a, a, a);
+            else if(x == 4) fprintf(f, "(%s * %s) * (%s * %s)", a, a, a, a);
+            else if(x == -1) fprintf(f, "1 / %s", a);
+            else if(x == -2) fprintf(f, "1 / (%s * %s)", a, a);
+            else if(x == 0.5) fprintf(f, "%s(%s)", emit_fn(dt, "sqrt"), a);
+            else if(x == -0.5) fprintf(f, "1 / %s(%s)", emit_fn(dt, "sqrt"), a);
+            else{
+                fprintf(f, "%s(%s, ", emit_fn(dt, "pow"), a);
+                emit_literal(f, dt, x);
+                fprintf(f, ")");
+            }
+            break;
         }
+        default: break;
     }
 }
 
-Tensor *MSELoss(Tensor * yTrue, Tensor * yPred){
-    // Validate inputs
-    if(!yTrue || !yPred){
-        fprintf(stderr, "Input tensors cannot be NULL\n");
-        return NULL;
-    }
-
-    // Check dimensions and data types
-    if (yTrue->ndim != yPred->ndim || 
-        yPred->dtype != yTrue->dtype || 
-        yTrue->size != yPred->size) {
-        fprintf(stderr, "Incompatible tensor dimensions or types\n");
-        return NULL;
+static void emit_fused_inputs(Emitter *e, Tensor *t){
+    for(int k=0; k<t->num_prevs; k++){
+        Tensor *p = t->prevs[k];
+        if(p->visit != e->epoch || !e->fused[p->pending] || (k == 1 && t->prevs[0] == p)) continue;
+        emit_fused_inputs(e, p);
+        fprintf(e->f, "        %s v%d = ", emit_ctype(p->dtype), p->pending);
+        emit_expression(e, p);
+        fprintf(e->f, ";\n");
     }
+}
 
-    // Check dimension compatibility
-    for (int i = 0; i < yPred->ndim; i++)
-    {
-        if (yTrue->dims[i] != yPred->dims[i]) {
-            fprintf(stderr, "Tensor dimensions do not match\n");
-            return NULL;
-        }
+// names of the ops fused into t's loop, in the order they run
+static void emit_chain(Emitter *e, Tensor *t){
+    for(int k=0; k<t->num_prevs; k++){
+        Tensor *p = t->prevs[k];
+        if(p->visit != e->epoch || !e->fused[p->pending] || (k == 1 && t->prevs[0] == p)) continue;
+        emit_chain(e, p);
+        fprintf(e->f, "%s, ", op_table[p->op].name);
     }
+}
 
-    bool require_grad = (yPred->requires_grad == true )? true : false;
-
-    Tensor *t = tensor(NULL, yPred->dtype, (int[]){1}, require_grad);
-    if(!t){
-        fprintf(stderr, "Memory allocation for MSE tensor failed\n");
-        return NULL;
+static void emit_node(Emitter *e, Tensor *t){
+    FILE *f = e->f;
+    const char *T = emit_ctype(t->dtype);
+    char o[16], x[16], y[16], z[16];
+    emit_name(e, t, o);
+    emit_name(e, t->prevs[0], x);
+    if(t->num_prevs > 1) emit_name(e, t->prevs[1], y);
+    if(t->num_prevs > 2) emit_name(e, t->prevs[2], z);
+    fprintf(f, "    // ");
+    if(op_table[t->op].flags & OP_FUSABLE) emit_chain(e, t);
+    fprintf(f, "%s\n", op_table[t->op].name);
+
+    if(op_table[t->op].flags & OP_FUSABLE){
+        fprintf(f, "    for(int i=0; i<%d; i++){\n", t->size);
+        emit_fused_inputs(e, t);
+        fprintf(f, "        %s[i] = ", o);
+        emit_expression(e, t);
+        fprintf(f, ";\n    }\n");
+        return;
     }
-    
-    switch (yPred->dtype){
-        case FLOAT32:
-            float floss = 0.0f;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:floss) //multithreading and simd reduction(+:loss)
-            for (int i = 0; i < yPred->size; i++){
-                float fdiff = yTrue->data.float32[i] - yPred->data.float32[i];
-                floss += fdiff * fdiff; 
+    switch(t->op){
+        case MATMUL:{
+            Tensor *pa = t->prevs[0];
+            int m = t->dims[t->ndim - 2], n = t->dims[t->ndim - 1], l = pa->dims[pa->ndim - 1];
+            int batch = matmul_batches(t);
+            if(batch > 1){
+                // matrices of A and B used by each output matrix, resolved from the broadcast now
+                for(int side=0; side<2; side++){
+                    fprintf(f, "    static const int %s_%c[%d] = {", o, "ab"[side], batch);
+                    for(int b=0; b<batch; b++){
+                        int ia, ib;
+                        matmul_batch_index(t, b, &ia, &ib);
+                        fprintf(f, "%s%d", b ? ", " : "", side ? ib : ia);
+                    }
+                    fprintf(f, "};\n");
+                }
             }
-            floss = floss / (2.0f * yPred->size);
-            t->data.float32[0] = floss;
+            fprintf(f, "    for(int b=0; b<%d; b++){\n", batch);
+            if(batch > 1) fprintf(f, "        const %s *A = %s + (size_t)%s_a[b]*%d, *B = %s + (size_t)%s_b[b]*%d;\n",
+                                  T, x, o, m * l, y, o, l * n);
+            else fprintf(f, "        const %s *A = %s, *B = %s;\n", T, x, y);
+            fprintf(f, "        %s *C = %s + (size_t)b*%d;\n", T, o, m * n);
+            fprintf(f, "        for(int i=0; i<%d; i++){\n", m);
+            fprintf(f, "            %s *c = C + (size_t)i*%d;\n", T, n);
+            fprintf(f, "            for(int j=0; j<%d; j++) c[j] = 0;\n", n);
+            fprintf(f, "            for(int k=0; k<%d; k++){\n", l);
+            fprintf(f, "                %s a = A[(size_t)i*%d + k];\n", T, l);
+            fprintf(f, "                const %s *r = B + (size_t)k*%d;\n", T, n);
+            fprintf(f, "                for(int j=0; j<%d; j++) c[j] += a * r[j];\n", n);
+            fprintf(f, "            }\n        }\n    }\n");
             break;
-        case FLOAT64:
-            double dloss = 0.0;  // Scalar reduction variable
-            // #pragma omp parallel for simd reduction(+:dloss) //multithreading and simd reduction(+:loss)
-            for (int i = 0; i < yPred->size; i++){
-                double ddiff = yTrue->data.float64[i] - yPred->data.float64[i];
-                dloss += ddiff * ddiff;
+        }
+        case MATMUL_PACKED:{
+            // the weight constant keeps its panel layout [panels, l, cols]
+            Tensor *pw = t->prevs[1];
+            int panels = pw->dims[0], l = pw->dims[1], cols = pw->dims[2], n = t->dims[t->ndim - 1], m = t->size / n;
+            fprintf(f, "    for(int i=0; i<%d; i++){\n", m);
+            fprintf(f, "        %s *c = %s + (size_t)i*%d;\n", T, o, n);
+            fprintf(f, "        for(int j=0; j<%d; j++) c[j] = 0;\n", n);
+            fprintf(f, "        for(int p=0; p<%d; p++){\n", panels);
+            fprintf(f, "            int j0 = p*%d, w = %d - j0 < %d ? %d - j0 : %d;\n", cols, n, cols, n, cols);
+            fprintf(f, "            for(int k=0; k<%d; k++){\n", l);
+            fprintf(f, "                %s a = %s[(size_t)i*%d + k];\n", T, x, l);
+            fprintf(f, "                const %s *r = %s + ((size_t)p*%d + k)*%d;\n", T, y, l, cols);
+            fprintf(f, "                for(int j=0; j<w; j++) c[j0 + j] += a * r[j];\n");
+            fprintf(f, "            }\n        }\n    }\n");
+            break;
+        }
+        case SOFTMAX:{
+            int outer, len, inner;
+            softmax_layout(t, (int)t->extra, &outer, &len, &inner);
+            fprintf(f, "    for(int p=0; p<%d; p++){\n", outer);
+            fprintf(f, "        for(int q=0; q<%d; q++){\n", inner);
+            fprintf(f, "            const %s *xs = %s + (size_t)p*%d + q;\n", T, x, len * inner);
+            fprintf(f, "            %s *os = %s + (size_t)p*%d + q, mx = xs[0], s = 0;\n", T, o, len * inner);
+            fprintf(f, "            for(int i=1; i<%d; i++) if(xs[i*%d] > mx) mx = xs[i*%d];\n", len, inner, inner);
+            fprintf(f, "            for(int i=0; i<%d; i++){\n", len);
+            fprintf(f, "                os[i*%d] = %s(xs[i*%d] - mx);\n", inner, emit_fn(t->dtype, "exp"), inner);
+            fprintf(f, "                s += os[i*%d];\n            }\n", inner);
+            fprintf(f, "            for(int i=0; i<%d; i++) os[i*%d] /= s;\n", len, inner);
+            fprintf(f, "        }\n    }\n");
+            break;
+        }
+        case LAYER_NORM:
+        case RMS_NORM:{
+            bool layer = t->op == LAYER_NORM;
+            int n = t->dims[t->ndim - 1], rows = t->size / n;
+            fprintf(f, "    for(int r=0; r<%d; r++){\n", rows);
+            fprintf(f, "        const %s *x = %s + (size_t)r*%d;\n", T, x, n);
+            fprintf(f, "        %s *y = %s + (size_t)r*%d, mean = 0, var = 0;\n", T, o, n);
+            if(layer){
+                fprintf(f, "        for(int j=0; j<%d; j++) mean += x[j];\n", n);
+                fprintf(f, "        mean /= %d;\n", n);
             }
-            dloss = dloss / (2.0 * yPred->size);
-            t->data.float64[0] = dloss;
+            fprintf(f, "        for(int j=0; j<%d; j++) var += (x[j] - mean) * (x[j] - mean);\n", n);
+            fprintf(f, "        %s rstd = 1 / %s(var / %d + ", T, emit_fn(t->dtype, "sqrt"), n);
+            emit_literal(f, t->dtype, t->extra);
+            fprintf(f, ");\n");
+            if(layer) fprintf(f, "        for(int j=0; j<%d; j++) y[j] = (x[j] - mean) * rstd * %s[j] + %s[j];\n", n, y, z);
+            else fprintf(f, "        for(int j=0; j<%d; j++) y[j] = x[j] * rstd * %s[j];\n", n, y);
+            fprintf(f, "    }\n");
             break;
-
-        case INT:
-            t_free(t);
-            fprintf(stderr, " RuntimeError: \"mse_cpu\" not implemented for 'Int' \n");
-            return NULL;
+        }
+        case INDEX_SELECT:
+        case EMBEDDING:{
+            int outer, len, inner, count = t->prevs[1]->size;
+            index_layout(t->prevs[0], (int)t->extra, &outer, &len, &inner);
+            fprintf(f, "    for(int o=0; o<%d; o++)\n", outer);
+            fprintf(f, "        for(int i=0; i<%d; i++)\n", count);
+            fprintf(f, "            memcpy(%s + ((size_t)o*%d + i)*%d, %s + ((size_t)o*%d + %s[i])*%d, %d * sizeof(%s));\n",
+                    o, count, inner, x, len, y, inner, inner, T);
             break;
+        }
+        case GATHER:{
+            int dim = (int)t->extra, outer, len, inner, count = t->prevs[1]->dims[dim];
+            index_layout(t->prevs[0], dim, &outer, &len, &inner);
+            fprintf(f, "    for(int o=0; o<%d; o++){\n", outer);
+            fprintf(f, "        for(int i=0; i<%d; i++){\n", count);
+            fprintf(f, "            size_t base = ((size_t)o*%d + i)*%d;\n", count, inner);
+            fprintf(f, "            for(int k=0; k<%d; k++) %s[base + k] = %s[((size_t)o*%d + %s[base + k])*%d + k];\n",
+                    inner, o, x, len, y, inner);
+            fprintf(f, "        }\n    }\n");
+            break;
+        }
+        case SUM:
+        case MEAN:
+        case MSE:
+        case MAE:{
+            int n = t->prevs[t->num_prevs - 1]->size;
+            fprintf(f, "    {\n        %s acc = 0;\n", T);
+            if(t->op == MSE) fprintf(f, "        for(int i=0; i<%d; i++) acc += (%s[i] - %s[i]) * (%s[i] - %s[i]);\n", n, x, y, x, y);
+            else if(t->op == MAE) fprintf(f, "        for(int i=0; i<%d; i++) acc += %s(%s[i] - %s[i]);\n", n, emit_fn(t->dtype, "fabs"), x, y);
+            else fprintf(f, "        for(int i=0; i<%d; i++) acc += %s[i];\n", n, x);
+            fprintf(f, "        %s[0] = acc%s", o, t->op == SUM ? ";\n" : " / ");
+            if(t->op != SUM) fprintf(f, "%d;\n", t->op == MSE ? 2 * n : n);
+            fprintf(f, "    }\n");
+            break;
+        }
+        case ATTENTION:
+        case ATTENTION_MASKED:{
+            Tensor *pq = t->prevs[0], *pk = t->prevs[1], *pv = t->prevs[2], *pm = t->num_prevs > 3 ? t->prevs[3] : NULL;
+            int nd = t->ndim, Lq = pq->dims[nd - 2], d = pq->dims[nd - 1], Lk = pk->dims[nd - 2], dv = pv->dims[nd - 1];
+            int heads = t->size / (Lq * dv), shift = Lk - Lq;
+            char mask[16];
+            if(pm) emit_name(e, pm, mask);
+            fprintf(f, "    for(int h=0; h<%d; h++){\n", heads);
+            fprintf(f, "        for(int q=0; q<%d; q++){\n", Lq);
+            fprintf(f, "            static %s s[%d];\n", T, Lk);
+            fprintf(f, "            const %s *qr = %s + ((size_t)h*%d + q)*%d;\n", T, x, Lq, d);
+            fprintf(f, "            %s *o = %s + ((size_t)h*%d + q)*%d, mx = -INFINITY, sum = 0;\n", T, o, Lq, dv);
+            // queries before Lq - Lk see no key when Lq > Lk: visible <= 0 leaves mx at -INFINITY and o at 0
+            if(t->extra != 0) fprintf(f, "            int visible = q %c %d < %d ? q %c %d : %d;\n", shift + 1 < 0 ? '-' : '+',
+                                      abs(shift + 1), Lk, shift + 1 < 0 ? '-' : '+', abs(shift + 1), Lk);
+            else fprintf(f, "            int visible = %d;\n", Lk);
+            fprintf(f, "            for(int c=0; c<visible; c++){\n");
+            fprintf(f, "                const %s *kc = %s + ((size_t)h*%d + c)*%d;\n", T, y, Lk, d);
+            fprintf(f, "                %s dot = 0;\n", T);
+            fprintf(f, "                for(int j=0; j<%d; j++) dot += qr[j] * kc[j];\n", d);
+            fprintf(f, "                s[c] = dot * ");
+            emit_literal(f, t->dtype, t->dtype == FLOAT32 ? (double)(1 / sqrtf((float)d)) : 1 / sqrt((double)d));
+            if(pm) fprintf(f, " + %s[(size_t)h*%d + (size_t)q*%d + c]", mask, pm->ndim > 2 ? Lq * Lk : 0, Lk);
+            fprintf(f, ";\n                if(s[c] > mx) mx = s[c];\n            }\n");
+            fprintf(f, "            for(int j=0; j<%d; j++) o[j] = 0;\n", dv);
+            fprintf(f, "            // a row whose keys are all masked out attends to nothing\n");
+            fprintf(f, "            if(mx == -INFINITY) continue;\n");
+            fprintf(f, "            for(int c=0; c<visible; c++){\n");
+            fprintf(f, "                %s p = %s(s[c] - mx);\n", T, emit_fn(t->dtype, "exp"));
+            fprintf(f, "                const %s *vc = %s + ((size_t)h*%d + c)*%d;\n", T, z, Lk, dv);
+            fprintf(f, "                sum += p;\n");
+            fprintf(f, "                for(int j=0; j<%d; j++) o[j] += p * vc[j];\n", dv);
+            fprintf(f, "            }\n");
+            fprintf(f, "            for(int j=0; j<%d; j++) o[j] /= sum;\n", dv);
+            fprintf(f, "        }\n    }\n");
+            break;
+        }
+        default: break;
+    }
+}
 
+static bool emit_supported(Tensor *t){
+    switch(t->op){
+        case MATMUL: case MATMUL_PACKED: case SOFTMAX: case LAYER_NORM: case RMS_NORM: case INDEX_SELECT:
+        case EMBEDDING: case GATHER: case SUM: case MEAN: case MSE: case MAE: case ATTENTION: case ATTENTION_MASKED:
+            return true;
         default:
-            // t_free(t);
-            fprintf(stderr, "Unsupported data type \n");
-            return NULL;
+            return (op_table[t->op].flags & OP_FUSABLE) != 0;
     }
-    t->op = MSE;
-    t->prevs[0] = yTrue;
-    t->prevs[1] = yPred;
-    t->num_prevs = 2;
-    return t;
 }
 
-void MSELoss_backward(Tensor * out){
-    if(!out) return;  //Null checks
-
-    if(out->requires_grad == true){
-        switch (out->dtype){
-            case FLOAT32:
-                float fscale = -out->grad.float32[0] / (float)out->prevs[0]->size;     
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    float fgrad = (out->prevs[0]->data.float32[i] - out->prevs[1]->data.float32[i]) * fscale;//Gradient of MSE
-                    out->prevs[1]->grad.float32[i] += fgrad ; //chain rule
-                }   
-                break;
-            case FLOAT64:
-                double dscale = -out->grad.float64[0] / (double)out->prevs[0]->size;
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[0]->size; i++){
-                    double dgrad = (out->prevs[0]->data.float64[i] - out->prevs[1]->data.float64[i]) * dscale;  //Gradient of MSE
-                    out->prevs[1]->grad.float64[i] += dgrad;  //chain rule
-                }
-                break;
-            case INT:
-                fprintf(stderr, "Backward pass not implemented for 'Int'\n");
-                break;
-            default:
-                fprintf(stderr, "Unsupported data type in backward pass\n");
-                break;
+static void emit_constant(FILE *f, Tensor *t, int k){
+    fprintf(f, "static const %s c%d[%d] = {", emit_ctype(t->dtype), k, t->size);
+    for(int i=0; i<t->size; i++){
+        fprintf(f, i % 8 ? ", " : i ? ",\n    " : "\n    ");
+        switch(t->dtype){
+            case FLOAT32: emit_literal(f, FLOAT32, t->data.float32[i]); break;
+            case FLOAT64: emit_literal(f, FLOAT64, t->data.float64[i]); break;
+            case INT: fprintf(f, "%d", t->data.Int[i]); break;
         }
     }
+    fprintf(f, "\n};\n");
 }
 
-Tensor * MAELoss(Tensor * yTrue, Tensor * yPred){
-    if (!yPred || !yTrue)
-    {
-        fprintf(stderr, "Input Tensor cannot be NULL\n");
-        return NULL;
-    }
+static void emit_dims(FILE *f, Tensor *t){
+    fprintf(f, "%s [", emit_ctype(t->dtype));
+    for(int d=0; d<t->ndim; d++) fprintf(f, d ? ", %d" : "%d", t->dims[d]);
+    fprintf(f, "]");
+}
 
-    if (yPred->dtype != yTrue->dtype || yPred->ndim != yTrue->ndim || yPred->size != yTrue->size)
-    {
-        fprintf(stderr, "Incompatible Tensors DType or Dimmension");
-        return NULL;
+static int emit_file(Emitter *e, const bool *plannable, const size_t *offset, size_t total, bool ipow,
+                     const char *name, const char *path){
+    Graph *g = e->g;
+    FILE *f = e->f = fopen(path, "w");
+    if(!f){
+        fprintf(stderr, "graph_emit_c: cannot open %s\n", path);
+        return -1;
     }
-
-    for (int i = 0; i < yPred->ndim; i++)
-    {
-        if (yPred->dims[i] != yTrue->dims[i])
-        {
-            fprintf(stderr, "Tensor Dimmesions do not match!\n");
-            return NULL;
-        } 
+    fprintf(f, "// generated by graph_emit_c(): %d ops, %d constants, %zu bytes of workspace\n", g->num_nodes,
+            e->num_constants, total);
+    for(int k=0; k<e->num_inputs; k++){
+        fprintf(f, "// in%d: ", k);
+        emit_dims(f, e->inputs[k]);
+        fprintf(f, "\n");
     }
-
-    bool required_grad = (yPred->requires_grad == true )? true : false;
-
-    Tensor * t = tensor(NULL, yPred->dtype, (int[]){1}, required_grad);
-    if (!t)
-    {
-        fprintf(stderr, "Memory allocation for MAE tensor failed\n");
-        return NULL;
+    fprintf(f, "// out: ");
+    emit_dims(f, g->root);
+    fprintf(f, "\n#include <math.h>\n#include <string.h>\n\n");
+    for(int k=0; k<e->num_inputs; k++) fprintf(f, "#define %s_IN%d_SIZE %d\n", name, k, e->inputs[k]->size);
+    fprintf(f, "#define %s_OUT_SIZE %d\n\n", name, g->root->size);
+    if(ipow){
+        fprintf(f, "static int nan_ipow(int base, int e){\n");
+        fprintf(f, "    int r = 1;\n");
+        fprintf(f, "    for(int k=e<0 ? -e : e; k; k>>=1){\n");
+        fprintf(f, "        if(k & 1) r *= base;\n");
+        fprintf(f, "        base *= base;\n    }\n");
+        fprintf(f, "    return (e >= 0 || r == 1 || r == -1) ? r : 0;\n}\n\n");
     }
-
-    switch (t->dtype)
-    {
-    case FLOAT32:
-        float floss = 0.0f; //scalar value for loss
-        // #pragma omp parallel for simd reduction(+:floss) //multithreading and simd for scalar accumulated value
-        for (int i = 0; i < yPred->size; i++)
-        {
-            floss += fabsf(yTrue->data.float32[i] - yPred->data.float32[i]);
-        }
-        t->data.float32[0] = floss / yPred->size;
-        break;
-    case FLOAT64:
-        double dloss = 0.0; //scalar value for loss
-        // #pragma omp parallel for simd reduction(+:dloss) //multithreading and simd for scalar accumulated value
-        for (int i = 0; i < yPred->size; i++)
-        {
-            dloss += fabsf(yTrue->data.float64[i] - yPred->data.float64[i]);
-        }
-        t->data.float64[0] = dloss / yPred->size;
-        break;
-    case INT:
-        t_free(t);
-        fprintf(stderr, " RuntimeError: \"mae_cpu\" not implemented for 'Int' \n");
-        return NULL;
-        break;
-    default:
-        // t_free(t);
-        fprintf(stderr, "Unsupported data type \n");
-        return NULL;
-    }   
-
-    t->op = MAE;
-    t->prevs[0] = yTrue;
-    t->prevs[1] = yPred;
-    t->num_prevs = 2;
-    return t;
+    for(int k=0; k<e->num_constants; k++) emit_constant(f, e->constants[k], k);
+    if(total) fprintf(f, "\nstatic _Alignas(64) unsigned char %s_workspace[%zu];\n", name, total);
+
+    fprintf(f, "\nvoid %s(", name);
+    for(int k=0; k<e->num_inputs; k++) fprintf(f, "const %s *in%d, ", emit_ctype(e->inputs[k]->dtype), k);
+    fprintf(f, "%s *out){\n", emit_ctype(g->root->dtype));
+    for(int i=0; i<g->num_nodes; i++){
+        if(!plannable[i]) continue;
+        const char *T = emit_ctype(g->nodes[i]->dtype);
+        fprintf(f, "    %s *t%d = (%s *)(%s_workspace + %zu);\n", T, i, T, name, offset[i]);
+    }
+    for(int i=0; i<g->num_nodes; i++){
+        if(!e->fused[i]) emit_node(e, g->nodes[i]);
+    }
+    fprintf(f, "}\n");
+    int rc = ferror(f) ? -1 : 0;
+    if(fclose(f) != 0) rc = -1;
+    if(rc) fprintf(stderr, "graph_emit_c: writing %s failed\n", path);
+    return rc;
 }
 
-void MAELoss_backward(Tensor * out){
-    if (!out) //NULL check
-    {
-        return;
+// writes `name` as C source to `path`: void name(const T *in0, ..., T *out) computes the root from the data of
+// `inputs` (leaves of the graph); every other leaf is embedded with the value it has now. Returns 0 on success.
+int graph_emit_c(Graph *g, Tensor **inputs, int num_inputs, const char *name, const char *path){
+    if(!g || !name || !path || g->num_nodes == 0 || g->nodes[g->num_nodes - 1] != g->root){
+        fprintf(stderr, "graph_emit_c: nothing to compile\n");
+        return -1;
     }
-
-    if (out->requires_grad == true)
-    {
-        switch (out->dtype)
-        {
-            case FLOAT32:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[1]->size; i++)
-                {
-                    if (out->prevs[1]->data.float32[i] > out->prevs[0]->data.float32[i])
-                    {
-                        out->prevs[1]->grad.float32[i] = -out->grad.float32[0] / out->prevs[1]->size;
-                    } else if (out->prevs[1]->data.float32[i] < out->prevs[0]->data.float32[i])
-                    {
-                        out->prevs[1]->grad.float32[i] = out->grad.float32[0] / out->prevs[1]->size;
-                    } else
-                    {
-                        out->prevs[1]->grad.float32[i] = 0.0f;
-                    }
-                    
-                    
-                }
-                break;
-            case FLOAT64:
-                // #pragma omp parallel for simd //multithreading or Parallelize the loop with SIMD
-                for (int i = 0; i < out->prevs[1]->size; i++)
-                {
-                    if (out->prevs[1]->data.float64[i] > out->prevs[0]->data.float64[i])
-                    {
-                        out->prevs[1]->grad.float64[i] = -out->grad.float64[0] / out->prevs[1]->size;
-                    } else if (out->prevs[1]->data.float64[i] < out->prevs[0]->data.float64[i])
-                    {
-                        out->prevs[1]->grad.float64[i] = out->grad.float64[0] / out->prevs[1]->size;
-                    } else
-                    {
-                        out->prevs[1]->grad.float64[i] = 0.0;
-                    }
-                }
-                break;
-            case INT:
-                fprintf(stderr, "Backward pass not implemented for 'Int'\n");
-                break;
-            default:
-                fprintf(stderr, "Unsupported data type in backward pass\n");
-                break;
+    int n = g->num_nodes;
+    for(int i=0; i<n; i++){
+        if(!emit_supported(g->nodes[i])){
+            fprintf(stderr, "graph_emit_c: '%s' is not supported%s\n", op_table[g->nodes[i]->op].name,
+                    g->nodes[i]->op == DROPOUT ? " (capture the graph with training off)" : "");
+            return -1;
+        }
+    }
+    for(int k=0; k<num_inputs; k++){
+        if(!inputs[k] || inputs[k]->num_prevs != 0){
+            fprintf(stderr, "graph_emit_c: input %d is not a leaf\n", k);
+            return -1;
         }
     }
-}
 
-void backward(Tensor * t){
-    //check if loss is NULL
-    if(!t) return;
+    Emitter e = {g, NULL, 0, inputs, num_inputs, NULL, 0, NULL, NULL};
+    e.constants = (Tensor **)malloc(MAX_PREVS * n * sizeof(Tensor *));
+    e.consumer = (int *)malloc(n * sizeof(int));
+    e.fused = (bool *)malloc(n * sizeof(bool));
+    int *exec = (int *)calloc(n, sizeof(int));
+    bool *plannable = (bool *)calloc(n, sizeof(bool));
+    size_t *offset = (size_t *)malloc(n * sizeof(size_t));
+    if(!e.constants || !e.consumer || !e.fused || !exec || !plannable || !offset){
+        fprintf(stderr, "Memory allocation for graph_emit_c failed\n");
+        free(e.constants); free(e.consumer); free(e.fused); free(exec); free(plannable); free(offset);
+        return -1;
+    }
 
-    if(t->op == MUL){
-        mul_backward(t);
-    }else if(t->op == ADD){
-        add_backward(t);
-    }else if(t->op == SUB){
-        sub_backward(t);
-    }else if(t->op == MATMUL){
-        matmul_backward(t);
-    }else if(t->op == MEAN){
-        mean_backward(t);
-    }else if(t->op == RELU){
-        relu_backward(t);
-    }else if(t->op == LEAKY_RELU){
-        leaky_relu_backward(t);
-    }else if(t->op == TANH){
-        Tanh_backward(t);
-    }else if(t->op == SIGMOID){
-        Sigmoid_backward(t);
-    }else if(t->op == SOFTMAX){
-        softmax_backward(t);
-    }else if(t->op == POW){
-        Pow_backward(t);
-    }else if(t->op == EXP){
-        Exp_backward(t);
-    }else if(t->op == DIV){
-        Div_backward(t);
-    }else if(t->op == SUM){
-        sum_backward(t);
-    }else if(t->op == MSE){
-        MSELoss_backward(t);
-    }else if (t->op == MAE)
-    {
-        MAELoss_backward(t);
+    // pending holds the node index; inputs not marked in this epoch are leaves
+    e.epoch = ++graph_epoch;
+    for(int i=0; i<n; i++){
+        g->nodes[i]->visit = e.epoch;
+        g->nodes[i]->pending = i;
+        e.consumer[i] = -1;
     }
-    
-    
-    for(int i=0; i<t->num_prevs; i++){
-        backward(t->prevs[i]);
+    bool ipow = false;
+    for(int j=0; j<n; j++){
+        Tensor *t = g->nodes[j];
+        ipow |= t->op == POW && t->dtype == INT;
+        for(int k=0; k<t->num_prevs; k++){
+            Tensor *p = t->prevs[k];
+            if(p->visit == e.epoch){
+                int i = p->pending;
+                e.consumer[i] = e.consumer[i] == -1 || e.consumer[i] == j ? j : -2;
+                continue;
+            }
+            bool known = false;
+            for(int c=0; c<num_inputs && !known; c++) known = inputs[c] == p;
+            for(int c=0; c<e.num_constants && !known; c++) known = e.constants[c] == p;
+            if(!known) e.constants[e.num_constants++] = p;
+        }
     }
+    // a fusable node read by one fusable node only is computed in its consumer's loop and needs no buffer
+    for(int i=n-1; i>=0; i--){
+        Tensor *t = g->nodes[i];
+        int c = e.consumer[i];
+        e.fused[i] = t != g->root && c >= 0 && (op_table[t->op].flags & OP_FUSABLE) && (op_table[g->nodes[c]->op].flags & OP_FUSABLE);
+        exec[i] = e.fused[i] ? exec[c] : i;
+        plannable[i] = !e.fused[i] && t != g->root;
+    }
+    bool buffers = false;
+    for(int i=0; i<n; i++) buffers |= plannable[i];
+    size_t unplanned, total = plan_layout(g, e.epoch, plannable, exec, offset, &unplanned);
+    int rc = buffers && !total ? -1 : emit_file(&e, plannable, offset, total, ipow, name, path);
+
+    for(int i=0; i<n; i++) g->nodes[i]->pending = 0;
+    free(e.constants); free(e.consumer); free(e.fused); free(exec); free(plannable); free(offset);
+    return rc;
 }
 
 // print data
@@ -2178,10 +4784,9 @@ void print(Tensor* t){
     }
     printf("]\n");
 
-    int rows = t->dims[0];
-    int cols = t->dims[1];
-
     if(t->ndim > 1){
+        int rows = t->dims[0];
+        int cols = t->dims[1];
         printf("  data:  [");
         for(int i=0; i<t->size; i++){
             int row = i/cols;
@@ -2312,4 +4917,589 @@ void print(Tensor* t){
     printf("}\n");
 }
 
+// CSV parsing
+// csv_load() maps the file and splits it into chunks of about CSV_CHUNK_BYTES that start after a newline. The
+// chunks are parsed in parallel twice: once to count their rows, so every chunk knows the row it starts at, and
+// once to write the values straight into the tensor. Numbers go through csv_number(), which needs no locale: a
+// mantissa of up to 19 digits that fits in 53 bits with a power of ten up to 1e22 is exact in a double, so one
+// multiply or divide rounds correctly; longer or larger numbers, and nan/inf, are left to strtod with the '.'
+// swapped for the decimal point of the current locale, which csv_load() reads once before the threads start.
+static const double csv_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                                   1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static bool csv_blank(char c){
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// parses the number at p (text ends at `end`); returns the first character after it, or NULL if there is none.
+// `point` is the locale's decimal point, for strtod.
+static const char *csv_number(const char *p, const char *end, const char *point, double *value){
+    const char *start = p;
+    bool neg = false, exact = true;
+    if(p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    uint64_t m = 0;
+    int digits = 0, exp10 = 0;
+    const char *d0 = p;
+    for(; p < end && (unsigned)(*p - '0') < 10; p++){
+        if(digits < 19){
+            m = m * 10 + (*p - '0');
+            digits += m != 0;
+        }else{
+            exp10++;
+            exact = false;
+        }
+    }
+    bool any = p > d0;
+    if(p < end && *p == '.'){
+        p++;
+        for(; p < end && (unsigned)(*p - '0') < 10; p++){
+            if(digits < 19){
+                m = m * 10 + (*p - '0');
+                digits += m != 0;
+                exp10--;
+            }else{
+                exact = false;
+            }
+            any = true;
+        }
+    }
+    if(any && p < end && (*p == 'e' || *p == 'E')){
+        const char *e = p + 1;
+        bool eneg = false;
+        if(e < end && (*e == '-' || *e == '+')) eneg = *e++ == '-';
+        if(e < end && (unsigned)(*e - '0') < 10){
+            int x = 0;
+            for(; e < end && (unsigned)(*e - '0') < 10; e++) x = x < 100000 ? x * 10 + (*e - '0') : x;
+            exp10 += eneg ? -x : x;
+            p = e;
+        }
+    }
+    if(any && exact && m <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22){
+        double v = exp10 < 0 ? (double)m / csv_pow10[-exp10] : (double)m * csv_pow10[exp10];
+        *value = neg ? -v : v;
+        return p;
+    }
+    // slow path on a terminated copy of the token
+    char buf[128];
+    size_t len = 0, plen = strlen(point);
+    const char *q = start;
+    for(; q < end && len + plen < sizeof(buf) - 1 && *q != ',' && *q != '\n' && !csv_blank(*q); q++){
+        if(*q != '.'){
+            buf[len++] = *q;
+            continue;
+        }
+        memcpy(buf + len, point, plen);
+        len += plen;
+    }
+    buf[len] = '\0';
+    char *stop;
+    *value = strtod(buf, &stop);
+    if(stop == buf) return NULL;
+    // back from the copy to the text
+    size_t used = (size_t)(stop - buf);
+    for(q = start, len = 0; len < used; q++) len += *q == '.' ? plen : 1;
+    return q;
+}
+
+// rows (lines that are not blank) in [p, end)
+static long csv_count_rows(const char *p, const char *end){
+    long rows = 0;
+    while(p < end){
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        if(!nl) nl = end;
+        for(; p < nl; p++){
+            if(!csv_blank(*p)){
+                rows++;
+                break;
+            }
+        }
+        p = nl + 1;
+    }
+    return rows;
+}
+
+// parses the rows of [p, end) into t from row `row` on; returns the index of the first bad row or -1
+static long csv_parse_rows(const char *p, const char *end, const char *point, Tensor *t, long row, int cols){
+    while(p < end){
+        while(p < end && csv_blank(*p)) p++;
+        if(p < end && *p == '\n'){
+            p++;
+            continue;
+        }
+        if(p >= end) break;
+        size_t at = (size_t)row * cols;
+        for(int c=0; c<cols; c++){
+            double v;
+            const char *next = csv_number(p, end, point, &v);
+            if(!next) return row;
+            switch(t->dtype){
+                case FLOAT32: t->data.float32[at + c] = (float)v; break;
+                case FLOAT64: t->data.float64[at + c] = v; break;
+                case INT: t->data.Int[at + c] = (int)v; break;
+            }
+            p = next;
+            while(p < end && csv_blank(*p)) p++;
+            if(c < cols - 1){
+                if(p >= end || *p != ',') return row;
+                p++;
+                while(p < end && csv_blank(*p)) p++;
+            }
+        }
+        if(p < end && *p != '\n') return row;
+        p++;
+        row++;
+    }
+    return -1;
+}
+
+// reads a CSV file of numbers into a [rows, cols] tensor of `dtype`; every row holds as many values as the first
+// and `header` skips the first line
+Tensor * csv_load(const char *path, DType dtype, bool header){
+    FILE *f = fopen(path, "rb");
+    if(!f){
+        fprintf(stderr, "csv_load: cannot open %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f);
+    const char *text = NULL;
+#ifndef _WIN32
+    if(bytes > 0){
+        void *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        text = map == MAP_FAILED ? NULL : (const char *)map;
+    }
+#else
+    char *copy = bytes > 0 ? (char *)malloc(bytes) : NULL;
+    rewind(f);
+    if(copy && fread(copy, 1, bytes, f) != (size_t)bytes){
+        free(copy);
+        copy = NULL;
+    }
+    text = copy;
+#endif
+    fclose(f);
+    if(!text){
+        fprintf(stderr, bytes > 0 ? "csv_load: cannot read %s\n" : "csv_load: %s is empty\n", path);
+        return NULL;
+    }
+
+    const char *begin = text, *end = text + bytes;
+    if(header){
+        const char *nl = (const char *)memchr(begin, '\n', end - begin);
+        begin = nl ? nl + 1 : end;
+    }
+    while(begin < end && (csv_blank(*begin) || *begin == '\n')) begin++;
+    int cols = begin < end;
+    for(const char *q = begin; q < end && *q != '\n'; q++) cols += *q == ',';
+
+    // chunk k covers [start[k], start[k + 1]); every start but the first is moved past a newline
+    int chunks = (int)(bytes / CSV_CHUNK_BYTES) + 1;
+    const char **start = (const char **)malloc((chunks + 1) * sizeof(char *));
+    long *rows = (long *)malloc((chunks + 1) * sizeof(long));
+    Tensor *t = NULL;
+    if(start && rows){
+        start[0] = begin;
+        for(int k=1; k<=chunks; k++){
+            const char *s = k == chunks ? end : begin + (end - begin) * (size_t)k / chunks;
+            if(k < chunks){
+                const char *nl = (const char *)memchr(s - 1, '\n', end - (s - 1));
+                s = nl ? nl + 1 : end;
+            }
+            start[k] = s < start[k - 1] ? start[k - 1] : s;
+        }
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int k=0; k<chunks; k++) rows[k + 1] = csv_count_rows(start[k], start[k + 1]);
+        rows[0] = 0;
+        for(int k=0; k<chunks; k++) rows[k + 1] += rows[k];
+
+        long total = rows[chunks];
+        if(total == 0 || (double)total * cols > 2147483647.0){
+            fprintf(stderr, total ? "csv_load: %s is too large for one tensor\n" : "csv_load: %s has no rows\n", path);
+        }else{
+            t = tensor(NULL, dtype, (int[]){(int)total, cols}, false);
+        }
+        if(t){
+            // localeconv() is not thread safe; read it here, not per token
+            char point[8] = ".";
+            const char *lp = localeconv()->decimal_point;
+            if(lp && *lp && strlen(lp) < sizeof(point)) strcpy(point, lp);
+            long bad = -1;
+            #pragma omp parallel for schedule(dynamic, 1)
+            for(int k=0; k<chunks; k++){
+                long b = csv_parse_rows(start[k], start[k + 1], point, t, rows[k], cols);
+                if(b >= 0){
+                    #pragma omp critical
+                    if(bad < 0 || b < bad) bad = b;
+                }
+            }
+            if(bad >= 0){
+                fprintf(stderr, "csv_load: row %ld of %s does not hold %d numbers\n", bad + 1, path, cols);
+                t_release(t);
+                t = NULL;
+            }
+        }
+    }else{
+        fprintf(stderr, "Memory allocation for csv_load failed\n");
+    }
+    free(start);
+    free(rows);
+#ifndef _WIN32
+    munmap((void *)text, bytes);
+#else
+    free((void *)text);
+#endif
+    return t;
+}
+
+// data loading
+// A Dataset is a row-major table of `rows` x `cols` values of one dtype: a binary file mapped into memory, a CSV
+// file parsed into memory, or an array the caller keeps. A DataLoader cuts it into batches of `batch_size` rows,
+// in a fresh random order every epoch if asked to, with the last `target_cols` columns of every row going to the
+// targets. The last incomplete batch of an epoch is dropped, so every batch has the same shape. Batches are
+// assembled into a ring of preallocated tensors (one more slot than workers: two, double buffered, with a single
+// worker) which background threads fill ahead of the consumer; the training loop only waits when it outruns them.
+// Batches are numbered across epochs and the workers run on past the end of one: epoch e reads its order from
+// buffer e & 1, which a worker shuffles as soon as every batch of epoch e - 2 is released.
+typedef enum{
+    DATA_BORROWED,  // the caller's array
+    DATA_OWNED,     // allocated by the dataset
+    DATA_MAPPED     // a file mapping
+} DataSource;
+
+typedef struct{
+    void *data;
+    DType dtype;
+    long rows;
+    int cols;
+    DataSource source;
+    size_t bytes;   // length of the mapping
+} Dataset;
+
+typedef struct{
+    Dataset *ds;
+    int batch_size, target_cols, num_workers, slots;
+    bool shuffle;
+    uint64_t rng;
+    long *order;                  // row at every position, for two epochs: [2, rows]
+    long num_batches;             // per epoch
+    long claimed, consumed, released; // batches since the start, over all epochs
+    long shuffled;                // epochs whose order is ready
+    bool shuffling;               // a worker is building the order of epoch `shuffled`
+    bool boundary;                // the last batch of an epoch was handed out; the next call returns false
+    long *ready;                  // batch held by every slot, -1 while it is being filled
+    Tensor **x, **y;              // inputs and targets of every slot
+    int held;                     // slot the consumer is reading, -1 if none
+    bool stop;
+#if LOADER_THREADS
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} DataLoader;
+
+static Dataset * dataset_new(void *data, DType dtype, long rows, int cols, DataSource source, size_t bytes){
+    Dataset *ds = (Dataset *)malloc(sizeof(Dataset));
+    if(!ds){
+        fprintf(stderr, "Memory allocation for dataset failed\n");
+        return NULL;
+    }
+    *ds = (Dataset){data, dtype, rows, cols, source, bytes};
+    return ds;
+}
+
+// wraps rows x cols values the caller owns; they must outlive the dataset
+Dataset * dataset_from_memory(void *data, DType dtype, long rows, int cols){
+    if(!data || rows <= 0 || cols <= 0){
+        fprintf(stderr, "dataset_from_memory: empty data\n");
+        return NULL;
+    }
+    return dataset_new(data, dtype, rows, cols, DATA_BORROWED, 0);
+}
+
+// a file of raw row-major values with `cols` values per row, mapped read-only (read into memory on Windows)
+Dataset * dataset_open_binary(const char *path, DType dtype, int cols){
+    FILE *f = fopen(path, "rb");
+    if(!f || cols <= 0){
+        fprintf(stderr, "dataset_open_binary: cannot open %s\n", path);
+        if(f) fclose(f);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f);
+    size_t row_bytes = (size_t)cols * dtype_size(dtype);
+    if(bytes <= 0 || bytes % row_bytes){
+        fprintf(stderr, "dataset_open_binary: %s holds %ld bytes, not a whole number of %zu byte rows\n", path, bytes, row_bytes);
+        fclose(f);
+        return NULL;
+    }
+#ifndef _WIN32
+    void *data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    fclose(f);
+    if(data == MAP_FAILED){
+        fprintf(stderr, "dataset_open_binary: cannot map %s\n", path);
+        return NULL;
+    }
+    Dataset *ds = dataset_new(data, dtype, bytes / row_bytes, cols, DATA_MAPPED, bytes);
+    if(!ds) munmap(data, bytes);
+#else
+    void *data = malloc(bytes);
+    rewind(f);
+    if(!data || fread(data, 1, bytes, f) != (size_t)bytes){
+        fprintf(stderr, "dataset_open_binary: cannot read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    Dataset *ds = dataset_new(data, dtype, bytes / row_bytes, cols, DATA_OWNED, bytes);
+    if(!ds) free(data);
+#endif
+    return ds;
+}
+
+// a CSV file of numbers read with csv_load()
+Dataset * dataset_open_csv(const char *path, DType dtype, bool header){
+    Tensor *t = csv_load(path, dtype, header);
+    if(!t) return NULL;
+    Dataset *ds = dataset_new(t->data.raw_data, dtype, t->dims[0], t->dims[1], DATA_OWNED, 0);
+    // the dataset keeps the values
+    if(ds) t->data.raw_data = NULL;
+    t_release(t);
+    return ds;
+}
+
+void dataset_free(Dataset *ds){
+    if(!ds) return;
+#ifndef _WIN32
+    if(ds->source == DATA_MAPPED) munmap(ds->data, ds->bytes);
+#endif
+    if(ds->source == DATA_OWNED) free(ds->data);
+    free(ds);
+}
+
+static uint64_t loader_seed_state = 0x2545f4914f6cdd1dULL;
+
+// seeds the shuffling of the loaders created from now on
+void dataloader_seed(uint64_t seed){
+    loader_seed_state = seed;
+}
+
+// splitmix64
+static uint64_t loader_random(uint64_t *state){
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// n values of dtype `from` into dst from element `at` on, converted if the dtypes differ
+static void loader_copy(Tensor *dst, size_t at, const char *src, DType from, int n){
+    if(dst->dtype == from){
+        memcpy((char *)dst->data.raw_data + at * dtype_size(from), src, n * dtype_size(from));
+        return;
+    }
+    for(int i=0; i<n; i++){
+        double v = from == FLOAT32 ? ((const float *)src)[i] : from == FLOAT64 ? ((const double *)src)[i] : ((const int *)src)[i];
+        switch(dst->dtype){
+            case FLOAT32: dst->data.float32[at + i] = (float)v; break;
+            case FLOAT64: dst->data.float64[at + i] = v; break;
+            case INT: dst->data.Int[at + i] = (int)v; break;
+        }
+    }
+}
+
+static long * loader_order(DataLoader *dl, long epoch){
+    return dl->order + (epoch & 1) * dl->ds->rows;
+}
+
+static void loader_fill(DataLoader *dl, long batch, int slot){
+    Dataset *ds = dl->ds;
+    size_t es = dtype_size(ds->dtype);
+    int features = ds->cols - dl->target_cols;
+    const long *order = loader_order(dl, batch / dl->num_batches) + (batch % dl->num_batches) * dl->batch_size;
+    for(int r=0; r<dl->batch_size; r++){
+        const char *row = (const char *)ds->data + (size_t)order[r] * ds->cols * es;
+        loader_copy(dl->x[slot], (size_t)r * features, row, ds->dtype, features);
+        if(dl->target_cols) loader_copy(dl->y[slot], (size_t)r * dl->target_cols, row + features * es, ds->dtype, dl->target_cols);
+    }
+}
+
+// the next epoch's order (Fisher-Yates over the one its buffer held two epochs ago); one shuffle runs at a time
+static void loader_shuffle(DataLoader *dl){
+    long *order = loader_order(dl, dl->shuffled);
+    for(long i=dl->ds->rows-1; i>0; i--){
+        long j = (long)(((loader_random(&dl->rng) >> 32) * (uint64_t)(i + 1)) >> 32);
+        long tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+// the buffer of epoch `shuffled` is free once no batch of two epochs before it can still be read
+static bool loader_can_shuffle(DataLoader *dl){
+    return dl->shuffle && !dl->shuffling && dl->released >= (dl->shuffled - 1) * dl->num_batches;
+}
+
+static bool loader_can_claim(DataLoader *dl){
+    return dl->claimed < dl->released + dl->slots && (!dl->shuffle || dl->claimed / dl->num_batches < dl->shuffled);
+}
+
+#if LOADER_THREADS
+// claims the next batch whose slot is free, fills it outside the lock and publishes it; when no slot is free it
+// shuffles the order of the next epoch instead
+static void *loader_worker(void *arg){
+    DataLoader *dl = (DataLoader *)arg;
+    pthread_mutex_lock(&dl->lock);
+    for(;;){
+        while(!dl->stop && !loader_can_claim(dl) && !loader_can_shuffle(dl)) pthread_cond_wait(&dl->cond, &dl->lock);
+        if(dl->stop) break;
+        if(loader_can_claim(dl)){
+            long batch = dl->claimed++;
+            int slot = batch % dl->slots;
+            pthread_mutex_unlock(&dl->lock);
+            loader_fill(dl, batch, slot);
+            pthread_mutex_lock(&dl->lock);
+            dl->ready[slot] = batch;
+        }else{
+            dl->shuffling = true;
+            pthread_mutex_unlock(&dl->lock);
+            loader_shuffle(dl);
+            pthread_mutex_lock(&dl->lock);
+            dl->shuffling = false;
+            dl->shuffled++;
+        }
+        pthread_cond_broadcast(&dl->cond);
+    }
+    pthread_mutex_unlock(&dl->lock);
+    return NULL;
+}
+#endif
+
+void dataloader_free(DataLoader *dl);
+
+// batches of `batch_size` rows converted to `dtype`; the last `target_cols` columns of every row are the targets
+// (none if 0). `num_workers` threads prefetch batches (0 assembles each batch in dataloader_next)
+DataLoader * dataloader_create(Dataset *ds, int batch_size, int target_cols, DType dtype, bool shuffle, int num_workers){
+    if(!ds || batch_size <= 0 || batch_size > ds->rows || target_cols < 0 || target_cols >= ds->cols){
+        fprintf(stderr, "dataloader_create: cannot make batches of %d rows with %d target columns\n", batch_size, target_cols);
+        return NULL;
+    }
+#if !LOADER_THREADS
+    num_workers = 0;
+#endif
+    DataLoader *dl = (DataLoader *)calloc(1, sizeof(DataLoader));
+    if(!dl){
+        fprintf(stderr, "Memory allocation for data loader failed\n");
+        return NULL;
+    }
+    dl->ds = ds;
+    dl->batch_size = batch_size;
+    dl->target_cols = target_cols;
+    dl->num_workers = num_workers > 0 ? num_workers : 0;
+    dl->slots = dl->num_workers + 1 > 2 ? dl->num_workers + 1 : 2;
+    dl->shuffle = shuffle;
+    dl->rng = loader_random(&loader_seed_state);
+    dl->num_batches = ds->rows / batch_size;
+    dl->held = -1;
+#if LOADER_THREADS
+    pthread_mutex_init(&dl->lock, NULL);
+    pthread_cond_init(&dl->cond, NULL);
+#endif
+    dl->order = (long *)malloc(2 * ds->rows * sizeof(long));
+    dl->ready = (long *)malloc(dl->slots * sizeof(long));
+    dl->x = (Tensor **)calloc(dl->slots, sizeof(Tensor *));
+    dl->y = (Tensor **)calloc(dl->slots, sizeof(Tensor *));
+    bool ok = dl->order && dl->ready && dl->x && dl->y;
+    for(int s=0; s<dl->slots && ok; s++){
+        dl->x[s] = tensor(NULL, dtype, (int[]){batch_size, ds->cols - target_cols}, false);
+        if(target_cols) dl->y[s] = tensor(NULL, dtype, (int[]){batch_size, target_cols}, false);
+        ok = dl->x[s] && (!target_cols || dl->y[s]);
+    }
+    if(!ok){
+        fprintf(stderr, "Memory allocation for data loader failed\n");
+        dataloader_free(dl);
+        return NULL;
+    }
+    for(long i=0; i<2 * ds->rows; i++) dl->order[i] = i % ds->rows;
+    for(int s=0; s<dl->slots; s++) dl->ready[s] = -1;
+    if(shuffle) loader_shuffle(dl);
+    dl->shuffled = 1;
+#if LOADER_THREADS
+    if(dl->num_workers > 0){
+        dl->workers = (pthread_t *)malloc(dl->num_workers * sizeof(pthread_t));
+        int started = 0;
+        while(dl->workers && started < dl->num_workers && pthread_create(&dl->workers[started], NULL, loader_worker, dl) == 0) started++;
+        if(started < dl->num_workers){
+            fprintf(stderr, "dataloader_create: started %d of %d workers\n", started, dl->num_workers);
+            dl->num_workers = started;
+        }
+    }
+#endif
+    return dl;
+}
+
+// hands out the next batch of the epoch in *x (and *y); the tensors belong to the loader and are refilled once the
+// following call returns, so they must not be kept across calls. Returns false at the end of an epoch; the call
+// after that starts the next one.
+bool dataloader_next(DataLoader *dl, Tensor **x, Tensor **y){
+    if(!dl) return false;
+#if LOADER_THREADS
+    pthread_mutex_lock(&dl->lock);
+#endif
+    if(dl->held >= 0){
+        dl->released++;
+        dl->held = -1;
+    }
+    bool more = !dl->boundary;
+    if(!more){
+        // the workers have moved on to the next epoch already
+        dl->boundary = false;
+    }else{
+        long batch = dl->consumed++;
+        dl->boundary = dl->consumed % dl->num_batches == 0;
+        dl->held = batch % dl->slots;
+        if(dl->num_workers == 0){
+            if(dl->shuffle && batch / dl->num_batches >= dl->shuffled){
+                loader_shuffle(dl);
+                dl->shuffled++;
+            }
+            loader_fill(dl, batch, dl->held);
+            dl->ready[dl->held] = batch;
+        }
+#if LOADER_THREADS
+        while(dl->ready[dl->held] != batch) pthread_cond_wait(&dl->cond, &dl->lock);
+#endif
+        *x = dl->x[dl->held];
+        if(y) *y = dl->y[dl->held];
+    }
+#if LOADER_THREADS
+    pthread_cond_broadcast(&dl->cond);
+    pthread_mutex_unlock(&dl->lock);
+#endif
+    return more;
+}
+
+void dataloader_free(DataLoader *dl){
+    if(!dl) return;
+#if LOADER_THREADS
+    pthread_mutex_lock(&dl->lock);
+    dl->stop = true;
+    pthread_cond_broadcast(&dl->cond);
+    pthread_mutex_unlock(&dl->lock);
+    for(int i=0; i<dl->num_workers && dl->workers; i++) pthread_join(dl->workers[i], NULL);
+    free(dl->workers);
+    pthread_mutex_destroy(&dl->lock);
+    pthread_cond_destroy(&dl->cond);
+#endif
+    for(int s=0; s<dl->slots; s++){
+        if(dl->x) t_release(dl->x[s]);
+        if(dl->y) t_release(dl->y[s]);
+    }
+    free(dl->x);
+    free(dl->y);
+    free(dl->order);
+    free(dl->ready);
+    free(dl);
+}
+
 #endif